@@ -0,0 +1,257 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+/*
+ * Replays identify responses through the DCP frame parsing path and reports
+ * the parse rate. Frames come from the files given on the command line (one
+ * raw Ethernet frame per file, as in bench/corpus) plus a set of responses
+ * built here.
+ *
+ * usage: bench_parse [-n iterations] [frame files...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "common.h"
+
+#define BENCH_MAX_FRAMES 256
+#define BENCH_ITERATIONS 200000
+
+/* Preamble, SFD, FCS and inter frame gap, added to every frame on the wire */
+#define BENCH_WIRE_OVERHEAD 24
+#define BENCH_LINE_RATE 1000000000.0
+
+struct bench_frame
+{
+    char buf[ETH_FRAME_LEN];
+    ssize_t len;
+};
+
+static struct bench_frame frames[BENCH_MAX_FRAMES];
+static int frame_count = 0;
+
+static volatile unsigned long bench_sink;
+
+static int bench_add_block(char *buf, int pos, uint8_t option, uint8_t suboption,
+                           const void *data, uint16_t len)
+{
+    struct pn_dcp_block_header *blk = (struct pn_dcp_block_header *)(buf + pos);
+
+    blk->h_option = option;
+    blk->h_suboption = suboption;
+    blk->h_block_length = htons(len + 2);
+    memset(buf + pos + sizeof(*blk), 0, 2); // BlockInfo
+    memcpy(buf + pos + sizeof(*blk) + 2, data, len);
+
+    pos += sizeof(*blk) + 2 + len;
+    if (pos % 2)
+        buf[pos++] = 0;
+
+    return pos;
+}
+
+/* Build an identify response with a station name of name_len characters */
+static void bench_build_response(int tagged, int name_len)
+{
+    struct bench_frame *f = &frames[frame_count++];
+    char *buf = f->buf;
+    int pos;
+    uint8_t ip[12] = {192, 168, 0, 10, 255, 255, 255, 0, 192, 168, 0, 1};
+    uint8_t ids[4] = {0x00, 0x2a, 0x03, 0x13};
+    uint8_t role[2] = {0x02, 0x00};
+    char name[PN_DCP_NAME_OF_STATION_MAX];
+
+    memset(buf, 0, sizeof(f->buf));
+    memcpy(buf, "\x02\xfc\x00\x00\x00\x01", ETH_ALEN);
+    memcpy(buf + ETH_ALEN, "\x00\x1b\x1b\x10\x00\x01", ETH_ALEN);
+    pos = 2 * ETH_ALEN;
+
+    if (tagged)
+    {
+        *(uint16_t *)(buf + pos) = htons(ETH_P_8021Q);
+        *(uint16_t *)(buf + pos + 2) = htons(42);
+        pos += 4;
+    }
+
+    *(uint16_t *)(buf + pos) = htons(ETH_P_PROFINET);
+    pos += 2;
+
+    struct pn_header *pn_hdr = (struct pn_header *)(buf + pos);
+    pn_hdr->h_frame_id = htons(PN_FRAME_ID_RTA_DCP_RESPONSE);
+    pos += sizeof(*pn_hdr);
+
+    struct pn_dcp_header *pn_dcp_hdr = (struct pn_dcp_header *)(buf + pos);
+    pn_dcp_hdr->h_service_id = PN_DCP_SERVICE_ID_IDENTIFY;
+    pn_dcp_hdr->h_service_type = PN_DCP_SERVICE_TYPE_RESPONSE_SUCCESS;
+    pn_dcp_hdr->h_xid = htonl(0x42424242);
+    pos += sizeof(*pn_dcp_hdr);
+
+    int data_start = pos;
+
+    memset(name, 'a' + name_len % 26, name_len);
+    pos = bench_add_block(buf, pos, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                          PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_CUSTOM, "ET200SP", 7);
+    pos = bench_add_block(buf, pos, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                          PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME, name, name_len);
+    pos = bench_add_block(buf, pos, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                          PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_ID, ids, sizeof(ids));
+    pos = bench_add_block(buf, pos, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                          PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_ROLE, role, sizeof(role));
+    pos = bench_add_block(buf, pos, PN_DCP_BLOCK_OPTION_ADDR,
+                          PN_DCP_BLOCK_SUBOPTION_ADDR_IP, ip, sizeof(ip));
+
+    pn_dcp_hdr->h_dcp_data_length = htons(pos - data_start);
+
+    f->len = pos < ETH_ZLEN ? ETH_ZLEN : pos;
+}
+
+static int bench_load_file(const char *path)
+{
+    struct bench_frame *f = &frames[frame_count];
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    f->len = fread(f->buf, 1, sizeof(f->buf), fp);
+    fclose(fp);
+
+    if (f->len <= 0)
+    {
+        fprintf(stderr, "%s: empty frame\n", path);
+        return -1;
+    }
+
+    frame_count++;
+    return 0;
+}
+
+static double bench_elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/* The discovery path: header checks, then the identify data */
+static void bench_parse_identify(long iterations)
+{
+    struct pn_dcp_identify_response_data data;
+    unsigned long parsed = 0;
+
+    for (long i = 0; i < iterations; i++)
+    {
+        struct bench_frame *f = &frames[i % frame_count];
+        struct pn_dcp_header *pn_dcp_hdr = pnt_get_dcp_header(f->buf, f->len, NULL, PN_FRAME_ID_RTA_DCP_RESPONSE);
+        if (pn_dcp_hdr == NULL)
+            continue;
+
+        memset(&data, 0, sizeof(data));
+        pnt_parse_dcp_response_blocks(pn_dcp_hdr, &data);
+        parsed += data.device_ip_addr[3] + data.device_stationname[0];
+    }
+
+    bench_sink = parsed;
+}
+
+/* Header checks and the block views only, without copying anything out */
+static void bench_parse_views(long iterations)
+{
+    struct pnt_dcp_block_view views[PNT_DCP_MAX_BLOCKS];
+    unsigned long parsed = 0;
+
+    for (long i = 0; i < iterations; i++)
+    {
+        struct bench_frame *f = &frames[i % frame_count];
+        struct pn_dcp_header *pn_dcp_hdr = pnt_get_dcp_header(f->buf, f->len, NULL, PN_FRAME_ID_RTA_DCP_RESPONSE);
+        if (pn_dcp_hdr == NULL)
+            continue;
+
+        parsed += pnt_dcp_parse_blocks(pn_dcp_hdr, 1, views, PNT_DCP_MAX_BLOCKS);
+    }
+
+    bench_sink = parsed;
+}
+
+/* Returns the measured rate as a multiple of the 1 Gbit/s burst rate */
+static double bench_run(const char *name, void (*fn)(long), long iterations, double wire_fps)
+{
+    struct timespec start, end;
+
+    fn(iterations / 10); // warm up caches and branch predictors
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fn(iterations);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = bench_elapsed_ns(&start, &end);
+    double fps = iterations / (ns / 1e9);
+
+    printf("%-10s %12.0f frames/s %8.1f ns/frame %8.1fx line rate\n",
+           name, fps, ns / iterations, fps / wire_fps);
+
+    return fps / wire_fps;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = BENCH_ITERATIONS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [frame files...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "E: iterations must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_build_response(0, 12);
+    bench_build_response(1, 12);
+    bench_build_response(0, 64);
+    bench_build_response(0, PN_DCP_NAME_OF_STATION_MAX);
+
+    for (int i = optind; i < argc && frame_count < BENCH_MAX_FRAMES; i++)
+    {
+        if (bench_load_file(argv[i]) < 0)
+            return EXIT_FAILURE;
+    }
+
+    /* A burst of these frames back to back fills the link at this rate */
+    double bytes = 0;
+    for (int i = 0; i < frame_count; i++)
+        bytes += frames[i].len + BENCH_WIRE_OVERHEAD;
+    double wire_fps = BENCH_LINE_RATE / (bytes / frame_count * 8);
+
+    printf("%d frames, %.0f bytes average, 1 Gbit/s burst is %.0f frames/s\n",
+           frame_count, bytes / frame_count - BENCH_WIRE_OVERHEAD, wire_fps);
+
+    double identify = bench_run("identify", bench_parse_identify, iterations, wire_fps);
+    bench_run("views", bench_parse_views, iterations, wire_fps);
+
+    if (identify < 1.0)
+    {
+        fprintf(stderr, "E: the identify parse path does not keep up with a 1 Gbit/s burst\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
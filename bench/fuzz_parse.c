@@ -0,0 +1,118 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+/*
+ * Fuzz entry point for the DCP frame parsing path. Built with
+ * -fsanitize=fuzzer it is a libFuzzer target; built with
+ * -DPNT_FUZZ_STANDALONE it reads one frame per file given on the command
+ * line (or stdin), which is what AFL and crash replays need.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+static void fuzz_views(const struct pn_dcp_header *pn_dcp_hdr, int has_blockinfo)
+{
+    struct pnt_dcp_block_view views[PNT_DCP_MAX_BLOCKS];
+    char str[PN_DCP_VENDOR_VALUE_MAX + 1];
+    uint8_t options[PNT_DCP_MAX_BLOCKS][2];
+    uint8_t mac[ETH_ALEN], addr[4], mask[4], gateway[4], role, high, low;
+    uint16_t vendor, device;
+
+    int count = pnt_dcp_parse_blocks(pn_dcp_hdr, has_blockinfo, views, PNT_DCP_MAX_BLOCKS);
+    for (int i = 0; i < count; i++)
+    {
+        const struct pnt_dcp_block_view *view = &views[i];
+
+        pnt_dcp_view_data(pn_dcp_hdr, view);
+        pnt_dcp_view_string(pn_dcp_hdr, view, str, sizeof(str));
+        pnt_dcp_view_string(pn_dcp_hdr, view, str, 1);
+        pnt_dcp_view_mac(pn_dcp_hdr, view, mac);
+        pnt_dcp_view_ip(pn_dcp_hdr, view, addr, mask, gateway);
+        pnt_dcp_view_device_id(pn_dcp_hdr, view, &vendor, &device);
+        pnt_dcp_view_role(pn_dcp_hdr, view, &role);
+        pnt_dcp_view_instance(pn_dcp_hdr, view, &high, &low);
+        pnt_dcp_view_device_options(pn_dcp_hdr, view, options, PNT_DCP_MAX_BLOCKS);
+    }
+
+    pnt_dcp_find_block(views, count, PN_DCP_BLOCK_OPTION_DEV_PROPS, PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct pn_dcp_identify_response_data pn_dcp_data;
+    uint8_t if_addr[ETH_ALEN] = {0x02, 0xfc, 0x00, 0x00, 0x00, 0x01};
+
+    if (size > ETH_FRAME_LEN)
+        return 0;
+
+    /* An exact size copy, so reads past the frame hit the redzone */
+    char *buf = malloc(size ? size : 1);
+    if (buf == NULL)
+        return 0;
+    memcpy(buf, data, size);
+
+    pnt_get_dcp_header(buf, size, if_addr, PN_FRAME_ID_RTA_DCP_RESPONSE);
+
+    struct pn_dcp_header *pn_dcp_hdr = pnt_get_dcp_header(buf, size, NULL, 0);
+    if (pn_dcp_hdr != NULL)
+    {
+        memset(&pn_dcp_data, 0, sizeof(pn_dcp_data));
+        pnt_parse_dcp_response_blocks(pn_dcp_hdr, &pn_dcp_data);
+
+        fuzz_views(pn_dcp_hdr, 1);
+        fuzz_views(pn_dcp_hdr, 0);
+    }
+
+    free(buf);
+    return 0;
+}
+
+#ifdef PNT_FUZZ_STANDALONE
+
+static int fuzz_file(FILE *fp, const char *name)
+{
+    uint8_t data[ETH_FRAME_LEN];
+
+    size_t size = fread(data, 1, sizeof(data), fp);
+    if (ferror(fp))
+    {
+        perror(name);
+        return -1;
+    }
+
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = EXIT_SUCCESS;
+
+    if (argc < 2)
+        return fuzz_file(stdin, "stdin") < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *fp = fopen(argv[i], "rb");
+        if (fp == NULL)
+        {
+            perror(argv[i]);
+            ret = EXIT_FAILURE;
+            continue;
+        }
+
+        if (fuzz_file(fp, argv[i]) < 0)
+            ret = EXIT_FAILURE;
+        fclose(fp);
+    }
+
+    return ret;
+}
+
+#endif
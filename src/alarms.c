@@ -0,0 +1,523 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "alarms.h"
+
+static volatile sig_atomic_t pnt_alarms_stop = 0;
+
+static const struct pnt_frame_id_range pnt_alarms_frame_ids[] = {
+    {PN_FRAME_ID_RTA_ALARM_HI, PN_FRAME_ID_RTA_ALARM_HI},
+    {PN_FRAME_ID_RTA_ALARM_LO, PN_FRAME_ID_RTA_ALARM_LO},
+};
+
+static const char *pnt_alarms_types[] = {
+    [0x0001] = "diagnosis",
+    [0x0002] = "process",
+    [0x0003] = "pull",
+    [0x0004] = "plug",
+    [0x0005] = "status",
+    [0x0006] = "update",
+    [0x0007] = "media_redundancy",
+    [0x0008] = "controlled_by_supervisor",
+    [0x0009] = "released",
+    [0x000A] = "plug_wrong_submodule",
+    [0x000B] = "return_of_submodule",
+    [0x000C] = "diagnosis_disappears",
+    [0x000D] = "multicast_mismatch",
+    [0x000E] = "port_data_change",
+    [0x000F] = "sync_data_changed",
+    [0x0010] = "isochronous_mode_problem",
+    [0x0011] = "network_component_problem",
+    [0x0012] = "time_data_changed",
+    [0x0013] = "dfp_problem",
+    [0x0014] = "mrpd_problem",
+    [0x0016] = "multiple_interface_mismatch",
+    [0x001E] = "upload_and_retrieval",
+    [0x001F] = "pull_module",
+};
+
+static const char *pnt_alarms_pdu_types[] = {
+    [PN_RTA_PDU_TYPE_DATA] = "DATA",
+    [PN_RTA_PDU_TYPE_NACK] = "NACK",
+    [PN_RTA_PDU_TYPE_ACK] = "ACK",
+    [PN_RTA_PDU_TYPE_ERR] = "ERR",
+};
+
+static void
+pnt_alarms_print_usage(const char *progname)
+{
+    fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
+    fprintf(stderr, "usage: %s alarms -i <iface> [-h] [-v] [-d] [-o] [-a] [-f <format>]\n\n", progname);
+    fprintf(stderr, "Passively capture Profinet RTA alarms (e.g. on a mirror port) and print them as they happen\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "   -h          Show this help\n");
+    fprintf(stderr, "   -i iface    The interface to listen on, it is put in promiscuous mode while running\n");
+    fprintf(stderr, "   -f format   Output format: tsv|ndjson (default=tsv)\n");
+    fprintf(stderr, "   -a          Also print the transport ACK and NACK PDUs\n");
+    fprintf(stderr, "   -o          Print the header of the tsv fields\n");
+    fprintf(stderr, "   -v          Be verbose\n");
+    fprintf(stderr, "   -d          Show debug information, including the capture to output latency\n");
+    fprintf(stderr, "\nEvery alarm PDU is written out with one write() as soon as it is received.\n");
+    fprintf(stderr, "tsv fields are <time> <src> <dst> <priority> <pdu> <send seq> <ack seq> <block> <alarm type>\n");
+    fprintf(stderr, "<api> <slot> <subslot> <module ident> <submodule ident> <alarm seq> <diagnosis> <user structure>\n");
+    fprintf(stderr, "<pnio status>, \"-\" when the PDU does not have the field.\n");
+}
+
+static void
+pnt_alarms_signal(int sig)
+{
+    (void)sig;
+    pnt_alarms_stop = 1;
+}
+
+static const char *
+pnt_alarms_type_name(uint16_t type)
+{
+    if (type < sizeof(pnt_alarms_types) / sizeof(pnt_alarms_types[0]) && pnt_alarms_types[type] != NULL)
+        return pnt_alarms_types[type];
+    return type >= 0x0100 && type <= 0x7fff ? "manufacturer_specific" : "reserved";
+}
+
+/* The decoded fields of one alarm PDU, whatever its type carries */
+struct pnt_alarm_event
+{
+    const struct timespec *ts;
+    const uint8_t *src;
+    const uint8_t *dst;
+    int high;
+    uint8_t pdu_type;
+    uint16_t send_seq;
+    uint16_t ack_seq;
+    const char *block; //NULL without an alarm block
+    uint16_t alarm_type;
+    uint32_t api;
+    uint16_t slot;
+    uint16_t subslot;
+    int has_ident;
+    uint32_t module_ident;
+    uint32_t submodule_ident;
+    int has_specifier;
+    uint16_t specifier;
+    int has_user_structure;
+    uint16_t user_structure;
+    const uint8_t *pnio_status; //NULL when absent
+};
+
+static int
+pnt_alarms_decode(char *buf, ssize_t len, struct pnt_alarm_event *ev)
+{
+    struct ether_header *eh = (struct ether_header *)buf;
+    size_t offset = sizeof(*eh);
+    uint16_t type;
+
+    if (len < (ssize_t)(offset + sizeof(struct vlan_hdr) + sizeof(struct pn_header)))
+        return -1;
+
+    type = ntohs(eh->ether_type);
+    if (type == ETH_P_8021Q)
+    {
+        type = ntohs(((struct vlan_hdr *)(buf + offset))->h_vlan_encapsulated_proto);
+        offset += sizeof(struct vlan_hdr);
+    }
+    if (type != ETH_P_PROFINET)
+        return -1;
+
+    uint16_t frame_id = ntohs(((struct pn_header *)(buf + offset))->h_frame_id);
+    if (frame_id != PN_FRAME_ID_RTA_ALARM_HI && frame_id != PN_FRAME_ID_RTA_ALARM_LO)
+        return -1;
+    offset += sizeof(struct pn_header);
+
+    if (len < (ssize_t)(offset + sizeof(struct pn_rta_header)))
+        return -1;
+    struct pn_rta_header *rta = (struct pn_rta_header *)(buf + offset);
+    offset += sizeof(*rta);
+
+    size_t var_len = ntohs(rta->h_var_part_len);
+    if (offset + var_len > (size_t)len)
+        return -1;
+
+    ev->src = eh->ether_shost;
+    ev->dst = eh->ether_dhost;
+    ev->high = frame_id == PN_FRAME_ID_RTA_ALARM_HI;
+    ev->pdu_type = rta->h_pdu_type & PN_RTA_PDU_TYPE_MASK;
+    ev->send_seq = ntohs(rta->h_send_seq);
+    ev->ack_seq = ntohs(rta->h_ack_seq);
+
+    if (ev->pdu_type < PN_RTA_PDU_TYPE_DATA || ev->pdu_type > PN_RTA_PDU_TYPE_ERR)
+        return -1;
+
+    if (ev->pdu_type == PN_RTA_PDU_TYPE_ERR)
+    {
+        if (var_len >= 4)
+            ev->pnio_status = (uint8_t *)buf + offset;
+        return 0;
+    }
+
+    if (ev->pdu_type != PN_RTA_PDU_TYPE_DATA || var_len < sizeof(struct pn_block_header))
+        return 0;
+
+    struct pn_block_header *block = (struct pn_block_header *)(buf + offset);
+    size_t block_len = ntohs(block->h_length) + offsetof(struct pn_block_header, h_version_high);
+
+    if (block_len > var_len)
+        return -1;
+
+    switch (ntohs(block->h_type))
+    {
+    case PN_BLOCK_TYPE_ALARM_NOTIFICATION_HIGH:
+    case PN_BLOCK_TYPE_ALARM_NOTIFICATION_LOW:
+    {
+        struct pn_alarm_notification *an = (struct pn_alarm_notification *)block;
+
+        if (block_len < sizeof(*an))
+            return -1;
+
+        ev->block = "notification";
+        ev->alarm_type = ntohs(an->alarm_type);
+        ev->api = ntohl(an->api);
+        ev->slot = ntohs(an->slot);
+        ev->subslot = ntohs(an->subslot);
+        ev->has_ident = 1;
+        ev->module_ident = ntohl(an->module_ident);
+        ev->submodule_ident = ntohl(an->submodule_ident);
+        ev->has_specifier = 1;
+        ev->specifier = ntohs(an->alarm_specifier);
+        if (block_len >= sizeof(*an) + 2)
+        {
+            uint8_t *usi = (uint8_t *)(an + 1);
+
+            ev->has_user_structure = 1;
+            ev->user_structure = usi[0] << 8 | usi[1];
+        }
+        break;
+    }
+    case PN_BLOCK_TYPE_ALARM_ACK_HIGH:
+    case PN_BLOCK_TYPE_ALARM_ACK_LOW:
+    {
+        struct pn_alarm_ack *ack = (struct pn_alarm_ack *)block;
+
+        if (block_len < sizeof(*ack))
+            return -1;
+
+        ev->block = "ack";
+        ev->alarm_type = ntohs(ack->alarm_type);
+        ev->api = ntohl(ack->api);
+        ev->slot = ntohs(ack->slot);
+        ev->subslot = ntohs(ack->subslot);
+        ev->has_specifier = 1;
+        ev->specifier = ntohs(ack->alarm_specifier);
+        ev->pnio_status = ack->pnio_status;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+#define _APPEND(...)                                                 \
+    do                                                               \
+    {                                                                \
+        if (n < size)                                                \
+            n += snprintf(line + n, size - n, __VA_ARGS__);          \
+    } while (0)
+
+static size_t
+pnt_alarms_format_tsv(const struct pnt_alarm_event *ev, char *line, size_t size)
+{
+    size_t n = 0;
+
+    _APPEND("%ld.%06ld\t%02x:%02x:%02x:%02x:%02x:%02x\t%02x:%02x:%02x:%02x:%02x:%02x\t%s\t%s\t%u\t%u",
+            (long)ev->ts->tv_sec, ev->ts->tv_nsec / 1000,
+            ev->src[0], ev->src[1], ev->src[2], ev->src[3], ev->src[4], ev->src[5],
+            ev->dst[0], ev->dst[1], ev->dst[2], ev->dst[3], ev->dst[4], ev->dst[5],
+            ev->high ? "high" : "low", pnt_alarms_pdu_types[ev->pdu_type], ev->send_seq, ev->ack_seq);
+
+    if (ev->block != NULL)
+        _APPEND("\t%s\t%s\t%u\t%u\t%u", ev->block, pnt_alarms_type_name(ev->alarm_type),
+                ev->api, ev->slot, ev->subslot);
+    else
+        _APPEND("\t-\t-\t-\t-\t-");
+
+    if (ev->has_ident)
+        _APPEND("\t0x%08x\t0x%08x", ev->module_ident, ev->submodule_ident);
+    else
+        _APPEND("\t-\t-");
+
+    if (ev->has_specifier)
+    {
+        _APPEND("\t%u\t%s%s%s%s%s", ev->specifier & PN_ALARM_SPECIFIER_SEQUENCE,
+                ev->specifier & PN_ALARM_SPECIFIER_CHANNEL_DIAGNOSIS ? "C" : "",
+                ev->specifier & PN_ALARM_SPECIFIER_MANUFACTURER_DIAGNOSIS ? "M" : "",
+                ev->specifier & PN_ALARM_SPECIFIER_SUBMODULE_DIAGNOSIS ? "S" : "",
+                ev->specifier & PN_ALARM_SPECIFIER_AR_DIAGNOSIS ? "A" : "",
+                ev->specifier & (PN_ALARM_SPECIFIER_CHANNEL_DIAGNOSIS | PN_ALARM_SPECIFIER_MANUFACTURER_DIAGNOSIS |
+                                 PN_ALARM_SPECIFIER_SUBMODULE_DIAGNOSIS | PN_ALARM_SPECIFIER_AR_DIAGNOSIS)
+                    ? ""
+                    : "-");
+    }
+    else
+        _APPEND("\t-\t-");
+
+    if (ev->has_user_structure)
+        _APPEND("\t0x%04x", ev->user_structure);
+    else
+        _APPEND("\t-");
+
+    if (ev->pnio_status != NULL)
+        _APPEND("\t%02x%02x%02x%02x\n", ev->pnio_status[0], ev->pnio_status[1], ev->pnio_status[2], ev->pnio_status[3]);
+    else
+        _APPEND("\t-\n");
+
+    return n < size ? n : size - 1;
+}
+
+static size_t
+pnt_alarms_format_json(const struct pnt_alarm_event *ev, char *line, size_t size)
+{
+    size_t n = 0;
+
+    _APPEND("{\"time\":%ld.%06ld,\"src\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"dst\":\"%02x:%02x:%02x:%02x:%02x:%02x\","
+            "\"priority\":\"%s\",\"pdu\":\"%s\",\"send_seq\":%u,\"ack_seq\":%u",
+            (long)ev->ts->tv_sec, ev->ts->tv_nsec / 1000,
+            ev->src[0], ev->src[1], ev->src[2], ev->src[3], ev->src[4], ev->src[5],
+            ev->dst[0], ev->dst[1], ev->dst[2], ev->dst[3], ev->dst[4], ev->dst[5],
+            ev->high ? "high" : "low", pnt_alarms_pdu_types[ev->pdu_type], ev->send_seq, ev->ack_seq);
+
+    if (ev->block != NULL)
+        _APPEND(",\"block\":\"%s\",\"alarm_type\":\"%s\",\"alarm_type_id\":%u,\"api\":%u,\"slot\":%u,\"subslot\":%u",
+                ev->block, pnt_alarms_type_name(ev->alarm_type), ev->alarm_type, ev->api, ev->slot, ev->subslot);
+
+    if (ev->has_ident)
+        _APPEND(",\"module_ident\":%u,\"submodule_ident\":%u", ev->module_ident, ev->submodule_ident);
+
+    if (ev->has_specifier)
+        _APPEND(",\"alarm_seq\":%u,\"channel_diagnosis\":%s,\"manufacturer_diagnosis\":%s,"
+                "\"submodule_diagnosis\":%s,\"ar_diagnosis\":%s",
+                ev->specifier & PN_ALARM_SPECIFIER_SEQUENCE,
+                ev->specifier & PN_ALARM_SPECIFIER_CHANNEL_DIAGNOSIS ? "true" : "false",
+                ev->specifier & PN_ALARM_SPECIFIER_MANUFACTURER_DIAGNOSIS ? "true" : "false",
+                ev->specifier & PN_ALARM_SPECIFIER_SUBMODULE_DIAGNOSIS ? "true" : "false",
+                ev->specifier & PN_ALARM_SPECIFIER_AR_DIAGNOSIS ? "true" : "false");
+
+    if (ev->has_user_structure)
+        _APPEND(",\"user_structure\":%u", ev->user_structure);
+
+    if (ev->pnio_status != NULL)
+        _APPEND(",\"pnio_status\":\"%02x%02x%02x%02x\"",
+                ev->pnio_status[0], ev->pnio_status[1], ev->pnio_status[2], ev->pnio_status[3]);
+
+    _APPEND("}\n");
+
+    return n < size ? n : size - 1;
+}
+
+#undef _APPEND
+
+static void
+pnt_alarms_handle_frame(char *buf, ssize_t len, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_alarms *al = arg;
+    struct pnt_alarm_event ev;
+    size_t n;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.ts = &info->ts;
+    if (pnt_alarms_decode(buf, len, &ev) < 0)
+    {
+        pnt_stats.parse_errors++;
+        pnt_debug("alarms: malformed alarm frame of %zd bytes", len);
+        return;
+    }
+
+    if (!al->transport && ev.block == NULL &&
+        (ev.pdu_type == PN_RTA_PDU_TYPE_ACK || ev.pdu_type == PN_RTA_PDU_TYPE_NACK))
+        return;
+
+    if (al->format == PNT_OUTPUT_NDJSON)
+        n = pnt_alarms_format_json(&ev, al->line, sizeof(al->line));
+    else
+        n = pnt_alarms_format_tsv(&ev, al->line, sizeof(al->line));
+
+    /* straight to the fd, stdio would hold the line until its buffer fills */
+    for (size_t done = 0; done < n;)
+    {
+        ssize_t ret = write(STDOUT_FILENO, al->line + done, n - done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not write alarm");
+            pnt_alarms_stop = 1;
+            return;
+        }
+        done += ret;
+    }
+
+    if (pnt_get_verbose_level() >= PNT_VERBOSE_DEBUG)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        pnt_debug("alarms: written %.0f us after capture",
+                  (now.tv_sec - info->ts.tv_sec) * 1e6 + (now.tv_nsec - info->ts.tv_nsec) / 1e3);
+    }
+}
+
+static int
+pnt_alarms_enable_rx_timestamps(int sock)
+{
+    int on = 1;
+
+    return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+/* Like pnt_recv_dispatch(), with the kernel receive time of each frame so
+   the event time does not include the wakeup */
+static int
+pnt_alarms_recv(struct pnt_alarms *al)
+{
+    while (!pnt_alarms_stop)
+    {
+        char control[CMSG_SPACE(sizeof(struct timespec))];
+        struct iovec iov = {.iov_base = al->buf, .iov_len = BUF_SIZE};
+        struct msghdr msg;
+        struct pnt_frame_info info;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t received = recvmsg(al->sock, &msg, 0);
+        if (received < 0)
+        {
+            if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+                return 0;
+            perror("Could not receive from socket");
+            return -1;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            memcpy(&info.ts, CMSG_DATA(cmsg), sizeof(info.ts));
+        else
+            clock_gettime(CLOCK_REALTIME, &info.ts);
+        info.vlan_tci = -1;
+
+        pnt_stats.frames_received++;
+        pnt_alarms_handle_frame(al->buf, received, &info, al);
+    }
+
+    return 0;
+}
+
+int pnt_alarms(int argc, char **argv)
+{
+    struct pnt_alarms *al;
+    char *if_name = NULL;
+    int do_headers = 0;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    al = calloc(1, sizeof(*al));
+    if (al == NULL)
+    {
+        perror("Cannot allocate alarm capture state");
+        return EXIT_FAILURE;
+    }
+    al->sock = -1;
+    al->format = PNT_OUTPUT_TSV;
+
+    while ((opt = getopt(argc, argv, "vdoai:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            pnt_set_verbose_level(PNT_VERBOSE_PRINT);
+            break;
+        case 'd':
+            pnt_set_verbose_level(PNT_VERBOSE_DEBUG);
+            break;
+        case 'o':
+            do_headers = 1;
+            break;
+        case 'a':
+            al->transport = 1;
+            break;
+        case 'i':
+            if_name = optarg;
+            break;
+        case 'f':
+            al->format = pnt_output_parse_format(optarg);
+            if (al->format != PNT_OUTPUT_TSV && al->format != PNT_OUTPUT_NDJSON)
+            {
+                fprintf(stderr, "Unsupported alarm format \"%s\"\n", optarg);
+                goto out;
+            }
+            break;
+        default: /* '?' */
+            pnt_alarms_print_usage(argv[0]);
+            goto out;
+        }
+    }
+
+    pnt_print("Parameters: iface[%s] verbose_level[%d] format[%d] transport[%d]",
+              if_name, pnt_get_verbose_level(), al->format, al->transport);
+
+    if (if_name == NULL)
+    {
+        pnt_alarms_print_usage(argv[0]);
+        goto out;
+    }
+
+    /* no ring: a block would hold alarms back for up to PNT_RING_BLOCK_TIMEOUT,
+       and with the filter only the few alarm frames are ever queued */
+    al->sock = open_raw_sock(if_name, al->if_addr, &al->if_index, 0, 0, 1, 1, NULL);
+    if (al->sock < 0)
+    {
+        //error has already been printed
+        goto out;
+    }
+
+    if (pnt_attach_frame_id_filter(al->sock, pnt_alarms_frame_ids, 2) < 0)
+        pnt_print("%s: could not attach socket filter, all frames will be received", if_name);
+    if (pnt_add_promisc_membership(al->sock, al->if_index) < 0)
+        perror("Cannot set promiscuous mode, only alarms to this host will be seen");
+    if (pnt_alarms_enable_rx_timestamps(al->sock) < 0)
+        pnt_print("%s: no kernel receive timestamps, timing from user space", if_name);
+
+    {
+        /* no SA_RESTART, so the blocking recvmsg() returns on a signal */
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = pnt_alarms_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+
+    if (do_headers && al->format == PNT_OUTPUT_TSV)
+    {
+        printf("time\tsrc\tdst\tpriority\tpdu\tsend_seq\tack_seq\tblock\talarm_type\tapi\tslot\tsubslot"
+               "\tmodule_ident\tsubmodule_ident\talarm_seq\tdiagnosis\tuser_structure\tpnio_status\n");
+        fflush(stdout);
+    }
+
+    if (pnt_alarms_recv(al) == 0)
+        ret = EXIT_SUCCESS;
+
+    pnt_print("%lu frames received, %lu malformed", (unsigned long)pnt_stats.frames_received,
+              (unsigned long)pnt_stats.parse_errors);
+
+out:
+    if (al->sock >= 0)
+        close(al->sock);
+    free(al);
+
+    return ret;
+}
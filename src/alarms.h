@@ -0,0 +1,24 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+#include "output.h"
+
+#include <signal.h>
+
+#define PNT_ALARMS_LINE_MAX 1024
+
+struct pnt_alarms
+{
+    enum pnt_output_format format; //tsv or ndjson
+    int transport; //also print the ACK/NACK PDUs without an alarm block
+    int sock;
+    int if_index;
+    uint8_t if_addr[ETH_ALEN];
+    char buf[BUF_SIZE];
+    char line[PNT_ALARMS_LINE_MAX];
+};
+
+int pnt_alarms(int argc, char **argv);
@@ -0,0 +1,177 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "analyze.h"
+
+static void
+pnt_analyze_print_usage(const char *progname)
+{
+    fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
+    fprintf(stderr, "usage: %s analyze -r <capture> [-f <format>] [-v] [-d] [-h] [-o]\n\n", progname);
+    fprintf(stderr, "List the Profinet devices that sent identify responses in a pcap or pcapng capture,\n");
+    fprintf(stderr, "in discovery format plus first seen and last seen timestamps\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -h          Show this help\n");
+    fprintf(stderr, "   -r capture  The capture file to read, Ethernet frames only\n");
+    fprintf(stderr, "   -v          Be verbose\n");
+    fprintf(stderr, "   -d          Show debug information\n");
+    fprintf(stderr, "   -o          Print the header of fields \n");
+    fprintf(stderr, "   -f format   Output format: %s (default=tsv)\n", PNT_OUTPUT_FORMATS);
+}
+
+static void
+pnt_analyze_handle_frame(char *buf, ssize_t len, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_analyze *an = arg;
+    struct ether_header *eh = (struct ether_header *)buf;
+
+    /* Every response in the capture counts, whoever asked for it */
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, len, NULL, PN_FRAME_ID_RTA_DCP_RESPONSE);
+    if (pn_dcp == NULL || pn_dcp->h_service_id != PN_DCP_SERVICE_ID_IDENTIFY ||
+        pn_dcp->h_service_type != PN_DCP_SERVICE_TYPE_RESPONSE_SUCCESS)
+        return;
+
+    struct pnt_device *dev;
+    int created;
+
+    an->responses++;
+    dev = pnt_devtable_insert(&an->devices, eh->ether_shost, &created);
+    if (dev == NULL)
+        return;
+
+    if (created)
+        dev->first_seen = info->ts;
+    dev->last_seen = info->ts;
+
+    /* the latest response wins, as in a live table */
+    memset(&dev->data, 0, sizeof(dev->data));
+    pnt_parse_dcp_response_blocks(pn_dcp, &dev->data);
+}
+
+static int
+pnt_analyze_cmp_first_seen(const void *a, const void *b)
+{
+    const struct pnt_device *da = *(const struct pnt_device *const *)a;
+    const struct pnt_device *db = *(const struct pnt_device *const *)b;
+
+    if (da->first_seen.tv_sec != db->first_seen.tv_sec)
+        return da->first_seen.tv_sec < db->first_seen.tv_sec ? -1 : 1;
+    if (da->first_seen.tv_nsec != db->first_seen.tv_nsec)
+        return da->first_seen.tv_nsec < db->first_seen.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Devices in the order they first answered, like a live discovery prints them */
+static int
+pnt_analyze_print(struct pnt_analyze *an, struct pnt_output *out)
+{
+    struct pnt_device **order;
+    unsigned int n = 0;
+
+    if (an->devices.count == 0)
+        return 0;
+
+    order = malloc(an->devices.count * sizeof(*order));
+    if (order == NULL)
+    {
+        perror("Cannot allocate device list");
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < an->devices.size; i++)
+    {
+        if (an->devices.slots[i].used)
+            order[n++] = &an->devices.slots[i];
+    }
+    qsort(order, n, sizeof(*order), pnt_analyze_cmp_first_seen);
+
+    for (unsigned int i = 0; i < n; i++)
+        pnt_output_device(out, PNT_EVENT_NONE, order[i], NULL);
+
+    free(order);
+    return 0;
+}
+
+int pnt_analyze(int argc, char **argv)
+{
+    struct pnt_analyze an;
+    struct pnt_capture cap;
+    struct pnt_output out;
+    struct timespec start, end;
+    char *path = NULL;
+    int do_headers = 0;
+    int format = PNT_OUTPUT_TSV;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vdor:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            pnt_set_verbose_level(PNT_VERBOSE_PRINT);
+            break;
+        case 'd':
+            pnt_set_verbose_level(PNT_VERBOSE_DEBUG);
+            break;
+        case 'o':
+            do_headers = 1;
+            break;
+        case 'r':
+            path = optarg;
+            break;
+        case 'f':
+            format = pnt_output_parse_format(optarg);
+            break;
+        default: /* '?' */
+            pnt_analyze_print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pnt_print("Parameters: capture[%s] verbose_level[%d] headers[%d] format[%d]",
+              path, pnt_get_verbose_level(), do_headers, format);
+
+    if (path == NULL || format < 0)
+    {
+        pnt_analyze_print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (pnt_capture_open(&cap, path) < 0)
+        return EXIT_FAILURE;
+
+    memset(&an, 0, sizeof(an));
+    if (pnt_devtable_init(&an.devices, 0) < 0)
+    {
+        pnt_capture_close(&cap);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = pnt_capture_dispatch(&cap, pnt_analyze_handle_frame, &an);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = TIME_DIFF_MS(start, end);
+    pnt_print("%lu frames, %lu identify responses, %u devices in %.0f ms (%.0f MB/s)",
+              cap.frames, an.responses, an.devices.count, ms, cap.map_len / 1e3 / (ms > 0 ? ms : 1));
+    if (cap.skipped > 0)
+        fprintf(stderr, "warning: %s: skipped %lu frames that are not Ethernet\n", path, cap.skipped);
+
+    if (ret == 0)
+        ret = pnt_output_init(&out, format, PNT_OUTPUT_TIMES, STDOUT_FILENO);
+    if (ret == 0)
+    {
+        if (do_headers)
+            pnt_output_header(&out);
+        ret = pnt_analyze_print(&an, &out);
+        if (pnt_output_close(&out) < 0)
+            ret = -1;
+    }
+
+    pnt_devtable_free(&an.devices);
+    pnt_capture_close(&cap);
+
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+#include "capture.h"
+#include "devtable.h"
+#include "output.h"
+
+#define TIME_DIFF_MS(s, e) ((e.tv_sec - s.tv_sec) * 1e3 + (e.tv_nsec - s.tv_nsec) / 1e6)
+
+struct pnt_analyze
+{
+    struct pnt_devtable devices; //devices that sent an identify response, by MAC
+    unsigned long responses;
+};
+
+int pnt_analyze(int argc, char **argv);
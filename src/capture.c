@@ -0,0 +1,318 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "capture.h"
+
+/* Records are only as aligned as the frame before them, read fields bytewise */
+static uint32_t pnt_capture_u32(const struct pnt_capture *cap, const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cap->swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t pnt_capture_u16(const struct pnt_capture *cap, const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cap->swapped ? __builtin_bswap16(v) : v;
+}
+
+int pnt_capture_open(struct pnt_capture *cap, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    memset(cap, 0, sizeof(*cap));
+    cap->path = path;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size < 24)
+    {
+        fprintf(stderr, "%s: too short for a capture file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    /* The mapping keeps the file referenced, the descriptor is not needed */
+    cap->map_len = st.st_size;
+    cap->map = mmap(NULL, cap->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cap->map == MAP_FAILED)
+    {
+        perror("Cannot map capture file");
+        cap->map = NULL;
+        return -1;
+    }
+
+    /* One pass from start to end, let the kernel read ahead aggressively
+       and drop the pages behind us */
+    madvise((void *)cap->map, cap->map_len, MADV_SEQUENTIAL);
+
+    uint32_t magic;
+    memcpy(&magic, cap->map, sizeof(magic));
+
+    if (magic == PNT_PCAPNG_BLOCK_SHB)
+    {
+        cap->pcapng = 1;
+        return 0;
+    }
+
+    if (magic == PNT_PCAP_MAGIC_US || magic == PNT_PCAP_MAGIC_NS)
+        cap->swapped = 0;
+    else if (magic == __builtin_bswap32(PNT_PCAP_MAGIC_US) || magic == __builtin_bswap32(PNT_PCAP_MAGIC_NS))
+        cap->swapped = 1;
+    else
+    {
+        fprintf(stderr, "%s: not a pcap or pcapng file\n", path);
+        pnt_capture_close(cap);
+        return -1;
+    }
+
+    cap->if_count = 1;
+    cap->ifaces[0].linktype = pnt_capture_u32(cap, cap->map + 20) & 0xffff;
+    cap->ifaces[0].tsresol = pnt_capture_u32(cap, cap->map) == PNT_PCAP_MAGIC_NS ? 9 : 6;
+
+    return 0;
+}
+
+void pnt_capture_close(struct pnt_capture *cap)
+{
+    if (cap->map != NULL)
+        munmap((void *)cap->map, cap->map_len);
+    cap->map = NULL;
+}
+
+static void pnt_capture_timestamp(const struct pnt_capture_iface *iface, uint64_t ts, struct timespec *out)
+{
+    uint8_t resol = iface->tsresol & 0x7f;
+    uint64_t frac;
+
+    if (iface->tsresol & 0x80)
+    {
+        out->tv_sec = ts >> resol;
+        frac = ts & ((1ULL << resol) - 1);
+        if (resol > 32)
+        {
+            frac >>= resol - 32;
+            resol = 32;
+        }
+        out->tv_nsec = (frac * 1000000000ULL) >> resol;
+    }
+    else
+    {
+        uint64_t div = 1;
+
+        for (int i = 0; i < resol && i < 19; i++)
+            div *= 10;
+        out->tv_sec = ts / div;
+        frac = ts % div;
+        if (div <= 1000000000ULL)
+            out->tv_nsec = frac * (1000000000ULL / div);
+        else
+            out->tv_nsec = frac / (div / 1000000000ULL);
+    }
+
+    out->tv_sec += iface->tsoffset;
+}
+
+static void pnt_capture_frame(struct pnt_capture *cap, const struct pnt_capture_iface *iface, uint64_t ts,
+                              const uint8_t *data, uint32_t caplen, pnt_frame_handler handler, void *arg)
+{
+    struct pnt_frame_info info;
+
+    if (iface->linktype != PNT_LINKTYPE_ETHERNET)
+    {
+        cap->skipped++;
+        return;
+    }
+
+    pnt_capture_timestamp(iface, ts, &info.ts);
+    info.vlan_tci = -1; //a tag is still in the captured frame
+
+    /* The mapping is read-only, handlers only ever look at the frame */
+    handler((char *)data, caplen, &info, arg);
+    cap->frames++;
+}
+
+static int pnt_capture_dispatch_pcap(struct pnt_capture *cap, pnt_frame_handler handler, void *arg)
+{
+    const struct pnt_capture_iface *iface = &cap->ifaces[0];
+    uint64_t units = iface->tsresol == 9 ? 1000000000ULL : 1000000ULL;
+    size_t off = 24;
+
+    while (off + 16 <= cap->map_len)
+    {
+        const uint8_t *rec = cap->map + off;
+        uint32_t caplen = pnt_capture_u32(cap, rec + 8);
+
+        if (caplen > cap->map_len - off - 16)
+        {
+            fprintf(stderr, "warning: %s: capture ends in the middle of a record\n", cap->path);
+            break;
+        }
+
+        uint64_t ts = pnt_capture_u32(cap, rec) * units + pnt_capture_u32(cap, rec + 4);
+        pnt_capture_frame(cap, iface, ts, rec + 16, caplen, handler, arg);
+
+        off += 16 + caplen;
+    }
+
+    return 0;
+}
+
+/* Start of a pcapng section: byte order and the interface list are reset */
+static int pnt_capture_section(struct pnt_capture *cap, const uint8_t *block, size_t avail)
+{
+    uint32_t bom;
+
+    if (avail < 28)
+        return -1;
+
+    memcpy(&bom, block + 8, sizeof(bom));
+    if (bom == PNT_PCAPNG_BYTE_ORDER_MAGIC)
+        cap->swapped = 0;
+    else if (bom == __builtin_bswap32(PNT_PCAPNG_BYTE_ORDER_MAGIC))
+        cap->swapped = 1;
+    else
+        return -1;
+
+    cap->if_count = 0;
+    return 0;
+}
+
+static void pnt_capture_add_iface(struct pnt_capture *cap, const uint8_t *block, uint32_t len)
+{
+    struct pnt_capture_iface *iface;
+
+    if (cap->if_count >= PNT_CAPTURE_MAX_IFACES || len < 20)
+    {
+        cap->if_count++; //frames referring to it are skipped
+        return;
+    }
+
+    iface = &cap->ifaces[cap->if_count++];
+    iface->linktype = pnt_capture_u16(cap, block + 8);
+    iface->tsresol = 6;
+    iface->tsoffset = 0;
+
+    /* Options run up to the trailing block length */
+    for (uint32_t off = 16; off + 4 <= len - 4;)
+    {
+        uint16_t code = pnt_capture_u16(cap, block + off);
+        uint16_t optlen = pnt_capture_u16(cap, block + off + 2);
+
+        if (code == 0 || off + 4 + optlen > len - 4)
+            break;
+
+        if (code == PNT_PCAPNG_OPT_IF_TSRESOL && optlen >= 1)
+            iface->tsresol = block[off + 4];
+        else if (code == PNT_PCAPNG_OPT_IF_TSOFFSET && optlen >= 8)
+        {
+            uint64_t v;
+
+            memcpy(&v, block + off + 4, sizeof(v));
+            iface->tsoffset = (int64_t)(cap->swapped ? __builtin_bswap64(v) : v);
+        }
+
+        off += 4 + ((optlen + 3) & ~3u);
+    }
+}
+
+static int pnt_capture_dispatch_pcapng(struct pnt_capture *cap, pnt_frame_handler handler, void *arg)
+{
+    size_t off = 0;
+
+    while (off + 12 <= cap->map_len)
+    {
+        const uint8_t *block = cap->map + off;
+        size_t avail = cap->map_len - off;
+        uint32_t type;
+
+        memcpy(&type, block, sizeof(type));
+        if (type == PNT_PCAPNG_BLOCK_SHB && pnt_capture_section(cap, block, avail) < 0)
+        {
+            fprintf(stderr, "%s: bad section header at offset %zu\n", cap->path, off);
+            return -1;
+        }
+        type = pnt_capture_u32(cap, block);
+
+        uint32_t len = pnt_capture_u32(cap, block + 4);
+        if (len < 12 || len % 4 != 0 || len > avail)
+        {
+            if (len > avail)
+                fprintf(stderr, "warning: %s: capture ends in the middle of a block\n", cap->path);
+            else
+                fprintf(stderr, "%s: bad block length %u at offset %zu\n", cap->path, len, off);
+            return len > avail ? 0 : -1;
+        }
+
+        switch (type)
+        {
+        case PNT_PCAPNG_BLOCK_IDB:
+            pnt_capture_add_iface(cap, block, len);
+            break;
+        case PNT_PCAPNG_BLOCK_EPB:
+        case PNT_PCAPNG_BLOCK_PB:
+        {
+            if (len < 32)
+                break;
+
+            uint32_t id = type == PNT_PCAPNG_BLOCK_EPB ? pnt_capture_u32(cap, block + 8) : pnt_capture_u16(cap, block + 8);
+            uint64_t ts = ((uint64_t)pnt_capture_u32(cap, block + 12) << 32) | pnt_capture_u32(cap, block + 16);
+            uint32_t caplen = pnt_capture_u32(cap, block + 20);
+
+            if (caplen > len - 32 || id >= (uint32_t)cap->if_count || id >= PNT_CAPTURE_MAX_IFACES)
+            {
+                cap->skipped++;
+                break;
+            }
+            pnt_capture_frame(cap, &cap->ifaces[id], ts, block + 28, caplen, handler, arg);
+            break;
+        }
+        case PNT_PCAPNG_BLOCK_SPB:
+        {
+            /* No timestamp and always the first interface */
+            if (len < 16 || cap->if_count == 0)
+                break;
+
+            uint32_t caplen = pnt_capture_u32(cap, block + 8);
+            if (caplen > len - 16)
+                caplen = len - 16;
+            pnt_capture_frame(cap, &cap->ifaces[0], 0, block + 12, caplen, handler, arg);
+            break;
+        }
+        default:
+            break;
+        }
+
+        off += len;
+    }
+
+    return 0;
+}
+
+/* Hand every frame of the capture to handler, in file order */
+int pnt_capture_dispatch(struct pnt_capture *cap, pnt_frame_handler handler, void *arg)
+{
+    if (cap->pcapng)
+        return pnt_capture_dispatch_pcapng(cap, handler, arg);
+    return pnt_capture_dispatch_pcap(cap, handler, arg);
+}
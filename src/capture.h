@@ -0,0 +1,56 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#ifndef __PNT_CAPTURE__
+#define __PNT_CAPTURE__
+
+#include "common.h"
+
+#include <sys/stat.h>
+
+#define PNT_PCAP_MAGIC_US 0xa1b2c3d4
+#define PNT_PCAP_MAGIC_NS 0xa1b23c4d
+#define PNT_PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define PNT_PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PNT_PCAPNG_BLOCK_IDB 0x00000001
+#define PNT_PCAPNG_BLOCK_PB 0x00000002 //obsolete packet block
+#define PNT_PCAPNG_BLOCK_SPB 0x00000003
+#define PNT_PCAPNG_BLOCK_EPB 0x00000006
+
+#define PNT_PCAPNG_OPT_IF_TSRESOL 9
+#define PNT_PCAPNG_OPT_IF_TSOFFSET 14
+
+#define PNT_LINKTYPE_ETHERNET 1
+
+#define PNT_CAPTURE_MAX_IFACES 256
+
+/* Interface of a pcapng section, pcap files have exactly one */
+struct pnt_capture_iface
+{
+    uint16_t linktype;
+    uint8_t tsresol;  //as in if_tsresol: 10^-n, or 2^-n with the top bit set
+    int64_t tsoffset; //seconds added to every timestamp
+};
+
+/* A pcap or pcapng file mapped read-only, frames are handed out in place */
+struct pnt_capture
+{
+    const char *path;
+    const uint8_t *map;
+    size_t map_len;
+    int pcapng;
+    int swapped; //byte order of the file (section) differs from ours
+    struct pnt_capture_iface ifaces[PNT_CAPTURE_MAX_IFACES];
+    int if_count;
+    unsigned long frames;  //frames handed to the handler
+    unsigned long skipped; //frames on interfaces that are not Ethernet
+};
+
+int pnt_capture_open(struct pnt_capture *cap, const char *path);
+int pnt_capture_dispatch(struct pnt_capture *cap, pnt_frame_handler handler, void *arg);
+void pnt_capture_close(struct pnt_capture *cap);
+
+#endif
@@ -6,6 +6,8 @@
 #include "common.h"
 
 static int pnt_verbose_level = 0;
+static pnt_log_handler pnt_log = NULL;
+static void *pnt_log_arg = NULL;
 
 void pnt_set_verbose_level(int lvl)
 {
@@ -17,6 +19,21 @@ int pnt_get_verbose_level()
     return pnt_verbose_level;
 }
 
+/* Messages go to handler instead of stderr, NULL restores stderr */
+void pnt_set_log_handler(pnt_log_handler handler, void *arg)
+{
+    pnt_log = handler;
+    pnt_log_arg = arg;
+}
+
+static void pnt_log_message(int level, const char *format, va_list args)
+{
+    char msg[512];
+
+    vsnprintf(msg, sizeof(msg), format, args);
+    pnt_log(level, msg, pnt_log_arg);
+}
+
 void pnt_debug(const char *format, ...)
 {
     if (pnt_verbose_level < PNT_VERBOSE_DEBUG)
@@ -25,6 +42,13 @@ void pnt_debug(const char *format, ...)
     va_list args;
     va_start(args, format);
 
+    if (pnt_log != NULL)
+    {
+        pnt_log_message(PNT_VERBOSE_DEBUG, format, args);
+        va_end(args);
+        return;
+    }
+
     fputs("debug: ", stderr);
     vfprintf(stderr, format, args);
     fputs("\n", stderr);
@@ -40,6 +64,13 @@ void pnt_print(const char *format, ...)
     va_list args;
     va_start(args, format);
 
+    if (pnt_log != NULL)
+    {
+        pnt_log_message(PNT_VERBOSE_PRINT, format, args);
+        va_end(args);
+        return;
+    }
+
     vfprintf(stderr, format, args);
     fputs("\n", stderr);
 
@@ -62,8 +93,355 @@ void dump_buffer(char *buf, unsigned int length)
 
 // ------------------------------------
 
+int pnt_parse_mac(const char *str, uint8_t *mac)
+{
+    unsigned int bytes[ETH_ALEN];
+    int consumed = 0;
+
+    if (ETH_ALEN != sscanf(str, "%02x:%02x:%02x:%02x:%02x:%02x%n",
+                           &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5], &consumed))
+        return -1;
+    if (str[consumed] != '\0')
+        return -1;
+
+    for (int i = 0; i < ETH_ALEN; i++)
+        mac[i] = bytes[i];
+
+    return 0;
+}
+
+void pnt_timespec_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+void pnt_deadline_set(struct timespec *deadline, int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    pnt_timespec_add_ms(deadline, ms);
+}
+
+int pnt_deadline_remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long ns = (long long)(deadline->tv_sec - now.tv_sec) * 1000000000LL +
+                   (deadline->tv_nsec - now.tv_nsec);
+    if (ns <= 0)
+        return 0;
+
+    /* round up, so poll() never wakes just before the deadline */
+    return (int)((ns + 999999LL) / 1000000LL);
+}
+
+// ------------------------------------
+
+int pnt_list_ifaces(char names[][IFNAMSIZ], int max)
+{
+    struct if_nameindex *list, *it;
+    int count = 0;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        perror("Cannot open socket");
+        return -1;
+    }
+
+    list = if_nameindex();
+    if (list == NULL)
+    {
+        perror("Cannot list interfaces");
+        close(sock);
+        return -1;
+    }
+
+    /* Keep Ethernet interfaces that are up, skipping loopback */
+    for (it = list; it->if_index != 0 && count < max; it++)
+    {
+        struct ifreq ifr;
+
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, it->if_name, IFNAMSIZ - 1);
+
+        if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0)
+            continue;
+        if (!(ifr.ifr_flags & IFF_UP) || (ifr.ifr_flags & IFF_LOOPBACK))
+            continue;
+        if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+            continue;
+
+        memset(names[count], 0, IFNAMSIZ);
+        strncpy(names[count], it->if_name, IFNAMSIZ - 1);
+        pnt_debug("pnt_list_ifaces: %s", names[count]);
+        count++;
+    }
+
+    if_freenameindex(list);
+    close(sock);
+
+    return count;
+}
+
+static int pnt_ring_setup(int sock, struct pnt_ring *ring)
+{
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+
+    ring->map = NULL;
+    ring->block_idx = 0;
+    if (ring->block_size == 0)
+        ring->block_size = PNT_RING_BLOCK_SIZE;
+    if (ring->block_nr == 0)
+        ring->block_nr = PNT_RING_BLOCK_NR;
+
+    if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+    {
+        pnt_debug("pnt_ring_setup: PACKET_VERSION: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = ring->block_size;
+    req.tp_block_nr = ring->block_nr;
+    req.tp_frame_size = PNT_RING_FRAME_SIZE;
+    req.tp_frame_nr = (ring->block_size * ring->block_nr) / PNT_RING_FRAME_SIZE;
+    req.tp_retire_blk_tov = PNT_RING_BLOCK_TIMEOUT;
+
+    if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        pnt_debug("pnt_ring_setup: PACKET_RX_RING: %s", strerror(errno));
+        return -1;
+    }
+
+    ring->map_len = (size_t)ring->block_size * ring->block_nr;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sock, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        /* retry without locking, RLIMIT_MEMLOCK may be too small */
+        ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+    }
+    if (ring->map == MAP_FAILED)
+    {
+        pnt_debug("pnt_ring_setup: mmap: %s", strerror(errno));
+        ring->map = NULL;
+        return -1;
+    }
+
+    pnt_debug("pnt_ring_setup: %u blocks of %u bytes mapped at %p", ring->block_nr, ring->block_size, ring->map);
+    return 0;
+}
+
+void pnt_ring_close(struct pnt_ring *ring)
+{
+    if (ring == NULL || ring->map == NULL)
+        return;
+
+    munmap(ring->map, ring->map_len);
+    ring->map = NULL;
+}
+
+int pnt_ring_dispatch(struct pnt_ring *ring, pnt_frame_handler handler, void *arg)
+{
+    int frames = 0;
+
+    /* Walk every block the kernel has retired to us, handing each frame
+       to the handler in place, and give the block back once done. */
+    for (;;)
+    {
+        struct tpacket_block_desc *bd;
+        struct tpacket3_hdr *ppd;
+
+        bd = (struct tpacket_block_desc *)(ring->map + (size_t)ring->block_idx * ring->block_size);
+        if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+            break;
+
+        ppd = (struct tpacket3_hdr *)((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (unsigned int i = 0; i < bd->hdr.bh1.num_pkts; i++)
+        {
+            struct pnt_frame_info info;
+
+            info.ts.tv_sec = ppd->tp_sec;
+            info.ts.tv_nsec = ppd->tp_nsec;
+            info.vlan_tci = (ppd->tp_status & TP_STATUS_VLAN_VALID) ? (int)ppd->hv1.tp_vlan_tci : -1;
+            pnt_stats.frames_received++;
+            handler((char *)ppd + ppd->tp_mac, ppd->tp_snaplen, &info, arg);
+            frames++;
+
+            ppd = (struct tpacket3_hdr *)((char *)ppd + ppd->tp_next_offset);
+        }
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ring->block_idx = (ring->block_idx + 1) % ring->block_nr;
+    }
+
+    return frames;
+}
+
+int pnt_ring_stats(int sock, struct tpacket_stats_v3 *stats)
+{
+    socklen_t len = sizeof(*stats);
+
+    /* the kernel resets the counters on every read, so every read adds up */
+    memset(stats, 0, sizeof(*stats));
+    if (getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, stats, &len) < 0)
+        return -1;
+
+    pnt_stats.kernel_packets += stats->tp_packets;
+    pnt_stats.kernel_drops += stats->tp_drops;
+    pnt_stats.kernel_freezes += stats->tp_freeze_q_cnt;
+    return 0;
+}
+
+int pnt_recv_dispatch(int sock, char *buf, pnt_frame_handler handler, void *arg)
+{
+    int frames = 0;
+
+    /* Drain everything queued on a non-blocking socket */
+    for (;;)
+    {
+        char control[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+        struct iovec iov = {.iov_base = buf, .iov_len = BUF_SIZE};
+        struct msghdr msg;
+        struct pnt_frame_info info;
+        ssize_t received;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        received = recvmsg(sock, &msg, 0);
+        if (received < 0)
+        {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+            {
+                perror("Could not receive from socket");
+                return -1;
+            }
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &info.ts);
+        info.vlan_tci = -1;
+        /* only there after pnt_enable_vlan_auxdata() */
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA)
+            {
+                struct tpacket_auxdata *aux = (struct tpacket_auxdata *)CMSG_DATA(cmsg);
+
+                if (aux->tp_status & TP_STATUS_VLAN_VALID)
+                    info.vlan_tci = aux->tp_vlan_tci;
+            }
+        }
+        pnt_stats.frames_received++;
+        handler(buf, received, &info, arg);
+        frames++;
+    }
+
+    return frames;
+}
+
+/* Resize the socket receive buffer, past net.core.rmem_max when allowed.
+   Returns the size the kernel settled on, which includes its overhead. */
+int pnt_set_rcvbuf(int sock, int bytes)
+{
+    socklen_t len = sizeof(bytes);
+
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) < 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0)
+    {
+        perror("Cannot set SO_RCVBUF on socket");
+        return -1;
+    }
+
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, &len) < 0)
+        return -1;
+
+    pnt_debug("pnt_set_rcvbuf: %d bytes", bytes);
+    return bytes;
+}
+
+/* Ask the kernel for a software timestamp of every frame sent, they come
+   back on the error queue with a copy of the frame */
+int pnt_enable_tx_timestamps(int sock)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        pnt_debug("pnt_enable_tx_timestamps: SO_TIMESTAMPING: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Drain the error queue, handing each sent frame to the handler with the
+   time it left for the driver as info->ts */
+int pnt_recv_tx_timestamps(int sock, char *buf, pnt_frame_handler handler, void *arg)
+{
+    int frames = 0;
+
+    for (;;)
+    {
+        char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct iovec iov = {.iov_base = buf, .iov_len = BUF_SIZE};
+        struct msghdr msg;
+        struct pnt_frame_info info;
+        int stamped = 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t received = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            perror("Could not read the socket error queue");
+            return -1;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+            {
+                struct scm_timestamping *tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+
+                info.ts = tss->ts[0];
+                stamped = info.ts.tv_sec != 0 || info.ts.tv_nsec != 0;
+            }
+        }
+
+        if (stamped)
+        {
+            info.vlan_tci = -1;
+            handler(buf, received, &info, arg);
+            frames++;
+        }
+    }
+
+    return frames;
+}
+
 int open_raw_sock(char *if_name, uint8_t *if_addr, int *if_index,
-                  int do_promiscuous, int non_block, int reuse, int bind_device)
+                  int do_promiscuous, int non_block, int reuse, int bind_device,
+                  struct pnt_ring *ring)
 {
     /* Create the AF_PACKET socket. */
     int sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
@@ -145,21 +523,232 @@ int open_raw_sock(char *if_name, uint8_t *if_addr, int *if_index,
         pnt_debug("open_raw_sock: SO_REUSEADDR set");
     }
 
+    if (ring != NULL)
+    {
+        /* The ring must exist before the socket is bound. On failure the
+           socket is still usable through recvfrom(), so just fall back. */
+        if (pnt_ring_setup(sock, ring) < 0)
+            pnt_print("Could not set up RX ring, falling back to recvfrom()");
+    }
+
     if (bind_device)
     {
-        if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, if_name, IFNAMSIZ - 1) < 0)
+        /* SO_BINDTODEVICE is ignored by packet sockets, they must be bound with
+           a sockaddr_ll to stop receiving frames from every other interface. */
+        struct sockaddr_ll sock_addr;
+
+        memset(&sock_addr, 0, sizeof(sock_addr));
+        sock_addr.sll_family = AF_PACKET;
+        sock_addr.sll_protocol = htons(ETH_P_ALL);
+        sock_addr.sll_ifindex = *if_index;
+
+        if (bind(sock, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0)
         {
             perror("Cannot bind to interface");
+            pnt_ring_close(ring);
             close(sock);
             return -1;
         }
-        pnt_debug("open_raw_sock: SO_BINDTODEVICE set");
+        pnt_debug("open_raw_sock: bound to ifindex %d", *if_index);
     }
 
     return sock;
 }
 
-int pnt_dcp_create_flashled_request(char *buf, uint8_t *if_src, uint8_t *if_dst)
+#define PNT_BPF_MAX_INSNS 16
+
+/*
+ * Attach a classic BPF program that only lets PROFINET frames (optionally
+ * 802.1Q tagged) with the given FrameID through, and when xid_mask is not 0
+ * only DCP frames whose XID matches xid in the bits of xid_mask. A frameid
+ * of 0 accepts any FrameID.
+ * Frames queued before the filter is attached are still delivered, so the
+ * receive path must keep validating with pnt_get_dcp_header().
+ */
+int pnt_attach_dcp_filter(int sock, uint16_t frameid, uint32_t xid, uint32_t xid_mask)
+{
+    struct sock_filter code[PNT_BPF_MAX_INSNS];
+    int drop_jf[PNT_BPF_MAX_INSNS];
+    unsigned int n = 0;
+
+    memset(drop_jf, 0, sizeof(drop_jf));
+
+#define _BPF(c, t, f, k) code[n++] = (struct sock_filter)BPF_JUMP(c, k, t, f)
+
+    /* X holds the VLAN tag length (0 or 4), loads below are relative to it */
+    _BPF(BPF_LD | BPF_H | BPF_ABS, 0, 0, 12);
+    _BPF(BPF_JMP | BPF_JEQ | BPF_K, 3, 0, ETH_P_8021Q);
+    drop_jf[n] = 1;
+    _BPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, ETH_P_PROFINET);
+    _BPF(BPF_LDX | BPF_W | BPF_IMM, 0, 0, 0);
+    _BPF(BPF_JMP | BPF_JA, 0, 0, 3);
+    _BPF(BPF_LD | BPF_H | BPF_ABS, 0, 0, 16);
+    drop_jf[n] = 1;
+    _BPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, ETH_P_PROFINET);
+    _BPF(BPF_LDX | BPF_W | BPF_IMM, 0, 0, sizeof(struct vlan_hdr));
+
+    if (frameid > 0)
+    {
+        _BPF(BPF_LD | BPF_H | BPF_IND, 0, 0, sizeof(struct ether_header));
+        drop_jf[n] = 1;
+        _BPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, frameid);
+    }
+
+    if (xid_mask != 0)
+    {
+        _BPF(BPF_LD | BPF_W | BPF_IND, 0, 0,
+             sizeof(struct ether_header) + sizeof(struct pn_header) + offsetof(struct pn_dcp_header, h_xid));
+        if (xid_mask != 0xffffffff)
+            _BPF(BPF_ALU | BPF_AND | BPF_K, 0, 0, xid_mask);
+        drop_jf[n] = 1;
+        _BPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, xid & xid_mask);
+    }
+
+    _BPF(BPF_RET | BPF_K, 0, 0, 0x40000);
+    _BPF(BPF_RET | BPF_K, 0, 0, 0);
+
+#undef _BPF
+
+    /* point every pending "drop" branch at the last instruction */
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (drop_jf[i])
+            code[i].jf = n - 1 - (i + 1);
+    }
+
+    struct sock_fprog prog;
+    prog.len = n;
+    prog.filter = code;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    {
+        pnt_debug("pnt_attach_dcp_filter: SO_ATTACH_FILTER: %s", strerror(errno));
+        return -1;
+    }
+
+    pnt_debug("pnt_attach_dcp_filter: %u instructions, frameid[%04x] xid[%08x/%08x]", n, frameid, xid, xid_mask);
+    return 0;
+}
+
+/*
+ * Attach a classic BPF program that only lets PROFINET frames (optionally
+ * 802.1Q tagged) with a FrameID in one of the ranges through. Passive
+ * captures use it to keep the traffic they do not care about in the kernel.
+ */
+int pnt_attach_frame_id_filter(int sock, const struct pnt_frame_id_range *ranges, int count)
+{
+    struct sock_filter code[PNT_BPF_MAX_INSNS + 2 * PNT_FRAME_ID_RANGES_MAX];
+    int drop_jf[PNT_BPF_MAX_INSNS + 2 * PNT_FRAME_ID_RANGES_MAX];
+    unsigned int n = 0;
+
+    if (count < 1 || count > PNT_FRAME_ID_RANGES_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(drop_jf, 0, sizeof(drop_jf));
+
+#define _BPF(c, t, f, k) code[n++] = (struct sock_filter)BPF_JUMP(c, k, t, f)
+
+    /* the same VLAN prologue as pnt_attach_dcp_filter() */
+    _BPF(BPF_LD | BPF_H | BPF_ABS, 0, 0, 12);
+    _BPF(BPF_JMP | BPF_JEQ | BPF_K, 3, 0, ETH_P_8021Q);
+    drop_jf[n] = 1;
+    _BPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, ETH_P_PROFINET);
+    _BPF(BPF_LDX | BPF_W | BPF_IMM, 0, 0, 0);
+    _BPF(BPF_JMP | BPF_JA, 0, 0, 3);
+    _BPF(BPF_LD | BPF_H | BPF_ABS, 0, 0, 16);
+    drop_jf[n] = 1;
+    _BPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, ETH_P_PROFINET);
+    _BPF(BPF_LDX | BPF_W | BPF_IMM, 0, 0, sizeof(struct vlan_hdr));
+    _BPF(BPF_LD | BPF_H | BPF_IND, 0, 0, sizeof(struct ether_header));
+
+    /* each range falls through to the next one, the last one to the drop */
+    for (int i = 0; i < count; i++)
+    {
+        _BPF(BPF_JMP | BPF_JGE | BPF_K, 0, 1, ranges[i].first);
+        _BPF(BPF_JMP | BPF_JGT | BPF_K, 0, 2 * (count - i) - 1, ranges[i].last);
+    }
+
+    _BPF(BPF_RET | BPF_K, 0, 0, 0);
+    _BPF(BPF_RET | BPF_K, 0, 0, 0x40000);
+
+#undef _BPF
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (drop_jf[i])
+            code[i].jf = n - 2 - (i + 1);
+    }
+
+    struct sock_fprog prog;
+    prog.len = n;
+    prog.filter = code;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    {
+        pnt_debug("pnt_attach_frame_id_filter: SO_ATTACH_FILTER: %s", strerror(errno));
+        return -1;
+    }
+
+    pnt_debug("pnt_attach_frame_id_filter: %u instructions, %d ranges", n, count);
+    return 0;
+}
+
+/* The kernel takes the 802.1Q tag off received frames before packet
+   sockets see them, recvmsg() then gets it back as PACKET_AUXDATA */
+int pnt_enable_vlan_auxdata(int sock)
+{
+    int one = 1;
+
+    if (setsockopt(sock, SOL_PACKET, PACKET_AUXDATA, &one, sizeof(one)) < 0)
+    {
+        pnt_debug("pnt_enable_vlan_auxdata: PACKET_AUXDATA: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Unlike IFF_PROMISC in open_raw_sock() this is counted per socket and
+   undone by the kernel when the socket is closed */
+int pnt_add_promisc_membership(int sock, int if_index)
+{
+    struct packet_mreq mreq;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = if_index;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+        pnt_debug("pnt_add_promisc_membership: PACKET_ADD_MEMBERSHIP: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Let frames to a multicast address through the NIC's filter while the socket is open */
+int pnt_add_multicast_membership(int sock, int if_index, const uint8_t *addr)
+{
+    struct packet_mreq mreq;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = if_index;
+    mreq.mr_type = PACKET_MR_MULTICAST;
+    mreq.mr_alen = ETH_ALEN;
+    memcpy(mreq.mr_address, addr, ETH_ALEN);
+    if (setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+        pnt_debug("pnt_add_multicast_membership: PACKET_ADD_MEMBERSHIP: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int pnt_dcp_create_flashled_request(char *buf, uint8_t *if_src, uint8_t *if_dst, uint32_t xid)
 {
     int send_len = 0;
 
@@ -184,7 +773,7 @@ int pnt_dcp_create_flashled_request(char *buf, uint8_t *if_src, uint8_t *if_dst)
     pn_dcp = (struct pn_dcp_header *)(buf + send_len);
     pn_dcp->h_service_id = PN_DCP_SERVICE_ID_SET;
     pn_dcp->h_service_type = PN_DCP_SERVICE_TYPE_REQUEST;
-    pn_dcp->h_xid = htonl(PNT_FLASHLED_XID);
+    pn_dcp->h_xid = htonl(xid);
     pn_dcp->h_response_delay = htons(0);
     //pn_dcp->h_dcp_data_length = htons(4);
 
@@ -206,56 +795,556 @@ int pnt_dcp_create_flashled_request(char *buf, uint8_t *if_src, uint8_t *if_dst)
     return send_len;
 }
 
-int pnt_dcp_create_ident_request(char *buf, uint8_t *if_addr)
+// ------------------------------------
+
+uint64_t pnt_now_ms(void)
 {
-    int send_len = 0;
+    struct timespec now;
 
-    /* Construct ehternet header. */
-    struct ether_header *eh;
-    eh = (struct ether_header *)buf;
-    memcpy(eh->ether_shost, if_addr, ETH_ALEN);
-    memcpy(eh->ether_dhost, addr_broadcast_pn, ETH_ALEN);
-    eh->ether_type = htons(ETH_P_PROFINET);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    send_len += sizeof(*eh);
+uint32_t pnt_xid_alloc(void)
+{
+    static uint32_t session = 0;
+    static uint16_t counter = 0;
 
-    /* Set PN FrameID to DCP - identify multicast*/
-    struct pn_header *pn_hdr;
-    pn_hdr = (struct pn_header *)(buf + send_len);
-    pn_hdr->h_frame_id = htons(PN_FRAME_ID_RTA_DCP_REQUEST);
+    if (session == 0)
+    {
+        uint16_t rnd = 0;
 
-    send_len += sizeof(*pn_hdr);
+        if (getrandom(&rnd, sizeof(rnd), GRND_NONBLOCK) != sizeof(rnd))
+            rnd = (uint16_t)(getpid() ^ pnt_now_ms());
+        session = (uint32_t)(rnd ? rnd : 1) << 16;
+        counter = (uint16_t)pnt_now_ms();
+    }
 
-    /* Create PN-DCP header */
-    struct pn_dcp_header *pn_dcp;
+    return session | counter++;
+}
+
+void pnt_wheel_init(struct pnt_wheel *wheel)
+{
+    for (int l = 0; l < PNT_WHEEL_LEVELS; l++)
+    {
+        for (int i = 0; i < PNT_WHEEL_SLOTS; i++)
+        {
+            wheel->slots[l][i].next = &wheel->slots[l][i];
+            wheel->slots[l][i].prev = &wheel->slots[l][i];
+        }
+    }
+    wheel->now = pnt_now_ms();
+    wheel->count = 0;
+}
+
+/* Link the timer into the slot of the lowest level whose range covers it */
+static void pnt_wheel_link(struct pnt_wheel *wheel, struct pnt_timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < PNT_WHEEL_LEVELS - 1 && delta >= (1ULL << (PNT_WHEEL_BITS * (level + 1))))
+        level++;
+
+    if (delta >= (1ULL << (PNT_WHEEL_BITS * PNT_WHEEL_LEVELS)))
+        timer->expires = wheel->now + (1ULL << (PNT_WHEEL_BITS * PNT_WHEEL_LEVELS)) - 1;
+
+    struct pnt_timer *head = &wheel->slots[level][(timer->expires >> (PNT_WHEEL_BITS * level)) & (PNT_WHEEL_SLOTS - 1)];
+
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void pnt_wheel_add(struct pnt_wheel *wheel, struct pnt_timer *timer, uint64_t expires)
+{
+    if (timer->next != NULL)
+        pnt_wheel_del(wheel, timer);
+
+    /* the current tick has already been processed */
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    pnt_wheel_link(wheel, timer);
+    wheel->count++;
+}
+
+void pnt_wheel_del(struct pnt_wheel *wheel, struct pnt_timer *timer)
+{
+    if (timer->next == NULL)
+        return;
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->count--;
+}
+
+/* Move the timers of a higher level slot down, closer to their expiry */
+static void pnt_wheel_cascade(struct pnt_wheel *wheel, int level)
+{
+    struct pnt_timer *head = &wheel->slots[level][(wheel->now >> (PNT_WHEEL_BITS * level)) & (PNT_WHEEL_SLOTS - 1)];
+    struct pnt_timer *timer = head->next;
+
+    head->next = head;
+    head->prev = head;
+
+    while (timer != head)
+    {
+        struct pnt_timer *next = timer->next;
+
+        pnt_wheel_link(wheel, timer);
+        timer = next;
+    }
+}
+
+/* Process every tick up to now, calling handler for each expired timer.
+   Timers are disarmed before the call and may be added again from it. */
+void pnt_wheel_advance(struct pnt_wheel *wheel, uint64_t now, pnt_timer_handler handler, void *arg)
+{
+    while (wheel->now < now)
+    {
+        if (wheel->count == 0)
+        {
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now++;
+
+        /* a lower level wrapped around, refill it from the one above */
+        for (int level = 1; level < PNT_WHEEL_LEVELS; level++)
+        {
+            if ((wheel->now & ((1ULL << (PNT_WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            pnt_wheel_cascade(wheel, level);
+        }
+
+        struct pnt_timer *head = &wheel->slots[0][wheel->now & (PNT_WHEEL_SLOTS - 1)];
+        while (head->next != head)
+        {
+            struct pnt_timer *timer = head->next;
+
+            pnt_wheel_del(wheel, timer);
+            handler(timer, arg);
+        }
+    }
+}
+
+/* Milliseconds until the wheel has work to do, -1 when it is empty. Timers
+   on the upper levels wake the caller at the next cascade. */
+int pnt_wheel_next_ms(const struct pnt_wheel *wheel)
+{
+    if (wheel->count == 0)
+        return -1;
+
+    uint64_t tick = wheel->now + 1;
+    for (; (tick & (PNT_WHEEL_SLOTS - 1)) != 0; tick++)
+    {
+        const struct pnt_timer *head = &wheel->slots[0][tick & (PNT_WHEEL_SLOTS - 1)];
+        if (head->next != head)
+            break;
+    }
+
+    uint64_t now = pnt_now_ms();
+    return tick > now ? (int)(tick - now) : 0;
+}
+
+static unsigned int pnt_xact_hash(uint32_t xid)
+{
+    return (unsigned int)(((uint64_t)xid * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+int pnt_xact_table_init(struct pnt_xact_table *table, unsigned int hint)
+{
+    unsigned int size = 64;
+
+    while (size < hint * 2)
+        size <<= 1;
+
+    table->slots = calloc(size, sizeof(*table->slots));
+    if (table->slots == NULL)
+    {
+        perror("Cannot allocate transaction table");
+        return -1;
+    }
+    table->size = size;
+    table->count = 0;
+    pnt_wheel_init(&table->wheel);
+
+    return 0;
+}
+
+void pnt_xact_table_free(struct pnt_xact_table *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+static struct pnt_xact **pnt_xact_slot(struct pnt_xact_table *table, uint32_t xid)
+{
+    unsigned int mask = table->size - 1;
+    unsigned int i = pnt_xact_hash(xid) & mask;
+
+    /* never more than half full, an empty slot always ends the probe */
+    while (table->slots[i] != NULL && table->slots[i]->xid != xid)
+        i = (i + 1) & mask;
+
+    return &table->slots[i];
+}
+
+static int pnt_xact_grow(struct pnt_xact_table *table)
+{
+    struct pnt_xact **old = table->slots;
+    unsigned int old_size = table->size;
+
+    table->slots = calloc(old_size * 2, sizeof(*table->slots));
+    if (table->slots == NULL)
+    {
+        perror("Cannot allocate transaction table");
+        table->slots = old;
+        return -1;
+    }
+    table->size = old_size * 2;
+
+    for (unsigned int i = 0; i < old_size; i++)
+    {
+        if (old[i] != NULL)
+            *pnt_xact_slot(table, old[i]->xid) = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+/* Give xact a fresh XID and track it. peer limits the answers to one device,
+   NULL accepts anyone (multicast requests). A timeout of 0 arms no timer. */
+int pnt_xact_start(struct pnt_xact_table *table, struct pnt_xact *xact, uint8_t service_id,
+                   const uint8_t *peer, int timeout)
+{
+    struct pnt_xact **slot;
+
+    if ((table->count + 1) * 2 > table->size && pnt_xact_grow(table) < 0)
+        return -1;
+
+    /* the counter may come around to a request that is still outstanding */
+    do
+    {
+        xact->xid = pnt_xid_alloc();
+        slot = pnt_xact_slot(table, xact->xid);
+    } while (*slot != NULL);
+
+    *slot = xact;
+    table->count++;
+
+    xact->service_id = service_id;
+    xact->unicast = peer != NULL;
+    if (peer != NULL)
+        memcpy(xact->peer, peer, ETH_ALEN);
+
+    clock_gettime(CLOCK_REALTIME, &xact->sent);
+    xact->timer.next = NULL;
+    if (timeout > 0)
+        pnt_wheel_add(&table->wheel, &xact->timer, pnt_now_ms() + timeout);
+
+    return 0;
+}
+
+/* Wait another timeout ms for the same XID, e.g. after a retransmission */
+void pnt_xact_rearm(struct pnt_xact_table *table, struct pnt_xact *xact, int timeout)
+{
+    clock_gettime(CLOCK_REALTIME, &xact->sent);
+    pnt_wheel_add(&table->wheel, &xact->timer, pnt_now_ms() + timeout);
+}
+
+void pnt_xact_finish(struct pnt_xact_table *table, struct pnt_xact *xact)
+{
+    unsigned int mask = table->size - 1;
+    struct pnt_xact **slot = pnt_xact_slot(table, xact->xid);
+
+    pnt_wheel_del(&table->wheel, &xact->timer);
+    if (*slot != xact)
+        return;
+
+    /* backward shift deletion, as in the device table */
+    unsigned int hole = slot - table->slots;
+    unsigned int i = hole;
+    for (;;)
+    {
+        i = (i + 1) & mask;
+        if (table->slots[i] == NULL)
+            break;
+
+        unsigned int home = pnt_xact_hash(table->slots[i]->xid) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+
+    table->slots[hole] = NULL;
+    table->count--;
+}
+
+struct pnt_xact *pnt_xact_find(struct pnt_xact_table *table, uint32_t xid)
+{
+    return *pnt_xact_slot(table, xid);
+}
+
+/* The outstanding request a response belongs to, NULL for stale and
+   foreign responses */
+struct pnt_xact *pnt_xact_match(struct pnt_xact_table *table, const struct pn_dcp_header *pn_dcp_hdr,
+                                const uint8_t *src)
+{
+    struct pnt_xact *xact = *pnt_xact_slot(table, ntohl(pn_dcp_hdr->h_xid));
+
+    if (xact == NULL || pn_dcp_hdr->h_service_type == PN_DCP_SERVICE_TYPE_REQUEST ||
+        pn_dcp_hdr->h_service_id != xact->service_id ||
+        (xact->unicast && memcmp(src, xact->peer, ETH_ALEN) != 0))
+    {
+        pnt_debug("pnt_xact_match: no request for xid[%08x]", ntohl(pn_dcp_hdr->h_xid));
+        return NULL;
+    }
+
+    return xact;
+}
+
+struct pnt_xact_expire_ctx
+{
+    pnt_xact_handler handler;
+    void *arg;
+};
+
+static void pnt_xact_expired(struct pnt_timer *timer, void *arg)
+{
+    struct pnt_xact_expire_ctx *ctx = arg;
+
+    ctx->handler((struct pnt_xact *)((char *)timer - offsetof(struct pnt_xact, timer)), ctx->arg);
+}
+
+/* Call handler for every request whose timeout passed. It stays in the
+   table, the handler either rearms or finishes it. */
+void pnt_xact_expire(struct pnt_xact_table *table, pnt_xact_handler handler, void *arg)
+{
+    struct pnt_xact_expire_ctx ctx = {handler, arg};
+
+    pnt_wheel_advance(&table->wheel, pnt_now_ms(), pnt_xact_expired, &ctx);
+}
+
+int pnt_xact_next_timeout(const struct pnt_xact_table *table)
+{
+    return pnt_wheel_next_ms(&table->wheel);
+}
+
+/* Append a Set request block, padded to an even length */
+static int pnt_dcp_add_set_block(char *buf, int send_len, uint8_t option, uint8_t suboption,
+                                 uint16_t qualifier, const void *data, uint16_t len)
+{
+    struct pn_dcp_block_header *block_hdr = (struct pn_dcp_block_header *)(buf + send_len);
+
+    block_hdr->h_option = option;
+    block_hdr->h_suboption = suboption;
+    block_hdr->h_block_length = htons(sizeof(qualifier) + len);
+    send_len += sizeof(*block_hdr);
+
+    *(__be16 *)(buf + send_len) = htons(qualifier);
+    send_len += sizeof(qualifier);
+
+    memcpy(buf + send_len, data, len);
+    send_len += len;
+    if (send_len % 2)
+        buf[send_len++] = 0;
+
+    return send_len;
+}
+
+/* Unicast Set of the NameOfStation and/or the IP parameters (address, mask,
+   gateway, 12 bytes), either may be NULL */
+int pnt_dcp_create_set_request(char *buf, uint8_t *if_src, uint8_t *if_dst, uint32_t xid, uint16_t qualifier,
+                               const char *name, const uint8_t *ip)
+{
+    int send_len = 0;
+
+    struct ether_header *eh;
+    eh = (struct ether_header *)buf;
+    memcpy(eh->ether_shost, if_src, ETH_ALEN);
+    memcpy(eh->ether_dhost, if_dst, ETH_ALEN);
+    eh->ether_type = htons(ETH_P_PROFINET);
+
+    send_len += sizeof(*eh);
+
+    struct pn_header *pn_hdr;
+    pn_hdr = (struct pn_header *)(buf + send_len);
+    pn_hdr->h_frame_id = htons(PN_FRAME_ID_RTA_DCP_GETSET);
+
+    send_len += sizeof(*pn_hdr);
+
+    struct pn_dcp_header *pn_dcp;
+    pn_dcp = (struct pn_dcp_header *)(buf + send_len);
+    pn_dcp->h_service_id = PN_DCP_SERVICE_ID_SET;
+    pn_dcp->h_service_type = PN_DCP_SERVICE_TYPE_REQUEST;
+    pn_dcp->h_xid = htonl(xid);
+    pn_dcp->h_response_delay = htons(0);
+
+    send_len += sizeof(*pn_dcp);
+    int data_start = send_len;
+
+    if (name != NULL)
+        send_len = pnt_dcp_add_set_block(buf, send_len, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                                         PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME, qualifier, name, strlen(name));
+    if (ip != NULL)
+        send_len = pnt_dcp_add_set_block(buf, send_len, PN_DCP_BLOCK_OPTION_ADDR,
+                                         PN_DCP_BLOCK_SUBOPTION_ADDR_IP, qualifier, ip, 12);
+
+    pn_dcp->h_dcp_data_length = htons(send_len - data_start);
+
+    return send_len;
+}
+
+/* Append an identify filter block, padded to an even length */
+static int pnt_dcp_add_filter_block(char *buf, int send_len, uint8_t option, uint8_t suboption,
+                                    const void *data, uint16_t len)
+{
+    struct pn_dcp_block_header *block_hdr = (struct pn_dcp_block_header *)(buf + send_len);
+
+    block_hdr->h_option = option;
+    block_hdr->h_suboption = suboption;
+    block_hdr->h_block_length = htons(len);
+    send_len += sizeof(*block_hdr);
+
+    if (len > 0)
+        memcpy(buf + send_len, data, len);
+    send_len += len;
+    if (send_len % 2)
+        buf[send_len++] = 0;
+
+    return send_len;
+}
+
+/* Names and aliases are unique, their single answer needs no spreading */
+int pnt_dcp_filter_response_delay(const struct pnt_dcp_filter *filter)
+{
+    if (filter != NULL && filter->response_delay > 0)
+        return filter->response_delay;
+    if (filter != NULL && (filter->name != NULL || filter->alias != NULL))
+        return 1;
+
+    return PNT_DCP_RESPONSE_DELAY;
+}
+
+/* Unicast Get of a single option, e.g. the NameOfStation as a heartbeat */
+int pnt_dcp_create_get_request(char *buf, uint8_t *if_src, uint8_t *if_dst, uint32_t xid,
+                               uint8_t option, uint8_t suboption)
+{
+    int send_len = 0;
+
+    struct ether_header *eh;
+    eh = (struct ether_header *)buf;
+    memcpy(eh->ether_shost, if_src, ETH_ALEN);
+    memcpy(eh->ether_dhost, if_dst, ETH_ALEN);
+    eh->ether_type = htons(ETH_P_PROFINET);
+
+    send_len += sizeof(*eh);
+
+    struct pn_header *pn_hdr;
+    pn_hdr = (struct pn_header *)(buf + send_len);
+    pn_hdr->h_frame_id = htons(PN_FRAME_ID_RTA_DCP_GETSET);
+
+    send_len += sizeof(*pn_hdr);
+
+    struct pn_dcp_header *pn_dcp;
+    pn_dcp = (struct pn_dcp_header *)(buf + send_len);
+    pn_dcp->h_service_id = PN_DCP_SERVICE_ID_GET;
+    pn_dcp->h_service_type = PN_DCP_SERVICE_TYPE_REQUEST;
+    pn_dcp->h_xid = htonl(xid);
+    pn_dcp->h_response_delay = htons(0);
+
+    send_len += sizeof(*pn_dcp);
+
+    /* a Get request lists bare option/suboption pairs */
+    buf[send_len++] = option;
+    buf[send_len++] = suboption;
+    pn_dcp->h_dcp_data_length = htons(2);
+
+    return send_len;
+}
+
+int pnt_dcp_create_ident_request(char *buf, uint8_t *if_addr, uint32_t xid, const struct pnt_dcp_filter *filter)
+{
+    int send_len = 0;
+
+    /* Construct ehternet header. */
+    struct ether_header *eh;
+    eh = (struct ether_header *)buf;
+    memcpy(eh->ether_shost, if_addr, ETH_ALEN);
+    memcpy(eh->ether_dhost, addr_broadcast_pn, ETH_ALEN);
+    eh->ether_type = htons(ETH_P_PROFINET);
+
+    send_len += sizeof(*eh);
+
+    if (filter != NULL && filter->vlan_tagged)
+    {
+        struct vlan_hdr *vlan = (struct vlan_hdr *)(buf + send_len);
+
+        eh->ether_type = htons(ETH_P_8021Q);
+        vlan->h_vlan_TCI = htons(filter->vlan_tci);
+        vlan->h_vlan_encapsulated_proto = htons(ETH_P_PROFINET);
+        send_len += sizeof(*vlan);
+    }
+
+    /* Set PN FrameID to DCP - identify multicast*/
+    struct pn_header *pn_hdr;
+    pn_hdr = (struct pn_header *)(buf + send_len);
+    pn_hdr->h_frame_id = htons(PN_FRAME_ID_RTA_DCP_REQUEST);
+
+    send_len += sizeof(*pn_hdr);
+
+    /* Create PN-DCP header */
+    struct pn_dcp_header *pn_dcp;
     pn_dcp = (struct pn_dcp_header *)(buf + send_len);
     pn_dcp->h_service_id = PN_DCP_SERVICE_ID_IDENTIFY;
     pn_dcp->h_service_type = PN_DCP_SERVICE_TYPE_REQUEST;
-    pn_dcp->h_xid = htonl(PNT_DISCOVERY_XID);
-    pn_dcp->h_response_delay = htons(128);
-    //pn_dcp->h_dcp_data_length = htons(4);
+    pn_dcp->h_xid = htonl(xid);
+    pn_dcp->h_response_delay = htons(pnt_dcp_filter_response_delay(filter));
 
     send_len += sizeof(*pn_dcp);
+    int data_start = send_len;
+
+    if (filter != NULL && filter->name != NULL)
+        send_len = pnt_dcp_add_filter_block(buf, send_len, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                                            PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME, filter->name, strlen(filter->name));
+    if (filter != NULL && filter->alias != NULL)
+        send_len = pnt_dcp_add_filter_block(buf, send_len, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                                            PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_ALIAS, filter->alias, strlen(filter->alias));
+    if (filter != NULL && filter->has_id)
+    {
+        __be16 id[2] = {htons(filter->vendor_id), htons(filter->device_id)};
 
-    struct pn_dcp_block_header *pn_dcp_block;
-    pn_dcp_block = (struct pn_dcp_block_header *)(buf + send_len);
-    pn_dcp_block->h_option = PN_DCP_BLOCK_OPTION_ALL_SELECTOR;
-    pn_dcp_block->h_suboption = PN_DCP_BLOCK_SUBOPTION_ALL_SELECTOR;
-    pn_dcp_block->h_block_length = 0;
+        send_len = pnt_dcp_add_filter_block(buf, send_len, PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                                            PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_ID, id, sizeof(id));
+    }
 
-    //set the size of the block on the header
-    pn_dcp->h_dcp_data_length = htons(sizeof(*pn_dcp_block));
+    /* no filter block at all selects every device */
+    if (send_len == data_start)
+        send_len = pnt_dcp_add_filter_block(buf, send_len, PN_DCP_BLOCK_OPTION_ALL_SELECTOR,
+                                            PN_DCP_BLOCK_SUBOPTION_ALL_SELECTOR, NULL, 0);
 
-    send_len += sizeof(*pn_dcp_block);
+    //set the size of the blocks on the header
+    pn_dcp->h_dcp_data_length = htons(send_len - data_start);
 
     return send_len;
 }
 
-#define _CHECK_LENGTH(er) \
-    if ((size - ptr) < 0) \
-    {                     \
-        pnt_debug(er);    \
-        return NULL;      \
+/* Make sure len more bytes are available before a header is looked at */
+#define _CHECK_LENGTH(len, er)                           \
+    if ((size - ptr) < (ssize_t)(len))                  \
+    {                                                   \
+        pnt_stats.frames_rejected[PNT_REJECT_LENGTH]++; \
+        pnt_debug(er);                                  \
+        return NULL;                                    \
     }
 
 struct pn_dcp_header *pnt_get_dcp_header(char *buf, ssize_t size, uint8_t *if_addr, uint16_t frameid)
@@ -267,15 +1356,16 @@ struct pn_dcp_header *pnt_get_dcp_header(char *buf, ssize_t size, uint8_t *if_ad
     struct pn_header *pn_hdr;
     struct pn_dcp_header *pn_dcp_hdr;
 
+    _CHECK_LENGTH(sizeof(*eh), "E: Ether header length");
     eh = (struct ether_header *)buf;
     ptr += sizeof(*eh);
-    _CHECK_LENGTH("E: Ether header length");
 
     /* Receive only destination address is broadcast or me. */
     if (if_addr != NULL &&
         memcmp(eh->ether_dhost, if_addr, ETH_ALEN) != 0 &&
         memcmp(eh->ether_dhost, addr_broadcast, ETH_ALEN) != 0)
     {
+        pnt_stats.frames_rejected[PNT_REJECT_ADDRESS]++;
         pnt_debug("E: ethernet address mismatch");
         return NULL;
     }
@@ -285,39 +1375,43 @@ struct pn_dcp_header *pnt_get_dcp_header(char *buf, ssize_t size, uint8_t *if_ad
     if (ethertype == ETH_P_8021Q)
     {
         pnt_debug("pnt_get_dcp_header type vlan");
+        _CHECK_LENGTH(sizeof(struct vlan_hdr), "E: VLAN header length");
         struct vlan_hdr *vlan = (struct vlan_hdr *)(buf + ptr);
         ptr += sizeof(*vlan);
-        _CHECK_LENGTH("E: VLAN header length");
 
         if (ntohs(vlan->h_vlan_encapsulated_proto) != ETH_P_PROFINET)
         {
+            pnt_stats.frames_rejected[PNT_REJECT_VLAN]++;
             pnt_debug("E: vlan proto not PROFINET");
             return NULL;
         }
     }
     else if (ethertype != ETH_P_PROFINET)
     {
+        pnt_stats.frames_rejected[PNT_REJECT_ETHERTYPE]++;
         pnt_debug("E: eth proto not PROFINET");
         return NULL;
     }
 
+    _CHECK_LENGTH(sizeof(*pn_hdr), "E: PN header length");
     pn_hdr = (struct pn_header *)(buf + ptr);
     ptr += sizeof(*pn_hdr);
-    _CHECK_LENGTH("E: PN header length");
 
     if (frameid > 0 && ntohs(pn_hdr->h_frame_id) != frameid)
     {
+        pnt_stats.frames_rejected[PNT_REJECT_FRAME_ID]++;
         pnt_debug("E: PN frameid [%04x] not %04x", ntohs(pn_hdr->h_frame_id), frameid);
         return NULL;
     }
 
+    _CHECK_LENGTH(sizeof(*pn_dcp_hdr), "E: PN DCP header length");
     pn_dcp_hdr = (struct pn_dcp_header *)(buf + ptr);
     ptr += sizeof(*pn_dcp_hdr);
-    _CHECK_LENGTH("E: PN DCP header length");
 
     int dcpdatalength = ntohs(pn_dcp_hdr->h_dcp_data_length);
     if (dcpdatalength > (size - ptr))
     {
+        pnt_stats.frames_rejected[PNT_REJECT_LENGTH]++;
         pnt_debug("E: PN DCP data-length is [%lu], but only [%lu] bytes left", dcpdatalength, (size - ptr));
         return NULL;
     }
@@ -325,67 +1419,233 @@ struct pn_dcp_header *pnt_get_dcp_header(char *buf, ssize_t size, uint8_t *if_ad
     return pn_dcp_hdr;
 }
 
-void pnt_parse_dcp_response_blocks(struct pn_dcp_header *pn_dcp_hdr, struct pn_dcp_identify_response_data *pn_dcp_data)
+/* The 802.1Q TCI a frame arrived with, whether the kernel took it off or
+   it is still in the frame, -1 for an untagged frame */
+int pnt_frame_vlan_tci(const char *buf, ssize_t size, const struct pnt_frame_info *info)
 {
+    const struct ether_header *eh = (const struct ether_header *)buf;
+
+    if (info->vlan_tci >= 0)
+        return info->vlan_tci;
+    if (size >= (ssize_t)(sizeof(*eh) + sizeof(struct vlan_hdr)) && ntohs(eh->ether_type) == ETH_P_8021Q)
+        return ntohs(((const struct vlan_hdr *)(buf + sizeof(*eh)))->h_vlan_TCI);
+
+    return -1;
+}
+
+/*
+ * Split the DCP data of a received PDU into block views without copying
+ * anything. has_blockinfo tells whether each block starts with a 2 byte
+ * BlockInfo (identify/get responses and hello requests). Returns the number
+ * of views. A block that runs past the DCP data, or one more than max,
+ * ends the walk: the blocks before it are still returned and the error is
+ * counted.
+ */
+int pnt_dcp_parse_blocks(const struct pn_dcp_header *pn_dcp_hdr, int has_blockinfo,
+                         struct pnt_dcp_block_view *views, int max)
+{
+    const uint8_t *data = (const uint8_t *)(pn_dcp_hdr + 1);
     int dcpdatalen = ntohs(pn_dcp_hdr->h_dcp_data_length);
     int consumed = 0;
-    char *ptr = (char *)pn_dcp_hdr;
-    ptr += sizeof(*pn_dcp_hdr);
+    int count = 0;
 
-    pnt_debug("pnt_parse_dcp_response_blocks dcp_hdr_len %lu", dcpdatalen);
+    pnt_debug("pnt_dcp_parse_blocks dcp_data_len %d", dcpdatalen);
 
-    while ((dcpdatalen - consumed) > 4) //4: sizeof struct pn_dcp_block_header
+    /* trailing bytes too short for a block header are padding */
+    while ((dcpdatalen - consumed) >= (int)sizeof(struct pn_dcp_block_header))
     {
-        struct pn_dcp_block_header *block_hdr = (struct pn_dcp_block_header *)(ptr + consumed);
-        unsigned int blocklen = ntohs(block_hdr->h_block_length);
-        pnt_debug("pnt_parse_dcp_response_blocks loop consumed:%lu blocklen:%lu", consumed, blocklen);
+        const struct pn_dcp_block_header *block_hdr = (const struct pn_dcp_block_header *)(data + consumed);
+        int blocklen = ntohs(block_hdr->h_block_length);
+        int start = consumed + sizeof(*block_hdr);
 
-        struct pn_dcp_block_dev_props_id *dev_props_id;
-        struct pn_dcp_block_dev_props_role *dev_props_role;
-        struct pn_dcp_block_addr_ip *addr_ip;
+        if (blocklen > dcpdatalen - start)
+        {
+            pnt_stats.parse_errors++;
+            pnt_debug("E: DCP block %u/%u length %d, only %d bytes left",
+                      block_hdr->h_option, block_hdr->h_suboption, blocklen, dcpdatalen - start);
+            break;
+        }
+        if (count == max)
+        {
+            pnt_stats.parse_errors++;
+            pnt_debug("E: more than %d DCP blocks", max);
+            break;
+        }
+
+        struct pnt_dcp_block_view *view = &views[count++];
+        view->option = block_hdr->h_option;
+        view->suboption = block_hdr->h_suboption;
+        view->blockinfo = 0;
+        view->offset = sizeof(*pn_dcp_hdr) + start;
+        view->length = blocklen;
 
-        switch (block_hdr->h_option)
+        if (has_blockinfo && blocklen >= 2)
         {
-        case PN_DCP_BLOCK_OPTION_DEV_PROPS:
+            view->blockinfo = (data[start] << 8) | data[start + 1];
+            view->offset += 2;
+            view->length -= 2;
+        }
+
+        consumed = start + blocklen;
+        consumed += (blocklen % 2); //word alignment
+    }
+
+    return count;
+}
 
-            if (blocklen > 63 || blocklen < 2)
-                break; //prevents under/overflowing our char buffers
+const struct pnt_dcp_block_view *pnt_dcp_find_block(const struct pnt_dcp_block_view *views, int count,
+                                                    uint8_t option, uint8_t suboption)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (views[i].option == option && views[i].suboption == suboption)
+            return &views[i];
+    }
+
+    return NULL;
+}
+
+const uint8_t *pnt_dcp_view_data(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view)
+{
+    return (const uint8_t *)pn_dcp_hdr + view->offset;
+}
+
+/* Copy a text block as a NUL terminated string, truncated to size - 1.
+   Returns the full length of the text, like strlcpy(). */
+size_t pnt_dcp_view_string(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                           char *dst, size_t size)
+{
+    size_t len = view->length;
+
+    if (size > 0)
+    {
+        size_t n = len < size - 1 ? len : size - 1;
+
+        memcpy(dst, pnt_dcp_view_data(pn_dcp_hdr, view), n);
+        dst[n] = '\0';
+    }
+
+    return len;
+}
+
+int pnt_dcp_view_mac(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view, uint8_t *mac)
+{
+    if (view->length < ETH_ALEN)
+        return -1;
+
+    memcpy(mac, pnt_dcp_view_data(pn_dcp_hdr, view), ETH_ALEN);
+    return 0;
+}
 
-            switch (block_hdr->h_suboption)
+int pnt_dcp_view_ip(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                    uint8_t *addr, uint8_t *mask, uint8_t *gateway)
+{
+    const uint8_t *data = pnt_dcp_view_data(pn_dcp_hdr, view);
+
+    if (view->length < 12)
+        return -1;
+
+    memcpy(addr, data, 4);
+    memcpy(mask, data + 4, 4);
+    memcpy(gateway, data + 8, 4);
+    return 0;
+}
+
+int pnt_dcp_view_device_id(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                           uint16_t *vendor, uint16_t *device)
+{
+    const uint8_t *data = pnt_dcp_view_data(pn_dcp_hdr, view);
+
+    if (view->length < 4)
+        return -1;
+
+    *vendor = (data[0] << 8) | data[1];
+    *device = (data[2] << 8) | data[3];
+    return 0;
+}
+
+int pnt_dcp_view_role(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view, uint8_t *role)
+{
+    if (view->length < 1)
+        return -1;
+
+    *role = pnt_dcp_view_data(pn_dcp_hdr, view)[0];
+    return 0;
+}
+
+int pnt_dcp_view_instance(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                          uint8_t *high, uint8_t *low)
+{
+    const uint8_t *data = pnt_dcp_view_data(pn_dcp_hdr, view);
+
+    if (view->length < 2)
+        return -1;
+
+    *high = data[0];
+    *low = data[1];
+    return 0;
+}
+
+/* Copies up to max (option, suboption) pairs, returns how many the block has */
+int pnt_dcp_view_device_options(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                                uint8_t (*options)[2], int max)
+{
+    const uint8_t *data = pnt_dcp_view_data(pn_dcp_hdr, view);
+    int count = view->length / 2;
+
+    for (int i = 0; i < count && i < max; i++)
+    {
+        options[i][0] = data[2 * i];
+        options[i][1] = data[2 * i + 1];
+    }
+
+    return count;
+}
+
+void pnt_parse_dcp_response_blocks(struct pn_dcp_header *pn_dcp_hdr, struct pn_dcp_identify_response_data *pn_dcp_data)
+{
+    struct pnt_dcp_block_view views[PNT_DCP_MAX_BLOCKS];
+    int count;
+
+    count = pnt_dcp_parse_blocks(pn_dcp_hdr, 1, views, PNT_DCP_MAX_BLOCKS);
+
+    for (int i = 0; i < count; i++)
+    {
+        const struct pnt_dcp_block_view *view = &views[i];
+
+        switch (view->option)
+        {
+        case PN_DCP_BLOCK_OPTION_DEV_PROPS:
+            switch (view->suboption)
             {
             case PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_CUSTOM:
-                memcpy(pn_dcp_data->device_vendorvalue, (ptr + consumed) + 6, blocklen - 2);
+                pnt_dcp_view_string(pn_dcp_hdr, view, pn_dcp_data->device_vendorvalue,
+                                    sizeof(pn_dcp_data->device_vendorvalue));
                 break;
             case PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME:
-                memcpy(pn_dcp_data->device_stationname, (ptr + consumed) + 6, blocklen - 2);
+                pnt_dcp_view_string(pn_dcp_hdr, view, pn_dcp_data->device_stationname,
+                                    sizeof(pn_dcp_data->device_stationname));
                 break;
             case PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_ID:
-                dev_props_id = (struct pn_dcp_block_dev_props_id *)block_hdr;
-                pn_dcp_data->device_id_vendor = ntohs(dev_props_id->id_vendor);
-                pn_dcp_data->device_id_device = ntohs(dev_props_id->id_device);
+                pnt_dcp_view_device_id(pn_dcp_hdr, view, &pn_dcp_data->device_id_vendor,
+                                       &pn_dcp_data->device_id_device);
                 break;
             case PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_ROLE:
-                dev_props_role = (struct pn_dcp_block_dev_props_role *)block_hdr;
-                pn_dcp_data->device_role = dev_props_role->dev_role;
+                pnt_dcp_view_role(pn_dcp_hdr, view, &pn_dcp_data->device_role);
                 break;
             }
             break;
 
         case PN_DCP_BLOCK_OPTION_ADDR:
-            switch (block_hdr->h_suboption)
+            switch (view->suboption)
             {
             case PN_DCP_BLOCK_SUBOPTION_ADDR_IP:
-                addr_ip = (struct pn_dcp_block_addr_ip *)block_hdr;
-                pn_dcp_data->device_ip_info = ntohs(addr_ip->h_blockinfo);
-                memcpy(pn_dcp_data->device_ip_addr, addr_ip->addr, 4);
-                memcpy(pn_dcp_data->device_ip_mask, addr_ip->mask, 4);
-                memcpy(pn_dcp_data->device_ip_gateway, addr_ip->gateway, 4);
+                if (pnt_dcp_view_ip(pn_dcp_hdr, view, pn_dcp_data->device_ip_addr,
+                                    pn_dcp_data->device_ip_mask, pn_dcp_data->device_ip_gateway) == 0)
+                    pn_dcp_data->device_ip_info = view->blockinfo;
                 break;
             }
             break;
         }
-
-        consumed += blocklen + 4;
-        consumed += (blocklen % 2); //word alignment
     }
-}
\ No newline at end of file
+}
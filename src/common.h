@@ -6,9 +6,14 @@
 #ifndef __PNT_COMMON__
 #define __PNT_COMMON__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //sendmmsg()
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
@@ -18,24 +23,126 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <net/ethernet.h>
 #include <net/if.h>
+#include <net/if_arp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 
 #include "version.h"
+#include "pntools.h" //the log API is shared with the library
+#include "stats.h"
 
 #define BUF_SIZE (ETH_FRAME_LEN)
 
-#define PNT_DISCOVERY_XID 0x42424242
-#define PNT_FLASHLED_XID  0x24242424
+#define PNT_DCP_RESPONSE_DELAY 128 //identify responses are spread over this many 10 ms slots
+#define PN_DCP_RESPONSE_DELAY_MAX 6400 //largest ResponseDelayFactor a device accepts
+
+/* XIDs carry a random per-process session in the upper half and a counter
+   in the lower one, so a socket filter can drop other processes' responses */
+#define PNT_XID_SESSION_MASK 0xffff0000
 
 static char addr_broadcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 static char addr_broadcast_pn[ETH_ALEN] = {0x01, 0x0e, 0xcf, 0x00, 0x00, 0x00};
 
-#define PNT_VERBOSE_PRINT 1
-#define PNT_VERBOSE_DEBUG 2
+// --- RX ring (PACKET_MMAP, TPACKET_V3) ---
+
+#define PNT_RING_BLOCK_SIZE (1 << 16)
+#define PNT_RING_BLOCK_NR 64
+#define PNT_RING_FRAME_SIZE 2048
+#define PNT_RING_BLOCK_TIMEOUT 2 //ms a partially filled block waits before being handed to userspace
+
+struct pnt_ring
+{
+    unsigned int block_size; //0: PNT_RING_BLOCK_SIZE
+    unsigned int block_nr;   //0: PNT_RING_BLOCK_NR
+    unsigned int block_idx;
+    char *map;               //NULL when the ring could not be set up
+    size_t map_len;
+};
+
+struct pnt_frame_info
+{
+    struct timespec ts; //CLOCK_REALTIME receive timestamp
+    int vlan_tci;       //802.1Q TCI the kernel took off the frame, -1 when there was none
+};
+
+/* Inclusive range of FrameIDs for pnt_attach_frame_id_filter() */
+struct pnt_frame_id_range
+{
+    uint16_t first;
+    uint16_t last;
+};
+
+#define PNT_FRAME_ID_RANGES_MAX 8
+
+typedef void (*pnt_frame_handler)(char *frame, ssize_t len, const struct pnt_frame_info *info, void *arg);
+
+/* Hierarchical timer wheel with 1 ms ticks: level n slots are 64^n ticks
+   wide, so four levels reach about 4.6 hours ahead */
+#define PNT_WHEEL_LEVELS 4
+#define PNT_WHEEL_BITS 6
+#define PNT_WHEEL_SLOTS (1 << PNT_WHEEL_BITS)
+
+struct pnt_timer
+{
+    struct pnt_timer *next; //NULL while not armed
+    struct pnt_timer *prev;
+    uint64_t expires; //CLOCK_MONOTONIC ms
+};
+
+struct pnt_wheel
+{
+    struct pnt_timer slots[PNT_WHEEL_LEVELS][PNT_WHEEL_SLOTS]; //list heads
+    uint64_t now; //last tick processed
+    unsigned int count;
+};
+
+typedef void (*pnt_timer_handler)(struct pnt_timer *timer, void *arg);
+
+/* An outstanding DCP request, embedded in whatever the caller tracks */
+struct pnt_xact
+{
+    uint32_t xid;
+    uint8_t service_id;
+    uint8_t unicast; //only peer may answer
+    uint8_t peer[ETH_ALEN];
+    struct pnt_timer timer;
+    struct timespec sent; //CLOCK_REALTIME of the last (re)transmission
+    void *data;
+};
+
+/* Outstanding requests by XID, open addressing like the device table */
+struct pnt_xact_table
+{
+    struct pnt_xact **slots;
+    unsigned int size; //always a power of two
+    unsigned int count;
+    struct pnt_wheel wheel;
+};
+
+typedef void (*pnt_xact_handler)(struct pnt_xact *xact, void *arg);
+
+/* Identify filter, only devices matching every set field answer. Without
+   any field the request goes to all devices. */
+struct pnt_dcp_filter
+{
+    const char *name;  //NameOfStation
+    const char *alias; //AliasName, <port>.<name of the neighbour>
+    int has_id;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    int response_delay; //10 ms slots, 0: 1 for a name or an alias, else PNT_DCP_RESPONSE_DELAY
+    int vlan_tagged;    //not a filter: send the request with an 802.1Q tag
+    uint16_t vlan_tci;  //priority << 13 | VLAN ID
+};
 
 // ------------------------------------------
 
@@ -43,6 +150,10 @@ static char addr_broadcast_pn[ETH_ALEN] = {0x01, 0x0e, 0xcf, 0x00, 0x00, 0x00};
 
 // --- VLAN ---
 
+#define PNT_VLAN_VID_MASK 0x0fff
+#define PNT_VLAN_PRIO_SHIFT 13
+#define PNT_VLAN_VID_MAX 4094
+
 struct vlan_hdr
 {
     __be16 h_vlan_TCI;
@@ -94,12 +205,84 @@ struct pn_footer
     __u8 f_transfer_status;
 } __attribute__((packed));
 
+#define PN_CYCLE_COUNTER_NS 31250 //the cycle counter counts in 31.25 us steps
+
+#define PN_DATA_STATUS_STATE 0x01           //primary (1) or backup (0)
+#define PN_DATA_STATUS_REDUNDANCY 0x02
+#define PN_DATA_STATUS_DATA_VALID 0x04
+#define PN_DATA_STATUS_PROVIDER_STATE 0x10  //run (1) or stop (0)
+#define PN_DATA_STATUS_STATION_PROBLEM 0x20 //normal (1) or problem (0)
+#define PN_DATA_STATUS_IGNORE 0x80
+
+// --- PN-RTA (alarms) ---
+
+#define PN_RTA_PDU_TYPE_MASK 0x0f //the upper nibble is the version
+#define PN_RTA_PDU_TYPE_DATA 0x01
+#define PN_RTA_PDU_TYPE_NACK 0x02
+#define PN_RTA_PDU_TYPE_ACK 0x03
+#define PN_RTA_PDU_TYPE_ERR 0x04
+
+struct pn_rta_header
+{
+    __be16 h_dst_endpoint;
+    __be16 h_src_endpoint;
+    __u8 h_pdu_type;
+    __u8 h_add_flags;
+    __be16 h_send_seq;
+    __be16 h_ack_seq;
+    __be16 h_var_part_len;
+} __attribute__((packed));
+
+#define PN_BLOCK_TYPE_ALARM_NOTIFICATION_HIGH 0x0001
+#define PN_BLOCK_TYPE_ALARM_NOTIFICATION_LOW 0x0002
+#define PN_BLOCK_TYPE_ALARM_ACK_HIGH 0x8001
+#define PN_BLOCK_TYPE_ALARM_ACK_LOW 0x8002
+
+struct pn_block_header
+{
+    __be16 h_type;
+    __be16 h_length; //bytes after this field
+    __u8 h_version_high;
+    __u8 h_version_low;
+} __attribute__((packed));
+
+#define PN_ALARM_SPECIFIER_SEQUENCE 0x07ff
+#define PN_ALARM_SPECIFIER_CHANNEL_DIAGNOSIS 0x0800
+#define PN_ALARM_SPECIFIER_MANUFACTURER_DIAGNOSIS 0x1000
+#define PN_ALARM_SPECIFIER_SUBMODULE_DIAGNOSIS 0x2000
+#define PN_ALARM_SPECIFIER_AR_DIAGNOSIS 0x8000
+
+/* AlarmNotification, optionally followed by a UserStructureIdentifier
+   and its data */
+struct pn_alarm_notification
+{
+    struct pn_block_header hdr;
+    __be16 alarm_type;
+    __be32 api;
+    __be16 slot;
+    __be16 subslot;
+    __be32 module_ident;
+    __be32 submodule_ident;
+    __be16 alarm_specifier;
+} __attribute__((packed));
+
+struct pn_alarm_ack
+{
+    struct pn_block_header hdr;
+    __be16 alarm_type;
+    __be32 api;
+    __be16 slot;
+    __be16 subslot;
+    __be16 alarm_specifier;
+    __u8 pnio_status[4]; //ErrorCode, ErrorDecode, ErrorCode1, ErrorCode2
+} __attribute__((packed));
+
 // --- PN_DCP ---
 
 #define PN_DCP_SERVICE_ID_GET 3
 #define PN_DCP_SERVICE_ID_SET 4
 #define PN_DCP_SERVICE_ID_IDENTIFY 5
-#define PN_DCP_SERVICE_ID_HELLP 5
+#define PN_DCP_SERVICE_ID_HELLO 6
 
 #define PN_DCP_SERVICE_TYPE_REQUEST 0
 #define PN_DCP_SERVICE_TYPE_RESPONSE_SUCCESS 1
@@ -123,6 +306,7 @@ struct pn_dcp_header
 
 #define PN_DCP_BLOCK_SUBOPTION_ADDR_MAC 1
 #define PN_DCP_BLOCK_SUBOPTION_ADDR_IP 2
+#define PN_DCP_BLOCK_SUBOPTION_ADDR_FULL_IP 3
 
 #define PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_CUSTOM 1
 #define PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME 2
@@ -132,6 +316,16 @@ struct pn_dcp_header
 #define PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_ALIAS 6
 #define PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_INSTANCE 7
 
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_HOSTNAME 12
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_VENDOR_SPEC 43
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_SERVER_ID 54
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_PARAM_REQ 55
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_CLASS_ID 60
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_CLIENT_ID 61
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_FQDN 81
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_UUID 97
+#define PN_DCP_BLOCK_SUBOPTION_DHCP_CONTROL 255
+
 #define PN_DCP_BLOCK_SUBOPTION_CONTROL_START_TRANS 0x01
 #define PN_DCP_BLOCK_SUBOPTION_CONTROL_END_TRANS 0x02
 #define PN_DCP_BLOCK_SUBOPTION_CONTROL_SIGNAL 0x03
@@ -140,6 +334,17 @@ struct pn_dcp_header
 
 #define PN_DCP_BLOCK_SUBOPTION_ALL_SELECTOR 255
 
+#define PN_DCP_BLOCK_QUALIFIER_TEMPORARY 0
+#define PN_DCP_BLOCK_QUALIFIER_PERMANENT 1
+
+#define PN_DCP_BLOCK_ERROR_NONE 0
+#define PN_DCP_BLOCK_ERROR_OPTION_UNSUPPORTED 1
+#define PN_DCP_BLOCK_ERROR_SUBOPTION_UNSUPPORTED 2
+#define PN_DCP_BLOCK_ERROR_SUBOPTION_NOT_SET 3
+#define PN_DCP_BLOCK_ERROR_RESOURCE 4
+#define PN_DCP_BLOCK_ERROR_SET_NOT_POSSIBLE 5
+#define PN_DCP_BLOCK_ERROR_IN_OPERATION 6
+
 struct pn_dcp_block_header
 {
     __u8 h_option;
@@ -194,10 +399,27 @@ struct pn_dcp_block_control_response
     __u8 error;
 } __attribute__((packed));
 
+/* A block of a received DCP PDU, described in place. offset is counted from
+   the start of the DCP header and points past the BlockInfo (when present),
+   length is the size of the block data from there. */
+struct pnt_dcp_block_view
+{
+    uint8_t option;
+    uint8_t suboption;
+    uint16_t blockinfo;
+    uint16_t offset;
+    uint16_t length;
+};
+
+#define PNT_DCP_MAX_BLOCKS 64
+
+#define PN_DCP_NAME_OF_STATION_MAX 240
+#define PN_DCP_VENDOR_VALUE_MAX 255
+
 struct pn_dcp_identify_response_data
 {
-    char device_vendorvalue[64];
-    char device_stationname[64];
+    char device_vendorvalue[PN_DCP_VENDOR_VALUE_MAX + 1];
+    char device_stationname[PN_DCP_NAME_OF_STATION_MAX + 1];
     uint16_t device_id_vendor;
     uint16_t device_id_device;
     uint8_t device_role;
@@ -209,17 +431,79 @@ struct pn_dcp_identify_response_data
 
 // -------------------------------------------
 
-void pnt_set_verbose_level(int lvl);
 int pnt_get_verbose_level();
 void pnt_debug(const char *format, ...);
 void pnt_print(const char *format, ...);
 void dump_buffer(char *buf, unsigned int length);
 
+int pnt_parse_mac(const char *str, uint8_t *mac);
+void pnt_timespec_add_ms(struct timespec *ts, int ms);
+void pnt_deadline_set(struct timespec *deadline, int ms);
+int pnt_deadline_remaining_ms(const struct timespec *deadline);
+
+int pnt_list_ifaces(char names[][IFNAMSIZ], int max);
 int open_raw_sock(char *if_name, uint8_t *if_addr, int *if_index,
-                  int do_promiscuous, int non_block, int reuse, int bind_device);
-int pnt_dcp_create_flashled_request(char *buf, uint8_t *if_src, uint8_t *if_dst);
-int pnt_dcp_create_ident_request(char *buf, uint8_t *if_addr);
+                  int do_promiscuous, int non_block, int reuse, int bind_device,
+                  struct pnt_ring *ring);
+int pnt_ring_dispatch(struct pnt_ring *ring, pnt_frame_handler handler, void *arg);
+int pnt_ring_stats(int sock, struct tpacket_stats_v3 *stats);
+void pnt_ring_close(struct pnt_ring *ring);
+int pnt_recv_dispatch(int sock, char *buf, pnt_frame_handler handler, void *arg);
+int pnt_set_rcvbuf(int sock, int bytes);
+int pnt_enable_tx_timestamps(int sock);
+int pnt_recv_tx_timestamps(int sock, char *buf, pnt_frame_handler handler, void *arg);
+int pnt_attach_dcp_filter(int sock, uint16_t frameid, uint32_t xid, uint32_t xid_mask);
+int pnt_attach_frame_id_filter(int sock, const struct pnt_frame_id_range *ranges, int count);
+int pnt_add_promisc_membership(int sock, int if_index);
+int pnt_add_multicast_membership(int sock, int if_index, const uint8_t *addr);
+int pnt_enable_vlan_auxdata(int sock);
+
+uint64_t pnt_now_ms(void);
+uint32_t pnt_xid_alloc(void);
+void pnt_wheel_init(struct pnt_wheel *wheel);
+void pnt_wheel_add(struct pnt_wheel *wheel, struct pnt_timer *timer, uint64_t expires);
+void pnt_wheel_del(struct pnt_wheel *wheel, struct pnt_timer *timer);
+void pnt_wheel_advance(struct pnt_wheel *wheel, uint64_t now, pnt_timer_handler handler, void *arg);
+int pnt_wheel_next_ms(const struct pnt_wheel *wheel);
+int pnt_xact_table_init(struct pnt_xact_table *table, unsigned int hint);
+void pnt_xact_table_free(struct pnt_xact_table *table);
+int pnt_xact_start(struct pnt_xact_table *table, struct pnt_xact *xact, uint8_t service_id,
+                   const uint8_t *peer, int timeout);
+void pnt_xact_rearm(struct pnt_xact_table *table, struct pnt_xact *xact, int timeout);
+void pnt_xact_finish(struct pnt_xact_table *table, struct pnt_xact *xact);
+struct pnt_xact *pnt_xact_find(struct pnt_xact_table *table, uint32_t xid);
+struct pnt_xact *pnt_xact_match(struct pnt_xact_table *table, const struct pn_dcp_header *pn_dcp_hdr,
+                                const uint8_t *src);
+void pnt_xact_expire(struct pnt_xact_table *table, pnt_xact_handler handler, void *arg);
+int pnt_xact_next_timeout(const struct pnt_xact_table *table);
+
+int pnt_dcp_create_flashled_request(char *buf, uint8_t *if_src, uint8_t *if_dst, uint32_t xid);
+int pnt_dcp_create_get_request(char *buf, uint8_t *if_src, uint8_t *if_dst, uint32_t xid,
+                               uint8_t option, uint8_t suboption);
+int pnt_dcp_create_ident_request(char *buf, uint8_t *if_addr, uint32_t xid, const struct pnt_dcp_filter *filter);
+int pnt_dcp_filter_response_delay(const struct pnt_dcp_filter *filter);
+int pnt_dcp_create_set_request(char *buf, uint8_t *if_src, uint8_t *if_dst, uint32_t xid, uint16_t qualifier,
+                               const char *name, const uint8_t *ip);
 struct pn_dcp_header *pnt_get_dcp_header(char *buf, ssize_t size, uint8_t *if_addr, uint16_t frameid);
+int pnt_frame_vlan_tci(const char *buf, ssize_t size, const struct pnt_frame_info *info);
 void pnt_parse_dcp_response_blocks(struct pn_dcp_header *pn_dcp_hdr, struct pn_dcp_identify_response_data *pn_dcp_data);
 
+int pnt_dcp_parse_blocks(const struct pn_dcp_header *pn_dcp_hdr, int has_blockinfo,
+                         struct pnt_dcp_block_view *views, int max);
+const struct pnt_dcp_block_view *pnt_dcp_find_block(const struct pnt_dcp_block_view *views, int count,
+                                                    uint8_t option, uint8_t suboption);
+const uint8_t *pnt_dcp_view_data(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view);
+size_t pnt_dcp_view_string(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                           char *dst, size_t size);
+int pnt_dcp_view_mac(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view, uint8_t *mac);
+int pnt_dcp_view_ip(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                    uint8_t *addr, uint8_t *mask, uint8_t *gateway);
+int pnt_dcp_view_device_id(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                           uint16_t *vendor, uint16_t *device);
+int pnt_dcp_view_role(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view, uint8_t *role);
+int pnt_dcp_view_instance(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                          uint8_t *high, uint8_t *low);
+int pnt_dcp_view_device_options(const struct pn_dcp_header *pn_dcp_hdr, const struct pnt_dcp_block_view *view,
+                                uint8_t (*options)[2], int max);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,595 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "daemon.h"
+
+static volatile sig_atomic_t pnt_daemon_stop = 0;
+static volatile sig_atomic_t pnt_daemon_dump = 0;
+
+static void
+pnt_daemon_print_usage(const char *progname)
+{
+    fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
+    fprintf(stderr, "usage: %s daemon -i <iface> [-s <socket>] [-r <refresh>] [-e <expire>] [-S <stats>] [-h] [-v] [-d] [-p]\n\n", progname);
+    fprintf(stderr, "Keep an in-memory table of Profinet devices and answer queries on a Unix socket\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -h          Show this help\n");
+    fprintf(stderr, "   -i iface    The interface on which devices will be searched for\n");
+    fprintf(stderr, "   -s socket   Path of the query socket (default=%s)\n", PNT_DAEMON_SOCKET);
+    fprintf(stderr, "   -r refresh  Interval (in ms) between identify requests (default=%d)\n", PNT_DAEMON_REFRESH);
+    fprintf(stderr, "   -e expire   Forget devices not seen for this long, in ms (default=3 x refresh)\n");
+    fprintf(stderr, "   -S stats    Write receive statistics in Prometheus text format to this file\n");
+    fprintf(stderr, "               on every refresh and on SIGUSR1 (to stderr without a file)\n");
+    fprintf(stderr, "   -v          Be verbose\n");
+    fprintf(stderr, "   -d          Show debug information\n");
+    fprintf(stderr, "   -p          Put the interface in promiscuous mode, to also learn from\n");
+    fprintf(stderr, "               identify responses sent to other hosts\n");
+    fprintf(stderr, "\nQueries, one per line:\n");
+    fprintf(stderr, "   list        All known devices, in discovery format plus a last seen column\n");
+    fprintf(stderr, "   get <mac>   A single device\n");
+    fprintf(stderr, "   count       The number of known devices\n");
+    fprintf(stderr, "   refresh     Send an identify request now\n");
+    fprintf(stderr, "   stats       Receive statistics in Prometheus text format\n");
+    fprintf(stderr, "Every answer ends with an empty line.\n");
+}
+
+static void
+pnt_daemon_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        pnt_daemon_dump = 1;
+    else
+        pnt_daemon_stop = 1;
+}
+
+static void
+pnt_daemon_handle_frame(char *buf, ssize_t received, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_daemon *d = arg;
+    struct ether_header *eh = (struct ether_header *)buf;
+
+    /* Responses addressed to other hosts are welcome too, they are just as
+       current as the ones we asked for */
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, received, NULL, PN_FRAME_ID_RTA_DCP_RESPONSE);
+    if (pn_dcp == NULL || pn_dcp->h_service_id != PN_DCP_SERVICE_ID_IDENTIFY)
+        return;
+
+    if (ntohl(pn_dcp->h_xid) == d->xid)
+        pnt_stats_response(&d->sent, &info->ts);
+
+    struct pnt_device *dev;
+    int created;
+
+    dev = pnt_devtable_insert(&d->devices, eh->ether_shost, &created);
+    if (dev == NULL)
+        return;
+
+    if (created)
+    {
+        memcpy(dev->if_name, d->if_name, IFNAMSIZ - 1);
+        dev->first_seen = info->ts;
+        pnt_print("new device %02x:%02x:%02x:%02x:%02x:%02x",
+                  dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4], dev->mac[5]);
+    }
+    dev->last_seen = info->ts;
+
+    memset(&dev->data, 0, sizeof(dev->data));
+    pnt_parse_dcp_response_blocks(pn_dcp, &dev->data);
+}
+
+static int
+pnt_daemon_send_request(struct pnt_daemon *d)
+{
+    char buf[BUF_SIZE];
+    struct sockaddr_ll sock_addr;
+
+    memset(buf, 0, BUF_SIZE);
+    d->xid = pnt_xid_alloc();
+    size_t send_len = pnt_dcp_create_ident_request(buf, d->if_addr, d->xid, NULL);
+
+    memset(&sock_addr, 0, sizeof(sock_addr));
+    sock_addr.sll_ifindex = d->if_index;
+    sock_addr.sll_halen = ETH_ALEN;
+    memcpy(sock_addr.sll_addr, addr_broadcast_pn, ETH_ALEN);
+
+    /* retry at the next refresh, e.g. while the interface is down */
+    pnt_deadline_set(&d->next_refresh, d->refresh);
+
+    if (sendto(d->sock, buf, send_len, 0, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0)
+    {
+        /* once per outage, not once per refresh */
+        if (!d->send_failed)
+            perror("Could not send ident request packet");
+        d->send_failed = 1;
+        return -1;
+    }
+    if (d->send_failed)
+        pnt_print("Identify requests are sent again");
+    d->send_failed = 0;
+
+    clock_gettime(CLOCK_REALTIME, &d->sent);
+    pnt_debug("daemon: identify request sent");
+    return 0;
+}
+
+static void
+pnt_daemon_expire(struct pnt_daemon *d)
+{
+    struct timespec now;
+    uint8_t(*stale)[ETH_ALEN];
+    unsigned int n = 0;
+
+    if (d->devices.count == 0)
+        return;
+
+    stale = malloc(d->devices.count * sizeof(*stale));
+    if (stale == NULL)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (unsigned int i = 0; i < d->devices.size; i++)
+    {
+        struct pnt_device *dev = &d->devices.slots[i];
+
+        if (dev->used && TIME_DIFF_MS(dev->last_seen, now) > d->expire)
+            memcpy(stale[n++], dev->mac, ETH_ALEN);
+    }
+
+    /* removing shifts entries around, so do it after the scan */
+    for (unsigned int i = 0; i < n; i++)
+    {
+        pnt_print("expired device %02x:%02x:%02x:%02x:%02x:%02x",
+                  stale[i][0], stale[i][1], stale[i][2], stale[i][3], stale[i][4], stale[i][5]);
+        pnt_devtable_remove(&d->devices, stale[i]);
+    }
+
+    free(stale);
+}
+
+static int
+pnt_daemon_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("Cannot open query socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Only a socket nobody listens on any more is stale, a live one belongs
+       to another daemon and anything else is not ours to remove */
+    struct stat st;
+
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            fprintf(stderr, "%s exists and is not a socket\n", path);
+            close(fd);
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 || errno == EAGAIN)
+        {
+            fprintf(stderr, "Another daemon is already listening on %s\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+
+        /* a socket that tried to connect cannot bind any more */
+        close(fd);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            perror("Cannot open query socket");
+            return -1;
+        }
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        perror("Cannot listen on query socket");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+pnt_daemon_append(struct pnt_daemon_client *c, const char *str, size_t len)
+{
+    if (c->out_len + len > c->out_cap)
+    {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + len)
+            cap *= 2;
+
+        char *out = realloc(c->out, cap);
+        if (out == NULL)
+            return -1;
+        c->out = out;
+        c->out_cap = cap;
+    }
+
+    memcpy(c->out + c->out_len, str, len);
+    c->out_len += len;
+    return 0;
+}
+
+static void
+pnt_daemon_append_device(struct pnt_daemon_client *c, const struct pnt_device *dev)
+{
+    char line[PNT_DEVICE_LINE_SIZE + 32];
+    int len;
+
+    len = pnt_device_snprint(line, PNT_DEVICE_LINE_SIZE, NULL, dev->mac, &dev->data);
+    if (len >= PNT_DEVICE_LINE_SIZE)
+        len = PNT_DEVICE_LINE_SIZE - 1;
+    len += snprintf(line + len, sizeof(line) - len, "\t%ld.%03ld\n",
+                    (long)dev->last_seen.tv_sec, dev->last_seen.tv_nsec / 1000000L);
+
+    pnt_daemon_append(c, line, len);
+}
+
+static void
+pnt_daemon_query(struct pnt_daemon *d, struct pnt_daemon_client *c, char *line)
+{
+    char *cmd = strtok(line, " \t\r");
+    char *arg = strtok(NULL, " \t\r");
+    char msg[64];
+
+    pnt_debug("daemon: query [%s]", cmd != NULL ? cmd : "");
+
+    if (cmd == NULL)
+        return;
+
+    if (strcmp(cmd, "list") == 0)
+    {
+        for (unsigned int i = 0; i < d->devices.size; i++)
+        {
+            if (d->devices.slots[i].used)
+                pnt_daemon_append_device(c, &d->devices.slots[i]);
+        }
+    }
+    else if (strcmp(cmd, "get") == 0)
+    {
+        uint8_t mac[ETH_ALEN];
+        struct pnt_device *dev;
+
+        if (arg == NULL || pnt_parse_mac(arg, mac) < 0)
+            pnt_daemon_append(c, "error: invalid MAC address\n", 27);
+        else if ((dev = pnt_devtable_find(&d->devices, mac)) == NULL)
+            pnt_daemon_append(c, "error: unknown device\n", 22);
+        else
+            pnt_daemon_append_device(c, dev);
+    }
+    else if (strcmp(cmd, "count") == 0)
+    {
+        int len = snprintf(msg, sizeof(msg), "%u\n", d->devices.count);
+        pnt_daemon_append(c, msg, len);
+    }
+    else if (strcmp(cmd, "refresh") == 0)
+    {
+        if (pnt_daemon_send_request(d) < 0)
+            pnt_daemon_append(c, "error: send failed\n", 19);
+    }
+    else if (strcmp(cmd, "stats") == 0)
+    {
+        struct tpacket_stats_v3 stats;
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f;
+
+        pnt_ring_stats(d->sock, &stats);
+        f = open_memstream(&text, &len);
+        if (f != NULL)
+        {
+            pnt_stats_write(f);
+            fclose(f);
+            pnt_daemon_append(c, text, len);
+            free(text);
+        }
+    }
+    else
+    {
+        pnt_daemon_append(c, "error: unknown command\n", 23);
+    }
+
+    pnt_daemon_append(c, "\n", 1);
+}
+
+static void
+pnt_daemon_close_client(struct pnt_daemon_client *c)
+{
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+/* Returns -1 when the client has to be dropped */
+static int
+pnt_daemon_read_client(struct pnt_daemon *d, struct pnt_daemon_client *c)
+{
+    ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    c->in_len += n;
+
+    char *nl;
+    while ((nl = memchr(c->in, '\n', c->in_len)) != NULL)
+    {
+        *nl = '\0';
+        pnt_daemon_query(d, c, c->in);
+
+        size_t used = nl + 1 - c->in;
+        memmove(c->in, nl + 1, c->in_len - used);
+        c->in_len -= used;
+    }
+
+    if (c->in_len == sizeof(c->in))
+        return -1; //line too long
+
+    return 0;
+}
+
+static int
+pnt_daemon_write_client(struct pnt_daemon_client *c)
+{
+    while (c->out_off < c->out_len)
+    {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        c->out_off += n;
+    }
+
+    c->out_off = 0;
+    c->out_len = 0;
+    return 0;
+}
+
+int pnt_daemon(int argc, char **argv)
+{
+    struct pnt_daemon d;
+    char *socket_path = PNT_DAEMON_SOCKET;
+    int do_promiscuous = 0;
+    int ret = EXIT_FAILURE;
+
+    memset(&d, 0, sizeof(d));
+    d.refresh = PNT_DAEMON_REFRESH;
+    d.listen_fd = -1;
+    for (int i = 0; i < PNT_DAEMON_MAX_CLIENTS; i++)
+        d.clients[i].fd = -1;
+
+    {
+        int opt;
+
+        while ((opt = getopt(argc, argv, "vdpi:s:r:e:S:")) != -1)
+        {
+            switch (opt)
+            {
+            case 'v':
+                pnt_set_verbose_level(PNT_VERBOSE_PRINT);
+                break;
+            case 'd':
+                pnt_set_verbose_level(PNT_VERBOSE_DEBUG);
+                break;
+            case 'p':
+                do_promiscuous = 1;
+                break;
+            case 'i':
+                d.if_name = optarg;
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'r':
+                d.refresh = atoi(optarg);
+                break;
+            case 'e':
+                d.expire = atoi(optarg);
+                break;
+            case 'S':
+                d.stats_file = optarg;
+                break;
+            default: /* '?' */
+                pnt_daemon_print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    if (d.expire <= 0)
+        d.expire = 3 * d.refresh;
+
+    pnt_print("Parameters: iface[%s] socket[%s] verbose_level[%d] promiscuous[%d] refresh[%d] expire[%d]",
+              d.if_name, socket_path, pnt_get_verbose_level(), do_promiscuous, d.refresh, d.expire);
+
+    if (d.if_name == NULL || d.refresh <= 0)
+    {
+        pnt_daemon_print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (pnt_devtable_init(&d.devices, 0) < 0)
+        return EXIT_FAILURE;
+
+    d.sock = open_raw_sock(d.if_name, d.if_addr, &d.if_index, do_promiscuous, 1, 1, 1, &d.ring);
+    if (d.sock < 0)
+    {
+        //error has already been printed
+        pnt_devtable_free(&d.devices);
+        return EXIT_FAILURE;
+    }
+
+    /* Any identify response is useful, not only the ones to our XIDs */
+    if (pnt_attach_dcp_filter(d.sock, PN_FRAME_ID_RTA_DCP_RESPONSE, 0, 0) < 0)
+        pnt_print("Could not attach socket filter, all frames will be received");
+
+    d.listen_fd = pnt_daemon_listen(socket_path);
+    if (d.listen_fd < 0)
+        goto out;
+
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = pnt_daemon_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGUSR1, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (pnt_daemon_send_request(&d) < 0)
+        goto out;
+
+    while (!pnt_daemon_stop)
+    {
+        if (pnt_daemon_dump)
+        {
+            struct tpacket_stats_v3 stats;
+
+            pnt_daemon_dump = 0;
+            pnt_ring_stats(d.sock, &stats);
+            pnt_stats_dump(d.stats_file);
+        }
+
+        struct pollfd pfds[2 + PNT_DAEMON_MAX_CLIENTS];
+        struct pnt_daemon_client *owners[2 + PNT_DAEMON_MAX_CLIENTS];
+        int nfds = 0;
+
+        pfds[nfds].fd = d.sock;
+        pfds[nfds++].events = POLLIN;
+        pfds[nfds].fd = d.listen_fd;
+        pfds[nfds++].events = POLLIN;
+        for (int i = 0; i < PNT_DAEMON_MAX_CLIENTS; i++)
+        {
+            struct pnt_daemon_client *c = &d.clients[i];
+
+            if (c->fd < 0)
+                continue;
+            owners[nfds] = c;
+            pfds[nfds].fd = c->fd;
+            pfds[nfds++].events = c->out_len > 0 ? POLLOUT : POLLIN;
+        }
+
+        int ready = poll(pfds, nfds, pnt_deadline_remaining_ms(&d.next_refresh));
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not poll sockets");
+            break;
+        }
+
+        /* the interface went down, reading the error clears it, the socket
+           keeps working once the link is back */
+        if (pfds[0].revents & POLLERR)
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            getsockopt(d.sock, SOL_SOCKET, SO_ERROR, &err, &len);
+            pnt_debug("daemon: socket error: %s", strerror(err));
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            if (d.ring.map != NULL)
+                pnt_ring_dispatch(&d.ring, pnt_daemon_handle_frame, &d);
+            else
+            {
+                char buf[BUF_SIZE];
+                pnt_recv_dispatch(d.sock, buf, pnt_daemon_handle_frame, &d);
+            }
+        }
+
+        if (pfds[1].revents & POLLIN)
+        {
+            int fd = accept4(d.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0)
+            {
+                int slot = -1;
+                for (int i = 0; i < PNT_DAEMON_MAX_CLIENTS && slot < 0; i++)
+                    if (d.clients[i].fd < 0)
+                        slot = i;
+
+                if (slot < 0)
+                {
+                    pnt_print("Too many clients, refusing connection");
+                    close(fd);
+                }
+                else
+                    d.clients[slot].fd = fd;
+            }
+        }
+
+        for (int i = 2; i < nfds; i++)
+        {
+            struct pnt_daemon_client *c = owners[i];
+            int drop = 0;
+
+            /* a hung up client with nothing left to read would keep poll() from sleeping */
+            if ((pfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) && !(pfds[i].revents & POLLIN))
+                drop = 1;
+            else if (pfds[i].revents & POLLOUT)
+                drop = pnt_daemon_write_client(c) < 0;
+            else if (pfds[i].revents & POLLIN)
+                drop = pnt_daemon_read_client(&d, c) < 0;
+
+            /* answer right away, most replies fit the socket buffer */
+            if (!drop && c->out_len > 0)
+                drop = pnt_daemon_write_client(c) < 0;
+
+            if (drop)
+                pnt_daemon_close_client(c);
+        }
+
+        if (pnt_deadline_remaining_ms(&d.next_refresh) == 0)
+        {
+            pnt_daemon_expire(&d);
+            pnt_daemon_send_request(&d);
+            if (d.stats_file != NULL)
+                pnt_daemon_dump = 1;
+        }
+
+    }
+
+    pnt_print("Stopping");
+    ret = EXIT_SUCCESS;
+
+out:
+    for (int i = 0; i < PNT_DAEMON_MAX_CLIENTS; i++)
+        if (d.clients[i].fd >= 0)
+            pnt_daemon_close_client(&d.clients[i]);
+    if (d.listen_fd >= 0)
+    {
+        close(d.listen_fd);
+        unlink(socket_path);
+    }
+    pnt_ring_close(&d.ring);
+    close(d.sock);
+    pnt_devtable_free(&d.devices);
+
+    return ret;
+}
@@ -0,0 +1,50 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+#include "devtable.h"
+
+#include <signal.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#define PNT_DAEMON_SOCKET "/run/pn-tools.sock"
+#define PNT_DAEMON_REFRESH 30000
+#define PNT_DAEMON_MAX_CLIENTS 64
+#define PNT_DAEMON_LINE_MAX 256
+
+#define TIME_DIFF_MS(s, e) ((e.tv_sec - s.tv_sec) * 1e3 + (e.tv_nsec - s.tv_nsec) / 1e6)
+
+struct pnt_daemon_client
+{
+    int fd;
+    char in[PNT_DAEMON_LINE_MAX];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+};
+
+struct pnt_daemon
+{
+    char *if_name;
+    int sock;
+    int listen_fd;
+    int if_index;
+    uint8_t if_addr[ETH_ALEN];
+    struct pnt_ring ring;
+    struct pnt_devtable devices;
+    struct pnt_daemon_client clients[PNT_DAEMON_MAX_CLIENTS];
+    int refresh;
+    int expire;
+    struct timespec next_refresh;
+    int send_failed;      //the last identify request could not be sent
+    uint32_t xid;         //of the last identify request
+    struct timespec sent; //CLOCK_REALTIME, for the response time histogram
+    char *stats_file;
+};
+
+int pnt_daemon(int argc, char **argv);
@@ -0,0 +1,171 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "devtable.h"
+
+static unsigned int pnt_devtable_hash(const uint8_t *mac)
+{
+    uint64_t key = 0;
+
+    for (int i = 0; i < ETH_ALEN; i++)
+        key = (key << 8) | mac[i];
+
+    /* Fibonacci hashing, the vendor prefix alone would cluster badly */
+    return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+int pnt_devtable_init(struct pnt_devtable *table, unsigned int hint)
+{
+    unsigned int size = PNT_DEVTABLE_MIN_SIZE;
+
+    while (size < hint * 2)
+        size <<= 1;
+
+    table->slots = calloc(size, sizeof(*table->slots));
+    if (table->slots == NULL)
+    {
+        perror("Cannot allocate device table");
+        return -1;
+    }
+    table->size = size;
+    table->count = 0;
+
+    return 0;
+}
+
+void pnt_devtable_free(struct pnt_devtable *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+static struct pnt_device *pnt_devtable_slot(struct pnt_devtable *table, const uint8_t *mac)
+{
+    unsigned int mask = table->size - 1;
+    unsigned int i = pnt_devtable_hash(mac) & mask;
+
+    /* The table is never more than half full, so an empty slot always ends the probe */
+    while (table->slots[i].used && memcmp(table->slots[i].mac, mac, ETH_ALEN) != 0)
+        i = (i + 1) & mask;
+
+    return &table->slots[i];
+}
+
+static int pnt_devtable_grow(struct pnt_devtable *table)
+{
+    struct pnt_devtable bigger;
+
+    if (pnt_devtable_init(&bigger, table->size) < 0)
+        return -1;
+
+    for (unsigned int i = 0; i < table->size; i++)
+    {
+        if (!table->slots[i].used)
+            continue;
+
+        *pnt_devtable_slot(&bigger, table->slots[i].mac) = table->slots[i];
+        bigger.count++;
+    }
+
+    free(table->slots);
+    *table = bigger;
+
+    return 0;
+}
+
+struct pnt_device *pnt_devtable_find(struct pnt_devtable *table, const uint8_t *mac)
+{
+    struct pnt_device *dev = pnt_devtable_slot(table, mac);
+
+    return dev->used ? dev : NULL;
+}
+
+struct pnt_device *pnt_devtable_insert(struct pnt_devtable *table, const uint8_t *mac, int *created)
+{
+    struct pnt_device *dev = pnt_devtable_slot(table, mac);
+
+    *created = 0;
+    if (dev->used)
+        return dev;
+
+    if ((table->count + 1) * 2 > table->size)
+    {
+        if (pnt_devtable_grow(table) < 0)
+            return NULL;
+        dev = pnt_devtable_slot(table, mac);
+    }
+
+    memset(dev, 0, sizeof(*dev));
+    dev->used = 1;
+    memcpy(dev->mac, mac, ETH_ALEN);
+    table->count++;
+    *created = 1;
+
+    return dev;
+}
+
+int pnt_devtable_remove(struct pnt_devtable *table, const uint8_t *mac)
+{
+    unsigned int mask = table->size - 1;
+    struct pnt_device *dev = pnt_devtable_slot(table, mac);
+
+    if (!dev->used)
+        return -1;
+
+    /* Backward shift deletion: move later entries of the probe chain into
+       the hole so lookups never need tombstones */
+    unsigned int hole = dev - table->slots;
+    unsigned int i = hole;
+    for (;;)
+    {
+        i = (i + 1) & mask;
+        if (!table->slots[i].used)
+            break;
+
+        unsigned int home = pnt_devtable_hash(table->slots[i].mac) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+
+    table->slots[hole].used = 0;
+    table->count--;
+
+    return 0;
+}
+
+/* Tab separated device line as printed by discovery, without the newline.
+   The interface column is only added when if_name is not NULL. */
+int pnt_device_snprint(char *str, size_t size, const char *if_name, const uint8_t *mac,
+                       const struct pn_dcp_identify_response_data *data)
+{
+    return snprintf(str, size,
+                    "%s%s%02x:%02x:%02x:%02x:%02x:%02x\t%s\t%s\t%u\t%04x\t%04x\t%u.%u.%u.%u\t%u.%u.%u.%u\t%u.%u.%u.%u\t%u",
+                    if_name != NULL ? if_name : "",
+                    if_name != NULL ? "\t" : "",
+                    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                    data->device_stationname,
+                    data->device_vendorvalue,
+                    data->device_role,
+                    data->device_id_vendor,
+                    data->device_id_device,
+                    data->device_ip_addr[0],
+                    data->device_ip_addr[1],
+                    data->device_ip_addr[2],
+                    data->device_ip_addr[3],
+                    data->device_ip_mask[0],
+                    data->device_ip_mask[1],
+                    data->device_ip_mask[2],
+                    data->device_ip_mask[3],
+                    data->device_ip_gateway[0],
+                    data->device_ip_gateway[1],
+                    data->device_ip_gateway[2],
+                    data->device_ip_gateway[3],
+                    data->device_ip_info);
+}
@@ -0,0 +1,43 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#ifndef __PNT_DEVTABLE__
+#define __PNT_DEVTABLE__
+
+#include "common.h"
+
+#define PNT_DEVTABLE_MIN_SIZE 64
+#define PNT_DEVICE_LINE_SIZE 1024
+
+struct pnt_device
+{
+    uint8_t used;
+    uint8_t mac[ETH_ALEN];
+    char if_name[IFNAMSIZ];
+    uint16_t vlan; //VLAN ID the device answered on, 0: untagged
+    struct pn_dcp_identify_response_data data;
+    struct timespec first_seen;
+    struct timespec last_seen;
+    unsigned int round; //last watch round the device answered in
+};
+
+/* Open addressing hash table of devices keyed by MAC address */
+struct pnt_devtable
+{
+    struct pnt_device *slots;
+    unsigned int size; //always a power of two
+    unsigned int count;
+};
+
+int pnt_devtable_init(struct pnt_devtable *table, unsigned int hint);
+void pnt_devtable_free(struct pnt_devtable *table);
+struct pnt_device *pnt_devtable_find(struct pnt_devtable *table, const uint8_t *mac);
+struct pnt_device *pnt_devtable_insert(struct pnt_devtable *table, const uint8_t *mac, int *created);
+int pnt_devtable_remove(struct pnt_devtable *table, const uint8_t *mac);
+
+int pnt_device_snprint(char *str, size_t size, const char *if_name, const uint8_t *mac,
+                       const struct pn_dcp_identify_response_data *data);
+
+#endif
@@ -5,41 +5,786 @@
 
 #include "discovery.h"
 
+static volatile sig_atomic_t pnt_discovery_stop = 0;
+static volatile sig_atomic_t pnt_discovery_dump = 0;
+
 static void
 pnt_discovery_print_usage(const char *progname)
 {
     fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
-    fprintf(stderr, "usage: %s discovery -i <iface> [-v] [-d] [-h] [-p] [-t <timeout>]\n\n", progname);
+    fprintf(stderr, "usage: %s discovery -i <iface> [-i <iface> ...] [-v] [-d] [-h] [-p] [-R] [--io-uring] [-t <timeout>] [-q <quiet>] [-f <format>] [--expect <n>] [--watch <interval> [--missed <n>]]\n"
+                    "       [--name <name>] [--alias <alias>] [--vendor-id <id> --device-id <id>]\n"
+                    "       [--delay <factor>|auto] [--rcvbuf <bytes>|auto] [--state <dir>] [--stats-file <file>]\n"
+                    "       [--vlan <vid>[:<prio>][,...]]\n\n", progname);
     fprintf(stderr, "Search for Profinet devices and print found ones on each line\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "   -h          Show this help\n");
-    fprintf(stderr, "   -i iface    The interface on which devices will be searched for\n");
+    fprintf(stderr, "   -i iface    The interface on which devices will be searched for. May be repeated,\n");
+    fprintf(stderr, "               \"all\" scans every interface that is up. With more than one\n");
+    fprintf(stderr, "               interface, the interface name is printed as the first column\n");
     fprintf(stderr, "   -v          Be verbose\n");
     fprintf(stderr, "   -d          Show debug information\n");
     fprintf(stderr, "   -o          Print the header of fields \n");
     fprintf(stderr, "   -p          Put the interface in promiscuous mode\n");
     fprintf(stderr, "   -t timeout  Amount of time (in ms) to wait for devices (default=%d)\n", PNT_DISCOVERY_TIMEOUT);
+    fprintf(stderr, "   -q quiet    Stop once the response delay window (default %d ms) has passed and no\n", PNT_DCP_RESPONSE_DELAY * 10);
+    fprintf(stderr, "               response arrived for quiet ms, instead of waiting the whole timeout\n");
+    fprintf(stderr, "   --expect n  Stop as soon as n distinct devices have answered\n");
+    fprintf(stderr, "   --name name Only the device with this NameOfStation answers, stops on its answer\n");
+    fprintf(stderr, "   --alias a   Only the device with this AliasName (<port>.<neighbour>) answers,\n");
+    fprintf(stderr, "               stops on its answer\n");
+    fprintf(stderr, "   --vendor-id id --device-id id\n");
+    fprintf(stderr, "               Only devices with this VendorID and DeviceID answer\n");
+    fprintf(stderr, "   --watch ms  Repeat the identify request every ms and only print changes:\n");
+    fprintf(stderr, "               ADDED, REMOVED and CHANGED (followed by the changed fields)\n");
+    fprintf(stderr, "   --missed n  Rounds a device may miss before it is REMOVED (default=%d)\n", PNT_DISCOVERY_MISSED);
+    fprintf(stderr, "   --delay f   Devices spread their answers over f 10 ms slots (1-%d, default=%d)\n",
+            PN_DCP_RESPONSE_DELAY_MAX, PNT_DCP_RESPONSE_DELAY);
+    fprintf(stderr, "   --rcvbuf b  Bytes of kernel buffer for the answers: the RX ring, or the socket\n");
+    fprintf(stderr, "               buffer with -R\n");
+    fprintf(stderr, "               \"auto\" sizes either from the devices and the kernel drops seen by\n");
+    fprintf(stderr, "               the previous scan of the interface, or the previous watch round\n");
+    fprintf(stderr, "   --vlan list Also send the request 802.1Q tagged on each VLAN of the comma separated\n");
+    fprintf(stderr, "               list of <vid>[:<prio>] (vid 0-%d, prio 0-7, default 0), \"untagged\"\n", PNT_VLAN_VID_MAX);
+    fprintf(stderr, "               stands for the plain request. Adds a VLAN column with the VLAN ID a\n");
+    fprintf(stderr, "               device answered on (0: untagged)\n");
+    fprintf(stderr, "   --state dir Where auto mode remembers interfaces (default=$XDG_CACHE_HOME/pn-tools)\n");
+    fprintf(stderr, "   --stats-file file\n");
+    fprintf(stderr, "               Write receive statistics in Prometheus text format to file on exit,\n");
+    fprintf(stderr, "               after every watch round and on SIGUSR1 (to stderr without a file)\n");
+    fprintf(stderr, "   -R          Receive with recvfrom() instead of the PACKET_MMAP ring\n");
+    fprintf(stderr, "   --io-uring  Send and receive through io_uring, one syscall per batch of frames for all\n");
+    fprintf(stderr, "               interfaces. Falls back to recvfrom() when unavailable%s\n",
+#ifdef PNT_IO_URING
+            ""
+#else
+            " (not built in)"
+#endif
+    );
+    fprintf(stderr, "   -f format   Output format: %s (default=tsv). bin is a stream of\n", PNT_OUTPUT_FORMATS);
+    fprintf(stderr, "               fixed size records, see src/output.h\n");
+}
+
+static void
+pnt_discovery_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        pnt_discovery_dump = 1;
+    else
+        pnt_discovery_stop = 1;
+}
+
+/* Report a CHANGED device when the new identify data differs from the old */
+static void
+pnt_discovery_print_changes(struct pnt_discovery *disc, const struct pnt_device *dev,
+                            const struct pn_dcp_identify_response_data *old)
+{
+    if (memcmp(old, &dev->data, sizeof(*old)) == 0)
+        return;
+
+    pnt_output_device(&disc->out, PNT_EVENT_CHANGED, dev, old);
+}
+
+static void
+pnt_discovery_handle_frame(char *buf, ssize_t received, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_discovery_iface *iface = arg;
+    struct pnt_discovery *disc = iface->disc;
+
+    struct ether_header *eh = (struct ether_header *)buf;
+    if (pnt_get_verbose_level() >= PNT_VERBOSE_DEBUG)
+    {
+        fprintf(stderr, "\ndebug: recv: %02x:%02x:%02x:%02x:%02x:%02x -> %02x:%02x:%02x:%02x:%02x:%02x (%04x)",
+                eh->ether_shost[0],
+                eh->ether_shost[1],
+                eh->ether_shost[2],
+                eh->ether_shost[3],
+                eh->ether_shost[4],
+                eh->ether_shost[5],
+                eh->ether_dhost[0],
+                eh->ether_dhost[1],
+                eh->ether_dhost[2],
+                eh->ether_dhost[3],
+                eh->ether_dhost[4],
+                eh->ether_dhost[5],
+                ntohs(eh->ether_type));
+    }
+
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, received, iface->addr, PN_FRAME_ID_RTA_DCP_RESPONSE);
+    if (pn_dcp == NULL)
+        return;
+
+    /* Only answers to this round's request on this interface count, late
+       ones from an earlier round and other processes' are dropped */
+    struct pnt_xact *xact = pnt_xact_match(&disc->xacts, pn_dcp, eh->ether_shost);
+    if (xact == NULL)
+        return;
+    struct pnt_discovery_target *target = xact->data;
+    if (target->iface != iface)
+        return;
+    iface->responses++;
+    pnt_stats_response(&xact->sent, &info->ts);
+
+    struct pn_dcp_identify_response_data pn_dcp_data;
+    memset(&pn_dcp_data, 0, sizeof(pn_dcp_data));
+    pnt_parse_dcp_response_blocks(pn_dcp, &pn_dcp_data);
+
+    struct pnt_device *dev;
+    int created;
+
+    clock_gettime(CLOCK_MONOTONIC, &disc->last_response);
+    dev = pnt_devtable_insert(&disc->devices, eh->ether_shost, &created);
+    if (dev == NULL)
+        return;
+
+    if (created)
+    {
+        memcpy(dev->if_name, iface->name, IFNAMSIZ);
+        dev->first_seen = info->ts;
+    }
+    dev->last_seen = info->ts;
+    dev->round = disc->round;
+
+    /* the tag the answer came with, the kernel may have taken it off; the
+       XID already tells which request it answers, so without one the
+       request's VLAN is what the device is on */
+    int tci = pnt_frame_vlan_tci(buf, received, info);
+    if (tci < 0 && target->vlan.tagged)
+        tci = target->vlan.tci;
+    dev->vlan = tci > 0 ? tci & PNT_VLAN_VID_MASK : 0;
+
+    if (!disc->watch)
+    {
+        /* every response is a line, as it always was */
+        memcpy(dev->if_name, iface->name, IFNAMSIZ);
+        dev->data = pn_dcp_data;
+        pnt_output_device(&disc->out, PNT_EVENT_NONE, dev, NULL);
+        return;
+    }
+
+    if (created)
+    {
+        dev->data = pn_dcp_data;
+        pnt_output_device(&disc->out, PNT_EVENT_ADDED, dev, NULL);
+    }
+    else
+    {
+        struct pn_dcp_identify_response_data old = dev->data;
+
+        dev->data = pn_dcp_data;
+        pnt_discovery_print_changes(disc, dev, &old);
+    }
+}
+
+/* Size the next request from a round in which devices answered and drops
+   of the answers were lost in the kernel: a delay slot gets
+   PNT_DISCOVERY_SLOT_DEVICES answers and each answer room in the buffer.
+   After a lossy round both at least double. */
+static void
+pnt_discovery_autosize(struct pnt_discovery_iface *iface, unsigned int devices, unsigned int drops)
+{
+    struct pnt_discovery *disc = iface->disc;
+
+    /* a name or an alias already selects a single device */
+    if (disc->delay == PNT_DISCOVERY_AUTO && disc->filter.name == NULL && disc->filter.alias == NULL)
+    {
+        long used = iface->delay > 0 ? iface->delay : PNT_DCP_RESPONSE_DELAY;
+        long delay = (devices + PNT_DISCOVERY_SLOT_DEVICES - 1) / PNT_DISCOVERY_SLOT_DEVICES;
+
+        if (drops > 0 && delay < used * 2)
+            delay = used * 2;
+        if (delay < 1)
+            delay = 1;
+        if (delay > PN_DCP_RESPONSE_DELAY_MAX)
+            delay = PN_DCP_RESPONSE_DELAY_MAX;
+        iface->delay = delay;
+    }
+
+    if (disc->rcvbuf == PNT_DISCOVERY_AUTO)
+    {
+        long rcvbuf = (long)devices * PNT_DISCOVERY_RCVBUF_PER_DEVICE;
+
+        if (drops > 0 && rcvbuf < iface->rcvbuf * 2L)
+            rcvbuf = iface->rcvbuf * 2L;
+        if (rcvbuf < PNT_DISCOVERY_RCVBUF_MIN)
+            rcvbuf = PNT_DISCOVERY_RCVBUF_MIN;
+        if (rcvbuf > PNT_DISCOVERY_RCVBUF_MAX)
+            rcvbuf = PNT_DISCOVERY_RCVBUF_MAX;
+        iface->rcvbuf = rcvbuf;
+    }
+
+    pnt_debug("%s: %u devices and %u drops, next delay[%d] rcvbuf[%d]", iface->name, devices, drops,
+              iface->delay, iface->rcvbuf);
+}
+
+static int
+pnt_discovery_state_path(struct pnt_discovery_iface *iface, char *path, size_t size)
+{
+    struct pnt_discovery *disc = iface->disc;
+
+    if (disc->state_dir[0] == '\0')
+        return -1;
+
+    return snprintf(path, size, "%s/%s", disc->state_dir, iface->name) < (int)size ? 0 : -1;
+}
+
+/* Start from the fixed values, or from what the last scan of the interface
+   learned in auto mode: the saved values were already sized from its
+   devices and drops. The first auto scan uses the defaults. */
+static void
+pnt_discovery_load_state(struct pnt_discovery_iface *iface)
+{
+    struct pnt_discovery *disc = iface->disc;
+    char path[PATH_MAX + IFNAMSIZ];
+    unsigned int devices, drops;
+    int delay, rcvbuf;
+    FILE *f;
+
+    iface->delay = disc->delay > 0 ? disc->delay : 0;
+    iface->rcvbuf = disc->rcvbuf > 0 ? disc->rcvbuf : 0;
+
+    if ((disc->delay != PNT_DISCOVERY_AUTO && disc->rcvbuf != PNT_DISCOVERY_AUTO) ||
+        pnt_discovery_state_path(iface, path, sizeof(path)) < 0 || (f = fopen(path, "r")) == NULL)
+        return;
+
+    if (fscanf(f, "devices %u drops %u delay %d rcvbuf %d", &devices, &drops, &delay, &rcvbuf) == 4)
+    {
+        if (disc->delay == PNT_DISCOVERY_AUTO)
+            iface->delay = delay;
+        if (disc->rcvbuf == PNT_DISCOVERY_AUTO)
+            iface->rcvbuf = rcvbuf;
+        pnt_debug("%s: last scan had %u devices and %u drops", path, devices, drops);
+    }
+    else
+        pnt_debug("%s: ignoring malformed state file", path);
+
+    fclose(f);
+}
+
+static void
+pnt_discovery_save_state(struct pnt_discovery_iface *iface)
+{
+    char path[PATH_MAX + IFNAMSIZ];
+    FILE *f;
+
+    if (pnt_discovery_state_path(iface, path, sizeof(path)) < 0)
+        return;
+
+    /* like mkdir -p, for a first run */
+    for (char *p = path + 1; *p; p++)
+    {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+
+    f = fopen(path, "w");
+    if (f == NULL)
+    {
+        pnt_debug("%s: cannot save state: %s", path, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "devices %u\ndrops %u\ndelay %d\nrcvbuf %d\n", iface->last_devices, iface->last_drops,
+            iface->delay > 0 ? iface->delay : PNT_DCP_RESPONSE_DELAY, iface->rcvbuf);
+    fclose(f);
+}
+
+/* End of a round: count the answers the kernel dropped and, in auto mode,
+   size the next round from this one */
+static void
+pnt_discovery_tally(struct pnt_discovery_iface *iface)
+{
+    struct tpacket_stats_v3 stats;
+
+    if (pnt_ring_stats(iface->sock, &stats) < 0)
+        pnt_debug("%s: PACKET_STATISTICS: %s", iface->name, strerror(errno));
+
+    /* a statistics dump may have read some of them already */
+    unsigned int drops = stats.tp_drops + iface->drops;
+
+    iface->drops = 0;
+    if (iface->ring.map != NULL)
+        pnt_print("%s: ring statistics: packets[%u] drops[%u] freezes[%u]",
+                  iface->name, stats.tp_packets, drops, stats.tp_freeze_q_cnt);
+    else
+        pnt_print("%s: socket statistics: packets[%u] drops[%u]", iface->name, stats.tp_packets, drops);
+    if (drops > 0)
+        fprintf(stderr, "warning: %s: the kernel dropped %u frames, some devices may be missing\n",
+                iface->name, drops);
+
+    iface->last_devices = iface->responses + drops;
+    iface->last_drops = drops;
+    iface->responses = 0;
+    iface->tallied = 1;
+
+    int rcvbuf = iface->rcvbuf;
+
+    pnt_discovery_autosize(iface, iface->last_devices, iface->last_drops);
+
+    /* a socket buffer can grow in place, a ring only on the next scan */
+    if (iface->ring.map == NULL && iface->rcvbuf != rcvbuf)
+        pnt_set_rcvbuf(iface->sock, iface->rcvbuf);
+}
+
+static int
+pnt_discovery_target_count(const struct pnt_discovery *disc)
+{
+    return disc->vlan_count > 0 ? disc->vlan_count : 1;
+}
+
+static int
+pnt_discovery_open_iface(struct pnt_discovery_iface *iface, int do_promiscuous, int do_ring)
+{
+    struct pnt_discovery *disc = iface->disc;
+
+    memset(&iface->ring, 0, sizeof(iface->ring));
+    if (iface->rcvbuf > 0)
+        iface->ring.block_nr = (iface->rcvbuf + PNT_RING_BLOCK_SIZE - 1) / PNT_RING_BLOCK_SIZE;
+
+    iface->sock = open_raw_sock(iface->name, iface->addr, &iface->index, do_promiscuous, 1, 1, 1,
+                                do_ring ? &iface->ring : NULL);
+    if (iface->sock < 0)
+        return -1;
+
+    if (iface->ring.map != NULL)
+    {
+        iface->rcvbuf = iface->ring.block_size * iface->ring.block_nr;
+    }
+    else if (iface->rcvbuf > 0)
+    {
+        pnt_set_rcvbuf(iface->sock, iface->rcvbuf);
+    }
+    else
+    {
+        socklen_t len = sizeof(iface->rcvbuf);
+
+        /* the kernel reports twice the size asked for, its overhead included */
+        if (getsockopt(iface->sock, SOL_SOCKET, SO_RCVBUF, &iface->rcvbuf, &len) == 0)
+            iface->rcvbuf /= 2;
+    }
+    pnt_print("%s: response delay[%d] receive buffer[%d]", iface->name,
+              iface->delay > 0 ? iface->delay : pnt_dcp_filter_response_delay(&iface->disc->filter), iface->rcvbuf);
+
+    /* Only identify responses to this process' requests have to leave the kernel */
+    if (pnt_attach_dcp_filter(iface->sock, PN_FRAME_ID_RTA_DCP_RESPONSE, pnt_xid_alloc(), PNT_XID_SESSION_MASK) < 0)
+        pnt_print("%s: could not attach socket filter, all frames will be received", iface->name);
+    if (disc->vlan_count > 0 && iface->ring.map == NULL)
+        pnt_enable_vlan_auxdata(iface->sock);
+
+    iface->targets = calloc(pnt_discovery_target_count(disc), sizeof(*iface->targets));
+    if (iface->targets == NULL)
+    {
+        perror("Cannot allocate identify requests");
+        pnt_ring_close(&iface->ring);
+        close(iface->sock);
+        return -1;
+    }
+    for (int i = 0; i < pnt_discovery_target_count(disc); i++)
+    {
+        iface->targets[i].iface = iface;
+        if (disc->vlan_count > 0)
+            iface->targets[i].vlan = disc->vlans[i];
+    }
+
+    return 0;
+}
+
+static void
+pnt_discovery_close_iface(struct pnt_discovery_iface *iface)
+{
+    struct pnt_discovery *disc = iface->disc;
+
+    if (iface->tallied && (disc->delay == PNT_DISCOVERY_AUTO || disc->rcvbuf == PNT_DISCOVERY_AUTO))
+        pnt_discovery_save_state(iface);
+
+    pnt_ring_close(&iface->ring);
+
+    close(iface->sock);
+    iface->sock = -1;
+    free(iface->targets);
+    iface->targets = NULL;
+}
+
+/* One identify request per VLAN of the interface, all in one sendmmsg() */
+static int
+pnt_discovery_send_request(struct pnt_discovery_iface *iface)
+{
+    struct pnt_discovery *disc = iface->disc;
+    int count = pnt_discovery_target_count(disc);
+    struct mmsghdr msgs[count];
+    struct iovec iovs[count];
+    struct sockaddr_ll sock_addr;
+    struct pnt_dcp_filter filter = disc->filter;
+
+    filter.response_delay = iface->delay;
+    if (pnt_dcp_filter_response_delay(&filter) * 10 > disc->window)
+        disc->window = pnt_dcp_filter_response_delay(&filter) * 10;
+
+    memset(&sock_addr, 0, sizeof(sock_addr));
+    sock_addr.sll_ifindex = iface->index;
+    sock_addr.sll_halen = ETH_ALEN;
+    memcpy(sock_addr.sll_addr, addr_broadcast_pn, ETH_ALEN);
+
+    for (int i = 0; i < count; i++)
+    {
+        struct pnt_discovery_target *target = &iface->targets[i];
+
+        /* Every round is a new transaction, the previous one is over */
+        if (target->xact.data != NULL)
+            pnt_xact_finish(&disc->xacts, &target->xact);
+        target->xact.data = target;
+        if (pnt_xact_start(&disc->xacts, &target->xact, PN_DCP_SERVICE_ID_IDENTIFY, NULL, 0) < 0)
+        {
+            target->xact.data = NULL;
+            return -1;
+        }
+
+        memset(target->request, 0, BUF_SIZE);
+        filter.vlan_tagged = target->vlan.tagged;
+        filter.vlan_tci = target->vlan.tci;
+        iovs[i].iov_base = target->request;
+        iovs[i].iov_len = pnt_dcp_create_ident_request(target->request, iface->addr, target->xact.xid, &filter);
+
+        /* goes out with the other interfaces' in pnt_discovery_send_requests() */
+        if (disc->use_uring)
+        {
+            if (pnt_uring_send(&disc->uring, iface->sock, target->request, iovs[i].iov_len) < 0)
+                return -1;
+            continue;
+        }
+
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &sock_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sock_addr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (int done = 0; !disc->use_uring && done < count;)
+    {
+        int ret = sendmmsg(iface->sock, msgs + done, count - done, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: ", iface->name);
+            perror("Could not send ident request packet");
+            return -1;
+        }
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* Send the identify request on every interface at once, so every segment
+   answers within the same timeout */
+static int
+pnt_discovery_send_requests(struct pnt_discovery *disc)
+{
+    disc->window = 0;
+    for (int i = 0; i < disc->if_count; i++)
+    {
+        if (pnt_discovery_send_request(&disc->ifaces[i]) < 0)
+            return -1;
+    }
+
+    if (disc->use_uring)
+        return pnt_uring_submit(&disc->uring);
+
+    return 0;
+}
+
+/* Bring the kernel counters up to date and write the statistics out */
+static void
+pnt_discovery_dump_stats(struct pnt_discovery *disc)
+{
+    for (int i = 0; i < disc->if_count; i++)
+    {
+        struct tpacket_stats_v3 stats;
+
+        if (pnt_ring_stats(disc->ifaces[i].sock, &stats) == 0)
+            disc->ifaces[i].drops += stats.tp_drops;
+    }
+
+    pnt_stats_dump(disc->stats_file);
+}
+
+/* Handle responses until the deadline, or until the quiet period or the
+   expected device count end the scan early */
+static void
+pnt_discovery_collect(struct pnt_discovery *disc, const struct timespec *deadline)
+{
+    struct timespec window_end;
+    struct timespec started;
+
+    pnt_deadline_set(&window_end, disc->window);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    /* Sleep in poll() until a frame arrives or the deadline expires,
+       then drain everything queued on the sockets before sleeping again. */
+    for (int remaining; !pnt_discovery_stop && (remaining = pnt_deadline_remaining_ms(deadline)) > 0;)
+    {
+        if (pnt_discovery_dump)
+        {
+            pnt_discovery_dump = 0;
+            pnt_discovery_dump_stats(disc);
+        }
+
+        if (disc->expect > 0 && disc->devices.count >= disc->expect)
+        {
+            pnt_print("All %u expected devices answered", disc->expect);
+            break;
+        }
+
+        if (disc->quiet > 0)
+        {
+            /* Devices answer within the response delay window, after that
+               only wait while responses keep coming in. The quiet period
+               runs from the last response of this scan, or from the
+               request when nothing answered (yet). */
+            int window = pnt_deadline_remaining_ms(&window_end);
+            struct timespec quiet_end = started;
+
+            if (disc->last_response.tv_sec > started.tv_sec ||
+                (disc->last_response.tv_sec == started.tv_sec && disc->last_response.tv_nsec > started.tv_nsec))
+                quiet_end = disc->last_response;
+            pnt_timespec_add_ms(&quiet_end, disc->quiet);
+
+            int idle = pnt_deadline_remaining_ms(&quiet_end);
+
+            if (window > idle)
+                idle = window;
+            if (idle <= 0)
+            {
+                pnt_print("No response for %d ms, stopping", disc->quiet);
+                break;
+            }
+            if (idle < remaining)
+                remaining = idle;
+        }
+
+        if (disc->use_uring)
+        {
+            struct pollfd pfd = {.fd = pnt_uring_fd(&disc->uring), .events = POLLIN};
+
+            int ready = poll(&pfd, 1, remaining);
+            if (ready < 0 && errno != EINTR)
+            {
+                perror("Could not poll io_uring");
+                break;
+            }
+            if (ready > 0 && pnt_uring_dispatch(&disc->uring) < 0)
+                break;
+
+            if (disc->stream)
+                pnt_output_flush(&disc->out);
+            continue;
+        }
+
+        int ready = poll(disc->pfds, disc->if_count, remaining);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not poll sockets");
+            break;
+        }
+        if (ready == 0)
+            continue;
+
+        for (int i = 0; i < disc->if_count; i++)
+        {
+            struct pnt_discovery_iface *iface = &disc->ifaces[i];
+
+            if (disc->pfds[i].revents & (POLLERR | POLLNVAL))
+            {
+                pnt_debug("%s: poll error on socket (revents %04x)", iface->name, disc->pfds[i].revents);
+                disc->pfds[i].fd = -1;
+                continue;
+            }
+            if (!(disc->pfds[i].revents & POLLIN))
+                continue;
+
+            if (iface->ring.map != NULL)
+                pnt_ring_dispatch(&iface->ring, pnt_discovery_handle_frame, iface);
+            else if (pnt_recv_dispatch(iface->sock, disc->buf, pnt_discovery_handle_frame, iface) < 0)
+                disc->pfds[i].fd = -1;
+        }
+
+        /* records are written as they come in, a json array or bin stream
+           of a single scan in one go at the end */
+        if (disc->stream)
+            pnt_output_flush(&disc->out);
+    }
+}
+
+/* Report and forget the devices that missed too many watch rounds */
+static void
+pnt_discovery_end_round(struct pnt_discovery *disc)
+{
+    uint8_t(*gone)[ETH_ALEN];
+    unsigned int n = 0;
+
+    for (int i = 0; i < disc->if_count; i++)
+        pnt_discovery_tally(&disc->ifaces[i]);
+
+    if (disc->devices.count > 0)
+    {
+        gone = malloc(disc->devices.count * sizeof(*gone));
+        if (gone == NULL)
+            return;
+
+        for (unsigned int i = 0; i < disc->devices.size; i++)
+        {
+            struct pnt_device *dev = &disc->devices.slots[i];
+
+            if (!dev->used || disc->round - dev->round < (unsigned int)disc->missed)
+                continue;
+
+            pnt_output_device(&disc->out, PNT_EVENT_REMOVED, dev, NULL);
+            memcpy(gone[n++], dev->mac, ETH_ALEN);
+        }
+
+        /* removing shifts entries around, so do it after the scan */
+        for (unsigned int i = 0; i < n; i++)
+            pnt_devtable_remove(&disc->devices, gone[i]);
+
+        free(gone);
+    }
+
+    pnt_output_flush(&disc->out);
+    disc->round++;
+}
+
+/* A whole non-negative number up to max (decimal, 0x hex or 0 octal), -1 otherwise */
+static long
+pnt_discovery_parse_number(const char *arg, long max)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno != 0 || value < 0 || value > max)
+        return -1;
+
+    return value;
+}
+
+/* "<vid>[:<prio>]" or "untagged", comma separated. -1 on a malformed list */
+static int
+pnt_discovery_parse_vlans(struct pnt_discovery *disc, const char *list)
+{
+    const char *p = list;
+
+    while (*p != '\0')
+    {
+        struct pnt_discovery_vlan vlan = {0, 0};
+        char *end;
+
+        if (disc->vlan_count >= PNT_DISCOVERY_MAX_VLANS)
+        {
+            fprintf(stderr, "At most %d VLANs are supported\n", PNT_DISCOVERY_MAX_VLANS);
+            return -1;
+        }
+
+        if (strncmp(p, "untagged", 8) == 0)
+        {
+            end = (char *)p + 8;
+        }
+        else
+        {
+            long vid = strtol(p, &end, 10);
+            long prio = 0;
+
+            if (end == p || vid < 0 || vid > PNT_VLAN_VID_MAX)
+                return -1;
+            if (*end == ':')
+            {
+                p = end + 1;
+                prio = strtol(p, &end, 10);
+                if (end == p || prio < 0 || prio > 7)
+                    return -1;
+            }
+            vlan.tagged = 1;
+            vlan.tci = (uint16_t)(prio << PNT_VLAN_PRIO_SHIFT | vid);
+        }
+
+        if (*end == ',' && end[1] != '\0')
+            end++;
+        else if (*end != '\0')
+            return -1;
+
+        disc->vlans[disc->vlan_count++] = vlan;
+        p = end;
+    }
+
+    return disc->vlan_count > 0 ? 0 : -1;
+}
+
+static void
+pnt_discovery_close(struct pnt_discovery *disc)
+{
+    if (disc->use_uring)
+        pnt_uring_close(&disc->uring);
+
+    for (int i = 0; i < disc->if_count; i++)
+        pnt_discovery_close_iface(&disc->ifaces[i]);
+
+    pnt_devtable_free(&disc->devices);
+    pnt_xact_table_free(&disc->xacts);
+    pnt_output_close(&disc->out);
 }
 
 int pnt_discovery(int argc, char **argv)
 {
-    char *if_name;
-    int if_name_set = 0;
+    struct pnt_discovery *disc;
+    struct pnt_discovery_iface *ifaces;
+    int if_count = 0;
+    int if_all = 0;
     int do_headers = 0;
     int do_promiscuous = 0;
-    int timeout = PNT_DISCOVERY_TIMEOUT;
-    int sock;
-    int if_index;
-    uint8_t if_addr[ETH_ALEN];
-    uint8_t dest_addr[ETH_ALEN];
-    char buf[BUF_SIZE];
+    int do_ring = 1;
+    int format = PNT_OUTPUT_TSV;
+    long vendor_id = -1;
+    long device_id = -1;
+    const char *state_dir = NULL;
+    int bad_arg = 0;
 
-    memcpy(dest_addr, addr_broadcast_pn, ETH_ALEN);
+    disc = calloc(1, sizeof(*disc));
+    if (disc == NULL)
+    {
+        perror("Cannot allocate discovery state");
+        return EXIT_FAILURE;
+    }
+    ifaces = disc->ifaces;
+    disc->timeout = PNT_DISCOVERY_TIMEOUT;
+    disc->missed = PNT_DISCOVERY_MISSED;
+    disc->uring.fd = -1;
 
     {
+        static const struct option long_options[] = {
+            {"expect", required_argument, NULL, 'e'},
+            {"watch", required_argument, NULL, 'W'},
+            {"missed", required_argument, NULL, 'M'},
+            {"name", required_argument, NULL, 'N'},
+            {"alias", required_argument, NULL, 'A'},
+            {"vendor-id", required_argument, NULL, 'V'},
+            {"device-id", required_argument, NULL, 'D'},
+            {"delay", required_argument, NULL, 'Y'},
+            {"rcvbuf", required_argument, NULL, 'B'},
+            {"state", required_argument, NULL, 'S'},
+            {"stats-file", required_argument, NULL, 'P'},
+            {"io-uring", no_argument, NULL, 'U'},
+            {"vlan", required_argument, NULL, 'L'},
+            {NULL, 0, NULL, 0}};
         int opt;
 
-        while ((opt = getopt(argc, argv, "vdopt:i:")) != -1)
+        while ((opt = getopt_long(argc, argv, "vdopRt:q:i:f:", long_options, NULL)) != -1)
         {
             switch (opt)
             {
@@ -55,140 +800,303 @@ int pnt_discovery(int argc, char **argv)
             case 'p':
                 do_promiscuous = 1;
                 break;
+            case 'R':
+                do_ring = 0;
+                break;
+            case 'U':
+                disc->use_uring = 1;
+                do_ring = 0;
+                break;
             case 't':
-                timeout = atoi(optarg);
+                disc->timeout = atoi(optarg);
+                break;
+            case 'q':
+                disc->quiet = atoi(optarg);
+                break;
+            case 'e':
+                disc->expect = atoi(optarg);
+                break;
+            case 'W':
+                disc->watch = atoi(optarg);
+                break;
+            case 'M':
+                disc->missed = atoi(optarg);
+                break;
+            case 'f':
+                format = pnt_output_parse_format(optarg);
+                break;
+            case 'N':
+                disc->filter.name = optarg;
+                break;
+            case 'A':
+                disc->filter.alias = optarg;
+                break;
+            case 'V':
+                if ((vendor_id = pnt_discovery_parse_number(optarg, 0xffff)) < 0)
+                    bad_arg = 1;
+                break;
+            case 'D':
+                if ((device_id = pnt_discovery_parse_number(optarg, 0xffff)) < 0)
+                    bad_arg = 1;
+                break;
+            case 'Y':
+                if (strcmp(optarg, "auto") == 0)
+                    disc->delay = PNT_DISCOVERY_AUTO;
+                else if ((disc->delay = pnt_discovery_parse_number(optarg, PN_DCP_RESPONSE_DELAY_MAX)) < 0)
+                    bad_arg = 1;
+                break;
+            case 'B':
+                if (strcmp(optarg, "auto") == 0)
+                    disc->rcvbuf = PNT_DISCOVERY_AUTO;
+                else if ((disc->rcvbuf = pnt_discovery_parse_number(optarg, INT_MAX)) < 0)
+                    bad_arg = 1;
+                break;
+            case 'S':
+                state_dir = optarg;
+                break;
+            case 'P':
+                disc->stats_file = optarg;
+                break;
+            case 'L':
+                if (pnt_discovery_parse_vlans(disc, optarg) < 0)
+                {
+                    pnt_discovery_print_usage(argv[0]);
+                    free(disc);
+                    return EXIT_FAILURE;
+                }
                 break;
             case 'i':
-                if_name = optarg;
-                if_name_set = 1;
+                if (strcmp(optarg, "all") == 0)
+                {
+                    if_all = 1;
+                    break;
+                }
+                if (if_count >= PNT_DISCOVERY_MAX_IFACES)
+                {
+                    fprintf(stderr, "At most %d interfaces are supported\n", PNT_DISCOVERY_MAX_IFACES);
+                    free(disc);
+                    return EXIT_FAILURE;
+                }
+                strncpy(ifaces[if_count++].name, optarg, IFNAMSIZ - 1);
                 break;
             default: /* '?' */
                 pnt_discovery_print_usage(argv[0]);
+                free(disc);
                 return EXIT_FAILURE;
             }
         }
     }
 
-    pnt_print("Parameters: iface[%s] verbose_level[%d] headers[%d] promiscuous[%d] timeout[%d]",
-              if_name, pnt_get_verbose_level(), do_headers, do_promiscuous, timeout);
+    if (if_all)
+    {
+        char names[PNT_DISCOVERY_MAX_IFACES][IFNAMSIZ];
+        int found = pnt_list_ifaces(names, PNT_DISCOVERY_MAX_IFACES);
+
+        for (int i = 0; i < found && if_count < PNT_DISCOVERY_MAX_IFACES; i++)
+        {
+            int dup = 0;
+            for (int j = 0; j < if_count; j++)
+                dup |= strcmp(ifaces[j].name, names[i]) == 0;
+            if (!dup)
+                memcpy(ifaces[if_count++].name, names[i], IFNAMSIZ);
+        }
+    }
+
+    pnt_print("Parameters: ifaces[%d] verbose_level[%d] headers[%d] promiscuous[%d] ring[%d] timeout[%d] quiet[%d] expect[%u] watch[%d] missed[%d] format[%d] delay[%d] rcvbuf[%d] vlans[%d]",
+              if_count, pnt_get_verbose_level(), do_headers, do_promiscuous, do_ring,
+              disc->timeout, disc->quiet, disc->expect, disc->watch, disc->missed, format, disc->delay, disc->rcvbuf, disc->vlan_count);
 
-    if (!if_name_set)
+    /* both IDs travel in the same filter block */
+    if (bad_arg || (vendor_id >= 0) != (device_id >= 0) || vendor_id > 0xffff || device_id > 0xffff ||
+        disc->delay > PN_DCP_RESPONSE_DELAY_MAX || disc->delay < PNT_DISCOVERY_AUTO ||
+        disc->rcvbuf < PNT_DISCOVERY_AUTO ||
+        (disc->filter.name != NULL && strlen(disc->filter.name) > PN_DCP_NAME_OF_STATION_MAX) ||
+        (disc->filter.alias != NULL && strlen(disc->filter.alias) > PN_DCP_NAME_OF_STATION_MAX))
     {
         pnt_discovery_print_usage(argv[0]);
+        free(disc);
         return EXIT_FAILURE;
     }
+    disc->filter.has_id = vendor_id >= 0;
+    disc->filter.vendor_id = vendor_id;
+    disc->filter.device_id = device_id;
+    if (disc->delay > 0)
+        disc->filter.response_delay = disc->delay;
 
-    /* Create the AF_PACKET socket. */
-    sock = open_raw_sock(if_name, if_addr, &if_index, do_promiscuous, 1, 1, 1);
-    if (sock < 0)
+    if (state_dir != NULL)
+        snprintf(disc->state_dir, sizeof(disc->state_dir), "%s", state_dir);
+    else if (getenv("XDG_CACHE_HOME") != NULL)
+        snprintf(disc->state_dir, sizeof(disc->state_dir), "%s/pn-tools", getenv("XDG_CACHE_HOME"));
+    else if (getenv("HOME") != NULL)
+        snprintf(disc->state_dir, sizeof(disc->state_dir), "%s/.cache/pn-tools", getenv("HOME"));
+
+    if (if_count == 0 || disc->watch < 0 || disc->missed < 1 || format < 0)
     {
-        //error has already been printed
+        if (if_all && if_count == 0)
+            fprintf(stderr, "No usable interface found\n");
+        pnt_discovery_print_usage(argv[0]);
+        free(disc);
         return EXIT_FAILURE;
     }
 
-    /* Send IdentRequest packet */
+    if (disc->watch > 0)
     {
-        memset(buf, 0, BUF_SIZE);
+        /* a round covers the whole interval, early exits make no sense */
+        disc->quiet = 0;
+        disc->expect = 0;
+        if (disc->watch < pnt_dcp_filter_response_delay(&disc->filter) * 10)
+            fprintf(stderr, "warning: watch interval is shorter than the response delay window (%d ms)\n",
+                    pnt_dcp_filter_response_delay(&disc->filter) * 10);
+    }
+    else if (disc->expect == 0 && (disc->filter.name != NULL || disc->filter.alias != NULL))
+    {
+        /* a name or an alias selects a single device */
+        disc->expect = 1;
+    }
 
-        size_t send_len = pnt_dcp_create_ident_request(buf, if_addr);
+    if (pnt_devtable_init(&disc->devices, disc->expect) < 0 ||
+        pnt_xact_table_init(&disc->xacts, PNT_DISCOVERY_MAX_IFACES) < 0)
+    {
+        pnt_devtable_free(&disc->devices);
+        free(disc);
+        return EXIT_FAILURE;
+    }
 
-        struct sockaddr_ll sock_addr;
+    /* Create one AF_PACKET socket per interface. Explicitly named interfaces
+       must all work, the ones picked by "all" are skipped on error. */
+    for (int i = 0; i < if_count; i++)
+    {
+        struct pnt_discovery_iface *iface = &ifaces[disc->if_count];
 
-        sock_addr.sll_ifindex = if_index;
-        sock_addr.sll_halen = ETH_ALEN;
-        memcpy(sock_addr.sll_addr, dest_addr, ETH_ALEN);
+        if (i != disc->if_count)
+            memcpy(iface->name, ifaces[i].name, IFNAMSIZ);
 
-        if (sendto(sock, buf, send_len, 0, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0)
+        pnt_print("Opening interface %s", iface->name);
+        iface->disc = disc;
+        pnt_discovery_load_state(iface);
+        if (pnt_discovery_open_iface(iface, do_promiscuous, do_ring) < 0)
         {
-            perror("Could not send ident request packet");
-            close(sock);
+            //error has already been printed
+            if (if_all)
+                continue;
+
+            pnt_discovery_close(disc);
+            free(disc);
             return EXIT_FAILURE;
         }
+        iface->multi = if_all || if_count > 1;
+
+        disc->pfds[disc->if_count].fd = iface->sock;
+        disc->pfds[disc->if_count].events = POLLIN;
+        disc->if_count++;
     }
 
-    if (do_headers)
+    if (disc->if_count == 0)
     {
-        printf("MAC Address\tStation Name\tVendor Value\tDevice Role\tVendorID\tDeviceID\tIP Address\tSubnet Mask\tGateway\tIP status\n");
+        fprintf(stderr, "No interface could be opened\n");
+        pnt_discovery_close(disc);
+        free(disc);
+        return EXIT_FAILURE;
     }
 
-    struct timespec start, end;
+    if (disc->use_uring)
+    {
+        /* the sockets were opened without a ring, so recvfrom() is the fallback */
+        if (pnt_uring_init(&disc->uring) < 0)
+        {
+            pnt_print("io_uring is not available (%s), using recvfrom()", strerror(errno));
+            disc->use_uring = 0;
+        }
+        for (int i = 0; disc->use_uring && i < disc->if_count; i++)
+        {
+            if (pnt_uring_add_recv(&disc->uring, ifaces[i].sock, pnt_discovery_handle_frame, &ifaces[i]) < 0)
+            {
+                pnt_discovery_close(disc);
+                free(disc);
+                return EXIT_FAILURE;
+            }
+        }
+        if (disc->use_uring && pnt_uring_submit(&disc->uring) < 0)
+        {
+            pnt_discovery_close(disc);
+            free(disc);
+            return EXIT_FAILURE;
+        }
+    }
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    memcpy(&end, &start, sizeof(start));
-    for (; TIME_DIFF_MS(start, end) < timeout; clock_gettime(CLOCK_MONOTONIC, &end))
+    if (pnt_output_init(&disc->out, format,
+                        (ifaces[0].multi ? PNT_OUTPUT_IFACE : 0) | (disc->watch > 0 ? PNT_OUTPUT_EVENT : 0) |
+                            (disc->vlan_count > 0 ? PNT_OUTPUT_VLAN : 0),
+                        STDOUT_FILENO) < 0)
     {
-        ssize_t received;
+        pnt_discovery_close(disc);
+        free(disc);
+        return EXIT_FAILURE;
+    }
+
+    disc->stream = disc->watch > 0 || format == PNT_OUTPUT_TSV || format == PNT_OUTPUT_CSV ||
+                   format == PNT_OUTPUT_NDJSON;
+    if (do_headers)
+        pnt_output_header(&disc->out);
 
-        received = recvfrom(sock, buf, BUF_SIZE, 0, NULL, NULL);
-        if (received <= 0)
+    int ret = EXIT_SUCCESS;
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pnt_discovery_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (disc->watch == 0)
+    {
+        struct timespec deadline;
+
+        if (pnt_discovery_send_requests(disc) < 0)
+            ret = EXIT_FAILURE;
+        else
+        {
+            pnt_deadline_set(&deadline, disc->timeout);
+            pnt_discovery_collect(disc, &deadline);
+            pnt_print("%u distinct devices answered", disc->devices.count);
+
+            for (int i = 0; i < disc->if_count; i++)
+                pnt_discovery_tally(&disc->ifaces[i]);
+        }
+    }
+    else
+    {
+        struct timespec next;
+
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        /* Each round lasts exactly one interval, measured from the start of
+           the previous one, until interrupted */
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        while (!pnt_discovery_stop)
         {
-            if (errno == EWOULDBLOCK || errno == EAGAIN)
+            pnt_debug("watch round %u", disc->round);
+            if (pnt_discovery_send_requests(disc) < 0)
             {
-                usleep(10000);
-                continue;
+                ret = EXIT_FAILURE;
+                break;
             }
-            else
+
+            pnt_timespec_add_ms(&next, disc->watch);
+            pnt_discovery_collect(disc, &next);
+            if (!pnt_discovery_stop)
             {
-                pnt_debug("recvfrom empty read");
-                break;
+                pnt_discovery_end_round(disc);
+                if (disc->stats_file != NULL)
+                    pnt_discovery_dump_stats(disc);
             }
         }
+    }
 
-        struct ether_header *eh = (struct ether_header *)buf;
-        if (pnt_get_verbose_level() >= PNT_VERBOSE_DEBUG)
-        {
-            fprintf(stderr, "\ndebug: recv: %02x:%02x:%02x:%02x:%02x:%02x -> %02x:%02x:%02x:%02x:%02x:%02x (%04x)",
-                    eh->ether_shost[0],
-                    eh->ether_shost[1],
-                    eh->ether_shost[2],
-                    eh->ether_shost[3],
-                    eh->ether_shost[4],
-                    eh->ether_shost[5],
-                    eh->ether_dhost[0],
-                    eh->ether_dhost[1],
-                    eh->ether_dhost[2],
-                    eh->ether_dhost[3],
-                    eh->ether_dhost[4],
-                    eh->ether_dhost[5],
-                    ntohs(eh->ether_type));
-        }
+    if (disc->stats_file != NULL)
+        pnt_discovery_dump_stats(disc);
 
-        struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, received, if_addr, PN_FRAME_ID_RTA_DCP_RESPONSE);
-        if (pn_dcp == NULL)
-            continue;
+    pnt_discovery_close(disc);
+    free(disc);
 
-        struct pn_dcp_identify_response_data pn_dcp_data;
-        memset(&pn_dcp_data, 0, sizeof(pn_dcp_data));
-        pnt_parse_dcp_response_blocks(pn_dcp, &pn_dcp_data);
-
-        printf("%02x:%02x:%02x:%02x:%02x:%02x\t%s\t%s\t%u\t%04x\t%04x\t%u.%u.%u.%u\t%u.%u.%u.%u\t%u.%u.%u.%u\t%u\n",
-               eh->ether_shost[0],
-               eh->ether_shost[1],
-               eh->ether_shost[2],
-               eh->ether_shost[3],
-               eh->ether_shost[4],
-               eh->ether_shost[5],
-               pn_dcp_data.device_stationname,
-               pn_dcp_data.device_vendorvalue,
-               pn_dcp_data.device_role,
-               pn_dcp_data.device_id_vendor,
-               pn_dcp_data.device_id_device,
-               pn_dcp_data.device_ip_addr[0],
-               pn_dcp_data.device_ip_addr[1],
-               pn_dcp_data.device_ip_addr[2],
-               pn_dcp_data.device_ip_addr[3],
-               pn_dcp_data.device_ip_mask[0],
-               pn_dcp_data.device_ip_mask[1],
-               pn_dcp_data.device_ip_mask[2],
-               pn_dcp_data.device_ip_mask[3],
-               pn_dcp_data.device_ip_gateway[0],
-               pn_dcp_data.device_ip_gateway[1],
-               pn_dcp_data.device_ip_gateway[2],
-               pn_dcp_data.device_ip_gateway[3],
-               pn_dcp_data.device_ip_info);
-    }
-
-    close(sock);
-
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return ret;
+}
@@ -4,9 +4,93 @@
 */
 
 #include "common.h"
+#include "devtable.h"
+#include "output.h"
+#include "uring.h"
+
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #define PNT_DISCOVERY_TIMEOUT 5000
+#define PNT_DISCOVERY_MAX_IFACES 32
+#define PNT_DISCOVERY_MISSED 3
+#define PNT_DISCOVERY_MAX_VLANS 64
+
+/* --delay and --rcvbuf auto: size both from the previous scan */
+#define PNT_DISCOVERY_AUTO -1
+#define PNT_DISCOVERY_SLOT_DEVICES 16           //answers per 10 ms delay slot
+#define PNT_DISCOVERY_RCVBUF_MIN (256 * 1024)
+#define PNT_DISCOVERY_RCVBUF_MAX (64 * 1024 * 1024)
+#define PNT_DISCOVERY_RCVBUF_PER_DEVICE 4096    //kernel memory of one queued response, with headroom
 
 #define TIME_DIFF_MS(s, e) ((e.tv_sec - s.tv_sec) * 1e3 + (e.tv_nsec - s.tv_nsec) / 1e6)
 
-int pnt_discovery(int argc, char **argv);
\ No newline at end of file
+struct pnt_discovery;
+struct pnt_discovery_iface;
+
+/* An 802.1Q tag to scan with, --vlan */
+struct pnt_discovery_vlan
+{
+    int tagged; //0: untagged
+    uint16_t tci;
+};
+
+/* One identify request per round: an interface, or one VLAN of it */
+struct pnt_discovery_target
+{
+    struct pnt_discovery_iface *iface;
+    struct pnt_discovery_vlan vlan;
+    struct pnt_xact xact; //identify request of the current round
+    char request[BUF_SIZE]; //kept until sent, io_uring sends it later
+};
+
+struct pnt_discovery_iface
+{
+    char name[IFNAMSIZ];
+    int sock;
+    int index;
+    uint8_t addr[ETH_ALEN];
+    struct pnt_ring ring;
+    struct pnt_discovery_target *targets; //one per VLAN, or a single untagged one
+    int delay;  //response delay factor sent, 0: the default
+    int rcvbuf; //bytes of socket buffer or ring, 0: the default
+    unsigned int responses; //this round
+    unsigned int drops;     //this round, read early by a statistics dump
+    unsigned int last_devices; //responses and drops of the last finished round
+    unsigned int last_drops;
+    int tallied; //last_* are valid
+    int multi; //print the interface column
+    struct pnt_discovery *disc;
+};
+
+struct pnt_discovery
+{
+    struct pnt_discovery_iface ifaces[PNT_DISCOVERY_MAX_IFACES];
+    struct pollfd pfds[PNT_DISCOVERY_MAX_IFACES];
+    int if_count;
+    int timeout;
+    int quiet;
+    unsigned int expect;
+    int watch;   //interval between identify rounds, 0: single scan
+    int missed;  //rounds a device may miss before it is reported as removed
+    int delay;   //response delay factor, 0: the default, PNT_DISCOVERY_AUTO
+    int rcvbuf;  //receive buffer bytes, 0: the default, PNT_DISCOVERY_AUTO
+    char state_dir[PATH_MAX]; //where auto mode remembers each interface, "" for nowhere
+    int window;  //ms the slowest interface's devices take to answer
+    const char *stats_file; //NULL: statistics go to stderr on SIGUSR1
+    unsigned int round;
+    struct pnt_dcp_filter filter; //only matching devices answer
+    struct pnt_discovery_vlan vlans[PNT_DISCOVERY_MAX_VLANS];
+    int vlan_count; //0: untagged requests only, and no VLAN column
+    struct pnt_devtable devices; //distinct devices that answered, by MAC
+    struct pnt_xact_table xacts;
+    struct pnt_output out;
+    int use_uring; //send and receive through io_uring instead of the sockets
+    int stream;    //flush the output after every batch of responses, not only at the end
+    struct pnt_uring uring;
+    struct timespec last_response;
+    char buf[BUF_SIZE];
+};
+
+int pnt_discovery(int argc, char **argv);
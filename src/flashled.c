@@ -9,35 +9,99 @@ static void
 pnt_flashled_print_usage(const char *progname)
 {
     fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
-    fprintf(stderr, "usage: %s flashled -i <iface> -t <target> [-h] [-v] [-d] [-p] [-c count] [-w <timewait>]\n\n", progname);
-    fprintf(stderr, "Search for Profinet devices and print found ones on each line\n");
+    fprintf(stderr, "usage: %s flashled -i <iface> -t <target> [-t <target> ...] [-f <file>] [-h] [-v] [-d] [-p] [-c count] [-w <timewait>]\n\n", progname);
+    fprintf(stderr, "Send a \"flash leds\" request to one or more Profinet devices\n");
     fprintf(stderr, "\nOptions:\n");
     fprintf(stderr, "   -h            Show this help\n");
     fprintf(stderr, "   -i iface      The interface on which to send the packet\n");
-    fprintf(stderr, "   -t target     The MAC address of the target device\n");
+    fprintf(stderr, "   -t target     The MAC address of a target device, may be repeated\n");
+    fprintf(stderr, "   -f file       Read target MAC addresses from file (\"-\" for stdin), one per line.\n");
+    fprintf(stderr, "                 Only the first field is used, so discovery output can be piped in\n");
     fprintf(stderr, "   -v            Be verbose\n");
     fprintf(stderr, "   -d            Show debug information\n");
     fprintf(stderr, "   -c count      Amount of flash requests to send (default=%d)\n", PNT_FLASHLED_COUNT);
     fprintf(stderr, "   -w timewait   Amount of time (in ms) to wait between requests (default=%d)\n", PNT_FLASHLED_TIMEWAIT);
 }
 
+static int
+pnt_flashled_add_target(struct pnt_flashled_targets *targets, const uint8_t *mac)
+{
+    if (targets->count == targets->cap)
+    {
+        int cap = targets->cap ? targets->cap * 2 : 16;
+        uint8_t(*macs)[ETH_ALEN] = realloc(targets->macs, cap * sizeof(*macs));
+
+        if (macs == NULL)
+        {
+            perror("Cannot allocate target list");
+            return -1;
+        }
+        targets->macs = macs;
+        targets->cap = cap;
+    }
+
+    memcpy(targets->macs[targets->count++], mac, ETH_ALEN);
+    return 0;
+}
+
+static int
+pnt_flashled_read_targets(struct pnt_flashled_targets *targets, const char *path)
+{
+    FILE *f;
+    char line[256];
+    int lineno = 0;
+
+    f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (f == NULL)
+    {
+        perror("Cannot open target file");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *field;
+        uint8_t mac[ETH_ALEN];
+
+        lineno++;
+        field = strtok(line, " \t\r\n");
+        if (field == NULL || field[0] == '#')
+            continue;
+
+        if (pnt_parse_mac(field, mac) < 0)
+        {
+            /* tolerate the header line printed by "discovery -o" */
+            pnt_print("%s:%d: ignoring \"%s\", not a MAC address", path, lineno, field);
+            continue;
+        }
+        if (pnt_flashled_add_target(targets, mac) < 0)
+            break;
+    }
+
+    if (f != stdin)
+        fclose(f);
+
+    return 0;
+}
+
 int pnt_flashled(int argc, char **argv)
 {
     char *if_name;
     int if_name_set = 0;
-    int if_target_set = 0;
     int do_count = PNT_FLASHLED_COUNT;
     int timewait = PNT_FLASHLED_TIMEWAIT;
     int sock;
     int if_index;
     uint8_t if_addr[ETH_ALEN];
-    uint8_t dest_addr[ETH_ALEN];
-    char buf[BUF_SIZE];
+    struct pnt_flashled_targets targets;
+    int ret = EXIT_FAILURE;
+
+    memset(&targets, 0, sizeof(targets));
 
     {
         int opt;
 
-        while ((opt = getopt(argc, argv, "vdpc:w:i:t:")) != -1)
+        while ((opt = getopt(argc, argv, "vdpc:w:i:t:f:")) != -1)
         {
             switch (opt)
             {
@@ -59,85 +123,125 @@ int pnt_flashled(int argc, char **argv)
                 break;
             case 't':
             {
-                int mac[ETH_ALEN];
-
-                if (ETH_ALEN != sscanf(optarg,
-                                       "%02x:%02x:%02x:%02x:%02x:%02x",
-                                       &mac[0],
-                                       &mac[1],
-                                       &mac[2],
-                                       &mac[3],
-                                       &mac[4],
-                                       &mac[5]))
+                uint8_t mac[ETH_ALEN];
+
+                if (pnt_parse_mac(optarg, mac) < 0)
                 {
                     pnt_flashled_print_usage(argv[0]);
-                    return EXIT_FAILURE;
+                    goto out;
                 }
-                for (int i = 0; i < ETH_ALEN; i++)
-                    dest_addr[i] = mac[i];
-
-                if_target_set = 1;
+                if (pnt_flashled_add_target(&targets, mac) < 0)
+                    goto out;
             }
             break;
+            case 'f':
+                if (pnt_flashled_read_targets(&targets, optarg) < 0)
+                    goto out;
+                break;
             default: /* '?' */
                 pnt_flashled_print_usage(argv[0]);
-                return EXIT_FAILURE;
+                goto out;
             }
         }
     }
 
-    pnt_print("Parameters: iface[%s] verbose_level[%d] count[%d] timewait[%d] destination[%02x:%02x:%02x:%02x:%02x:%02x]",
-              if_name, pnt_get_verbose_level(), do_count, timewait,
-              dest_addr[0], dest_addr[1], dest_addr[2], dest_addr[3], dest_addr[4], dest_addr[5]);
+    pnt_print("Parameters: iface[%s] verbose_level[%d] count[%d] timewait[%d] targets[%d]",
+              if_name, pnt_get_verbose_level(), do_count, timewait, targets.count);
 
-    if (!if_name_set || !if_target_set)
+    if (!if_name_set || targets.count == 0)
     {
         pnt_flashled_print_usage(argv[0]);
-        return EXIT_FAILURE;
+        goto out;
     }
 
     /* Create the AF_PACKET socket. */
-    sock = open_raw_sock(if_name, if_addr, &if_index, 0, 0, 1, 1);
+    sock = open_raw_sock(if_name, if_addr, &if_index, 0, 0, 1, 1, NULL);
     if (sock < 0)
     {
         //error has already been printed
-        return EXIT_FAILURE;
+        goto out;
+    }
+
+    /* Build every request once, back to back in one buffer, together with
+       the message headers that let a whole round go out in one sendmmsg() */
+    char *frames = calloc(targets.count, BUF_SIZE);
+    struct sockaddr_ll *addrs = calloc(targets.count, sizeof(*addrs));
+    struct iovec *iovs = calloc(targets.count, sizeof(*iovs));
+    struct mmsghdr *msgs = calloc(targets.count, sizeof(*msgs));
+
+    if (frames == NULL || addrs == NULL || iovs == NULL || msgs == NULL)
+    {
+        perror("Cannot allocate request buffers");
+        goto out_free;
     }
 
-    memset(buf, 0, BUF_SIZE);
-    size_t send_len = pnt_dcp_create_flashled_request(buf, if_addr, dest_addr);
-    pnt_debug("flashled packet length: %ld", send_len);
+    size_t offset = 0;
+    for (int i = 0; i < targets.count; i++)
+    {
+        char *frame = frames + offset;
+        size_t send_len = pnt_dcp_create_flashled_request(frame, if_addr, targets.macs[i], pnt_xid_alloc());
+
+        offset += send_len;
+        if (i == 0)
+            pnt_debug("flashled packet length: %ld", send_len);
+
+        addrs[i].sll_family = AF_PACKET;
+        addrs[i].sll_ifindex = if_index;
+        addrs[i].sll_halen = ETH_ALEN;
+        memcpy(addrs[i].sll_addr, targets.macs[i], ETH_ALEN);
+
+        iovs[i].iov_base = frame;
+        iovs[i].iov_len = send_len;
+
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    /* Repeat do_count times */
+    /* Repeat do_count times, each round starting timewait ms after the
+       previous one started, regardless of how long sending took */
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
     for (int cnt = 0; cnt < do_count; cnt++)
     {
         if (cnt > 0)
         {
-            usleep(timewait * 1e3);
+            pnt_timespec_add_ms(&next, timewait);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+                ;
         }
-        pnt_debug("send packet cnt %u", cnt);
+        pnt_debug("send round %u", cnt);
 
-        /* Send FlashLed request packet */
+        /* Send FlashLed request packets */
+        for (int sent = 0; sent < targets.count;)
         {
-            struct sockaddr_ll sock_addr;
-
-            sock_addr.sll_ifindex = if_index;
-            sock_addr.sll_halen = ETH_ALEN;
-            memcpy(sock_addr.sll_addr, dest_addr, ETH_ALEN);
-
-            if (sendto(sock, buf, send_len, 0, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0)
+            int n = sendmmsg(sock, msgs + sent, targets.count - sent, 0);
+            if (n < 0)
             {
-                perror("Could not send ident request packet");
-                close(sock);
-                return EXIT_FAILURE;
+                if (errno == EINTR)
+                    continue;
+                perror("Could not send flashled request packets");
+                goto out_free;
             }
+            sent += n;
         }
 
         // fire and forget, ignore any answer for now
     }
 
     pnt_debug("finished");
+    ret = EXIT_SUCCESS;
+
+out_free:
+    free(msgs);
+    free(iovs);
+    free(addrs);
+    free(frames);
     close(sock);
+out:
+    free(targets.macs);
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return ret;
+}
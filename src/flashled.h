@@ -10,4 +10,11 @@
 
 #define TIME_DIFF_MS(s, e) ((e.tv_sec - s.tv_sec) * 1e3 + (e.tv_nsec - s.tv_nsec) / 1e6)
 
+struct pnt_flashled_targets
+{
+    uint8_t (*macs)[ETH_ALEN];
+    int count;
+    int cap;
+};
+
 int pnt_flashled(int argc, char **argv);
\ No newline at end of file
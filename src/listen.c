@@ -0,0 +1,367 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "listen.h"
+
+static volatile sig_atomic_t pnt_listen_stop = 0;
+
+/* Where devices send their Hello to */
+static const uint8_t pnt_listen_hello_addr[ETH_ALEN] = {0x01, 0x0e, 0xcf, 0x00, 0x00, 0x01};
+
+static const struct pnt_frame_id_range pnt_listen_frame_ids[] = {
+    {PN_FRAME_ID_RTA_DCP_HELLO, PN_FRAME_ID_RTA_DCP_HELLO},
+    {PN_FRAME_ID_RTA_DCP_RESPONSE, PN_FRAME_ID_RTA_DCP_RESPONSE},
+};
+
+static void
+pnt_listen_print_usage(const char *progname)
+{
+    fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
+    fprintf(stderr, "usage: %s listen -i <iface> [-h] [-v] [-d] [-o] [-p] [-c] [-t <timeout>] [-f <format>]\n\n", progname);
+    fprintf(stderr, "Print the Profinet devices announcing themselves with a DCP Hello, e.g. when they power up\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "   -h          Show this help\n");
+    fprintf(stderr, "   -i iface    The interface to listen on\n");
+    fprintf(stderr, "   -p          Put the interface in promiscuous mode\n");
+    fprintf(stderr, "   -c          Confirm every Hello with a unicast identify request to the device\n");
+    fprintf(stderr, "   -t timeout  Amount of time (in ms) to wait for the identify response (default=%d)\n", PNT_LISTEN_TIMEOUT);
+    fprintf(stderr, "   -f format   Output format: %s (default=tsv)\n", PNT_OUTPUT_FORMATS);
+    fprintf(stderr, "   -o          Print the header of fields\n");
+    fprintf(stderr, "   -v          Be verbose\n");
+    fprintf(stderr, "   -d          Show debug information\n");
+    fprintf(stderr, "\nEvery Hello is written out as a HELLO record as soon as it is received, with what the device\n");
+    fprintf(stderr, "announced. With -c it is followed by a CONFIRMED record with the identify response, or an\n");
+    fprintf(stderr, "UNCONFIRMED one when the device did not answer within the timeout.\n");
+}
+
+static void
+pnt_listen_signal(int sig)
+{
+    (void)sig;
+    pnt_listen_stop = 1;
+}
+
+static void
+pnt_listen_emit(struct pnt_listen *ls, enum pnt_output_event event, const struct pnt_device *dev)
+{
+    pnt_output_device(&ls->out, event, dev, NULL);
+    if (pnt_output_flush(&ls->out) < 0)
+        pnt_listen_stop = 1;
+}
+
+/* A device repeats its Hello, only one identify is sent until it answers */
+static struct pnt_listen_confirm *
+pnt_listen_find_confirm(struct pnt_listen *ls, const uint8_t *mac)
+{
+    for (unsigned int i = 0; i < ls->xacts.size; i++)
+    {
+        struct pnt_xact *xact = ls->xacts.slots[i];
+
+        if (xact != NULL && memcmp(xact->peer, mac, ETH_ALEN) == 0)
+            return xact->data;
+    }
+
+    return NULL;
+}
+
+static void
+pnt_listen_confirm_done(struct pnt_listen *ls, struct pnt_listen_confirm *confirm)
+{
+    pnt_xact_finish(&ls->xacts, &confirm->xact);
+    free(confirm);
+}
+
+/* Identify request to the device only, on the VLAN the Hello came from */
+static int
+pnt_listen_send_confirm(struct pnt_listen *ls, const struct pnt_device *dev, int tci)
+{
+    struct pnt_listen_confirm *confirm;
+    struct pnt_dcp_filter filter;
+    struct sockaddr_ll sock_addr;
+
+    if (pnt_listen_find_confirm(ls, dev->mac) != NULL)
+        return 0;
+
+    confirm = calloc(1, sizeof(*confirm));
+    if (confirm == NULL)
+        return -1;
+    confirm->dev = *dev;
+    confirm->xact.data = confirm;
+
+    if (pnt_xact_start(&ls->xacts, &confirm->xact, PN_DCP_SERVICE_ID_IDENTIFY, dev->mac, ls->timeout) < 0)
+    {
+        free(confirm);
+        return -1;
+    }
+
+    /* a named device is selected by its name, an unnamed one by the address alone */
+    memset(&filter, 0, sizeof(filter));
+    if (dev->data.device_stationname[0] != '\0')
+        filter.name = dev->data.device_stationname;
+    filter.response_delay = 1;
+    filter.vlan_tagged = tci >= 0;
+    filter.vlan_tci = tci >= 0 ? tci : 0;
+
+    memset(ls->request, 0, BUF_SIZE);
+    size_t send_len = pnt_dcp_create_ident_request(ls->request, ls->if_addr, confirm->xact.xid, &filter);
+    memcpy(((struct ether_header *)ls->request)->ether_dhost, dev->mac, ETH_ALEN);
+
+    memset(&sock_addr, 0, sizeof(sock_addr));
+    sock_addr.sll_ifindex = ls->if_index;
+    sock_addr.sll_halen = ETH_ALEN;
+    memcpy(sock_addr.sll_addr, dev->mac, ETH_ALEN);
+
+    if (sendto(ls->sock, ls->request, send_len, 0, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0)
+    {
+        perror("Could not send identify request packet");
+        pnt_listen_confirm_done(ls, confirm);
+        return -1;
+    }
+
+    pnt_debug("listen: identify request %08x sent to %02x:%02x:%02x:%02x:%02x:%02x", confirm->xact.xid,
+              dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4], dev->mac[5]);
+    return 0;
+}
+
+static void
+pnt_listen_handle_hello(struct pnt_listen *ls, char *buf, ssize_t received, const struct pnt_frame_info *info,
+                        struct pn_dcp_header *pn_dcp)
+{
+    struct ether_header *eh = (struct ether_header *)buf;
+    struct pnt_device dev;
+
+    if (pn_dcp->h_service_id != PN_DCP_SERVICE_ID_HELLO || pn_dcp->h_service_type != PN_DCP_SERVICE_TYPE_REQUEST)
+    {
+        pnt_debug("listen: DCP Hello frame with service %u/%u", pn_dcp->h_service_id, pn_dcp->h_service_type);
+        return;
+    }
+
+    int tci = pnt_frame_vlan_tci(buf, received, info);
+
+    memset(&dev, 0, sizeof(dev));
+    memcpy(dev.mac, eh->ether_shost, ETH_ALEN);
+    memcpy(dev.if_name, ls->if_name, IFNAMSIZ);
+    dev.vlan = tci > 0 ? tci & PNT_VLAN_VID_MASK : 0;
+    dev.first_seen = info->ts;
+    dev.last_seen = info->ts;
+    pnt_parse_dcp_response_blocks(pn_dcp, &dev.data);
+
+    ls->hellos++;
+    pnt_listen_emit(ls, PNT_EVENT_HELLO, &dev);
+
+    if (ls->confirm && pnt_listen_send_confirm(ls, &dev, tci) < 0)
+        pnt_print("listen: could not confirm the Hello of %s", dev.data.device_stationname);
+}
+
+static void
+pnt_listen_handle_response(struct pnt_listen *ls, char *buf, const struct pnt_frame_info *info,
+                           struct pn_dcp_header *pn_dcp)
+{
+    struct ether_header *eh = (struct ether_header *)buf;
+
+    if (memcmp(eh->ether_dhost, ls->if_addr, ETH_ALEN) != 0)
+        return;
+
+    struct pnt_xact *xact = pnt_xact_match(&ls->xacts, pn_dcp, eh->ether_shost);
+    if (xact == NULL)
+        return;
+
+    struct pnt_listen_confirm *confirm = xact->data;
+
+    pnt_stats_response(&xact->sent, &info->ts);
+
+    /* the identify response is the authoritative description */
+    memset(&confirm->dev.data, 0, sizeof(confirm->dev.data));
+    pnt_parse_dcp_response_blocks(pn_dcp, &confirm->dev.data);
+    confirm->dev.last_seen = info->ts;
+
+    ls->confirmed++;
+    pnt_listen_emit(ls, PNT_EVENT_CONFIRMED, &confirm->dev);
+    pnt_listen_confirm_done(ls, confirm);
+}
+
+static void
+pnt_listen_handle_frame(char *buf, ssize_t received, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_listen *ls = arg;
+
+    /* Hellos go to a multicast address, so no destination check here */
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, received, NULL, 0);
+    if (pn_dcp == NULL)
+        return;
+
+    switch (ntohs(((struct pn_header *)pn_dcp - 1)->h_frame_id))
+    {
+    case PN_FRAME_ID_RTA_DCP_HELLO:
+        pnt_listen_handle_hello(ls, buf, received, info, pn_dcp);
+        break;
+    case PN_FRAME_ID_RTA_DCP_RESPONSE:
+        if (ls->confirm)
+            pnt_listen_handle_response(ls, buf, info, pn_dcp);
+        break;
+    default:
+        pnt_stats.frames_rejected[PNT_REJECT_FRAME_ID]++;
+        break;
+    }
+}
+
+static void
+pnt_listen_expired(struct pnt_xact *xact, void *arg)
+{
+    struct pnt_listen *ls = arg;
+    struct pnt_listen_confirm *confirm = xact->data;
+
+    ls->unconfirmed++;
+    pnt_listen_emit(ls, PNT_EVENT_UNCONFIRMED, &confirm->dev);
+    pnt_listen_confirm_done(ls, confirm);
+}
+
+static int
+pnt_listen_run(struct pnt_listen *ls)
+{
+    struct pollfd pfd = {.fd = ls->sock, .events = POLLIN};
+
+    while (!pnt_listen_stop)
+    {
+        int ready = poll(&pfd, 1, pnt_xact_next_timeout(&ls->xacts));
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not poll socket");
+            return -1;
+        }
+
+        if (ready > 0 && pnt_recv_dispatch(ls->sock, ls->buf, pnt_listen_handle_frame, ls) < 0)
+            return -1;
+
+        pnt_xact_expire(&ls->xacts, pnt_listen_expired, ls);
+    }
+
+    return 0;
+}
+
+int pnt_listen(int argc, char **argv)
+{
+    struct pnt_listen *ls;
+    char *if_name = NULL;
+    int do_headers = 0;
+    int do_promiscuous = 0;
+    int format = PNT_OUTPUT_TSV;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    ls = calloc(1, sizeof(*ls));
+    if (ls == NULL)
+    {
+        perror("Cannot allocate listen state");
+        return EXIT_FAILURE;
+    }
+    ls->sock = -1;
+    ls->timeout = PNT_LISTEN_TIMEOUT;
+
+    while ((opt = getopt(argc, argv, "vdopci:t:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            pnt_set_verbose_level(PNT_VERBOSE_PRINT);
+            break;
+        case 'd':
+            pnt_set_verbose_level(PNT_VERBOSE_DEBUG);
+            break;
+        case 'o':
+            do_headers = 1;
+            break;
+        case 'p':
+            do_promiscuous = 1;
+            break;
+        case 'c':
+            ls->confirm = 1;
+            break;
+        case 'i':
+            if_name = optarg;
+            break;
+        case 't':
+            ls->timeout = atoi(optarg);
+            break;
+        case 'f':
+            format = pnt_output_parse_format(optarg);
+            break;
+        default: /* '?' */
+            pnt_listen_print_usage(argv[0]);
+            goto out;
+        }
+    }
+
+    pnt_print("Parameters: iface[%s] verbose_level[%d] headers[%d] promiscuous[%d] confirm[%d] timeout[%d] format[%d]",
+              if_name, pnt_get_verbose_level(), do_headers, do_promiscuous, ls->confirm, ls->timeout, format);
+
+    if (if_name == NULL || strlen(if_name) >= IFNAMSIZ || ls->timeout < 1 || format < 0)
+    {
+        pnt_listen_print_usage(argv[0]);
+        goto out;
+    }
+    strcpy(ls->if_name, if_name);
+
+    /* no ring: a block would hold a Hello back for up to PNT_RING_BLOCK_TIMEOUT,
+       and with the filter only the odd DCP frame is ever queued */
+    ls->sock = open_raw_sock(if_name, ls->if_addr, &ls->if_index, do_promiscuous, 1, 1, 1, NULL);
+    if (ls->sock < 0)
+    {
+        //error has already been printed
+        goto out;
+    }
+
+    if (pnt_attach_frame_id_filter(ls->sock, pnt_listen_frame_ids, ls->confirm ? 2 : 1) < 0)
+        pnt_print("%s: could not attach socket filter, all frames will be received", if_name);
+    if (!do_promiscuous && pnt_add_multicast_membership(ls->sock, ls->if_index, pnt_listen_hello_addr) < 0)
+        perror("Cannot join the DCP Hello multicast address, only Hellos the NIC lets through will be seen");
+    pnt_enable_vlan_auxdata(ls->sock);
+
+    if (pnt_xact_table_init(&ls->xacts, 16) < 0)
+    {
+        perror("Cannot allocate identify requests");
+        goto out;
+    }
+    if (pnt_output_init(&ls->out, format, PNT_OUTPUT_EVENT | PNT_OUTPUT_TIMES, STDOUT_FILENO) < 0)
+        goto out;
+
+    {
+        /* no SA_RESTART, so poll() returns on a signal */
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = pnt_listen_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+
+    if (do_headers)
+    {
+        pnt_output_header(&ls->out);
+        pnt_output_flush(&ls->out);
+    }
+
+    if (pnt_listen_run(ls) == 0)
+        ret = EXIT_SUCCESS;
+
+    pnt_print("%lu hellos, %lu confirmed, %lu unconfirmed", ls->hellos, ls->confirmed, ls->unconfirmed);
+
+out:
+    /* identify requests still in flight end without a record */
+    for (unsigned int i = 0; i < ls->xacts.size; i++)
+    {
+        if (ls->xacts.slots[i] != NULL)
+            free(ls->xacts.slots[i]->data);
+    }
+    pnt_xact_table_free(&ls->xacts);
+    pnt_output_close(&ls->out);
+    if (ls->sock >= 0)
+        close(ls->sock);
+    free(ls);
+
+    return ret;
+}
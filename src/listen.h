@@ -0,0 +1,37 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+#include "output.h"
+
+#include <signal.h>
+
+#define PNT_LISTEN_TIMEOUT 1000
+
+/* A unicast identify sent to a device that said Hello */
+struct pnt_listen_confirm
+{
+    struct pnt_xact xact;
+    struct pnt_device dev; //as the Hello described it
+};
+
+struct pnt_listen
+{
+    int confirm; //send a unicast identify after each Hello
+    int timeout; //for its answer
+    unsigned long hellos;
+    unsigned long confirmed;
+    unsigned long unconfirmed;
+    struct pnt_output out;
+    struct pnt_xact_table xacts;
+    char if_name[IFNAMSIZ];
+    int sock;
+    int if_index;
+    uint8_t if_addr[ETH_ALEN];
+    char buf[BUF_SIZE];
+    char request[BUF_SIZE];
+};
+
+int pnt_listen(int argc, char **argv);
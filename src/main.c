@@ -6,6 +6,13 @@
 #include "common.h"
 #include "discovery.h"
 #include "flashled.h"
+#include "daemon.h"
+#include "analyze.h"
+#include "set.h"
+#include "monitor.h"
+#include "sniff.h"
+#include "alarms.h"
+#include "listen.h"
 
 static void
 print_usage(const char *progname)
@@ -15,6 +22,13 @@ print_usage(const char *progname)
     fprintf(stderr, "Available commands:\n");
     fprintf(stderr, "   discovery    List all reachable devices on the network\n");
     fprintf(stderr, "   flashled     Identifies a device by flashing all its leds\n");
+    fprintf(stderr, "   set          Assigns station names and IP parameters to devices\n");
+    fprintf(stderr, "   daemon       Keeps a table of devices and answers queries on a Unix socket\n");
+    fprintf(stderr, "   monitor      Watches reachability and response times of known devices\n");
+    fprintf(stderr, "   sniff        Watches cyclic real-time traffic for lost frames, jitter and status changes\n");
+    fprintf(stderr, "   alarms       Prints the Profinet alarms seen on the network as they happen\n");
+    fprintf(stderr, "   listen       Prints the devices announcing themselves with a DCP Hello as they boot\n");
+    fprintf(stderr, "   analyze      Lists the devices found in a pcap or pcapng capture\n");
     fprintf(stderr, "   version      Prints the version and exits\n");
 }
 
@@ -41,6 +55,34 @@ int main(int argc, char **argv)
     {
         return pnt_flashled(argc, argv);
     }
+    else if (strcmp(argv[1], "set") == 0)
+    {
+        return pnt_set(argc, argv);
+    }
+    else if (strcmp(argv[1], "daemon") == 0)
+    {
+        return pnt_daemon(argc, argv);
+    }
+    else if (strcmp(argv[1], "monitor") == 0)
+    {
+        return pnt_monitor(argc, argv);
+    }
+    else if (strcmp(argv[1], "sniff") == 0)
+    {
+        return pnt_sniff(argc, argv);
+    }
+    else if (strcmp(argv[1], "alarms") == 0)
+    {
+        return pnt_alarms(argc, argv);
+    }
+    else if (strcmp(argv[1], "listen") == 0)
+    {
+        return pnt_listen(argc, argv);
+    }
+    else if (strcmp(argv[1], "analyze") == 0)
+    {
+        return pnt_analyze(argc, argv);
+    }
     else
     {
         print_usage(argv[0]);
@@ -0,0 +1,550 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "monitor.h"
+
+static volatile sig_atomic_t pnt_monitor_stop = 0;
+static volatile sig_atomic_t pnt_monitor_dump = 0;
+
+static void
+pnt_monitor_print_usage(const char *progname)
+{
+    fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
+    fprintf(stderr, "usage: %s monitor -i <iface> -f <file> [-h] [-v] [-d] [-o] [-I <interval>] [-t <timeout>] [-m <missed>] [-s <report>]\n\n", progname);
+    fprintf(stderr, "Watch the reachability and response time of known Profinet devices with unicast DCP Get requests\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "   -h            Show this help\n");
+    fprintf(stderr, "   -i iface      The interface on which to send the requests\n");
+    fprintf(stderr, "   -f file       Read device MAC addresses from file (\"-\" for stdin), one per line.\n");
+    fprintf(stderr, "                 Only the first field is used, so discovery output can be piped in\n");
+    fprintf(stderr, "   -I interval   Amount of time (in ms) between two requests to a device (default=%d).\n", PNT_MONITOR_INTERVAL);
+    fprintf(stderr, "                 The requests to all devices are spread evenly over the interval\n");
+    fprintf(stderr, "   -t timeout    Amount of time (in ms) to wait for each response (default=%d)\n", PNT_MONITOR_TIMEOUT);
+    fprintf(stderr, "   -m missed     Requests in a row a device may miss before it is DOWN (default=%d)\n", PNT_MONITOR_MISSED);
+    fprintf(stderr, "   -s report     Print a summary every report ms, besides on SIGUSR1 and at exit\n");
+    fprintf(stderr, "   -o            Print the header of the summary fields\n");
+    fprintf(stderr, "   -v            Be verbose\n");
+    fprintf(stderr, "   -d            Show debug information\n");
+    fprintf(stderr, "\nState changes are printed as they happen, as <time> <mac> UP <rtt ms> or <time> <mac> DOWN.\n");
+    fprintf(stderr, "The summary has one line per device: <mac> UP|DOWN|UNKNOWN <sent> <received> <lost>\n");
+    fprintf(stderr, "<p50 ms> <p99 ms> <max ms>. Percentiles are within 25%% of the exact value.\n");
+}
+
+static void
+pnt_monitor_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        pnt_monitor_dump = 1;
+    else
+        pnt_monitor_stop = 1;
+}
+
+static int
+pnt_monitor_add_device(struct pnt_monitor *mon, const uint8_t *mac)
+{
+    if (mon->count == mon->cap)
+    {
+        int cap = mon->cap ? mon->cap * 2 : 64;
+        struct pnt_monitor_device *devices = realloc(mon->devices, cap * sizeof(*devices));
+
+        if (devices == NULL)
+        {
+            perror("Cannot allocate device list");
+            return -1;
+        }
+        mon->devices = devices;
+        mon->cap = cap;
+    }
+
+    struct pnt_monitor_device *dev = &mon->devices[mon->count++];
+
+    memset(dev, 0, sizeof(*dev));
+    memcpy(dev->mac, mac, ETH_ALEN);
+    return 0;
+}
+
+static int
+pnt_monitor_read_devices(struct pnt_monitor *mon, const char *path)
+{
+    FILE *f;
+    char line[256];
+    int lineno = 0;
+    int ret = 0;
+
+    f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (f == NULL)
+    {
+        perror("Cannot open device file");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *field;
+        uint8_t mac[ETH_ALEN];
+
+        lineno++;
+        field = strtok(line, " \t\r\n");
+        if (field == NULL || field[0] == '#')
+            continue;
+
+        if (pnt_parse_mac(field, mac) < 0)
+        {
+            /* tolerate the header line printed by "discovery -o" */
+            pnt_print("%s:%d: ignoring \"%s\", not a MAC address", path, lineno, field);
+            continue;
+        }
+        if (pnt_monitor_add_device(mon, mac) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (f != stdin)
+        fclose(f);
+
+    return ret;
+}
+
+static int
+pnt_monitor_bucket(uint32_t us)
+{
+    if (us < 4)
+        return us;
+
+    int octave = 31 - __builtin_clz(us);
+    int bucket = 4 * (octave - 1) + ((us >> (octave - 2)) & 3);
+
+    return bucket < PNT_MONITOR_BUCKETS ? bucket : PNT_MONITOR_BUCKETS - 1;
+}
+
+/* Largest RTT that falls in a bucket */
+static uint32_t
+pnt_monitor_bucket_max(int bucket)
+{
+    if (bucket < 4)
+        return bucket;
+
+    int octave = bucket / 4 + 1;
+    uint64_t low = (uint64_t)(4 + bucket % 4) << (octave - 2);
+
+    return low + (1ULL << (octave - 2)) - 1 > UINT32_MAX ? UINT32_MAX : low + (1ULL << (octave - 2)) - 1;
+}
+
+static uint32_t
+pnt_monitor_percentile(const struct pnt_monitor_device *dev, double p)
+{
+    uint64_t target = (uint64_t)(p * dev->received + 0.999999);
+    uint64_t seen = 0;
+
+    if (dev->received == 0)
+        return 0;
+
+    for (int i = 0; i < PNT_MONITOR_BUCKETS; i++)
+    {
+        seen += dev->hist[i];
+        if (seen >= target)
+        {
+            uint32_t max = pnt_monitor_bucket_max(i);
+            return max < dev->max_us ? max : dev->max_us;
+        }
+    }
+
+    return dev->max_us;
+}
+
+static void
+pnt_monitor_event(const struct pnt_monitor_device *dev, const char *event, int64_t rtt_us)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    printf("%ld.%03ld\t%02x:%02x:%02x:%02x:%02x:%02x\t%s",
+           (long)now.tv_sec, now.tv_nsec / 1000000L,
+           dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4], dev->mac[5], event);
+    if (rtt_us >= 0)
+        printf("\t%.3f", rtt_us / 1e3);
+    printf("\n");
+}
+
+static void
+pnt_monitor_report(struct pnt_monitor *mon)
+{
+    static const char *states[] = {
+        [PNT_MONITOR_UNKNOWN] = "UNKNOWN",
+        [PNT_MONITOR_UP] = "UP",
+        [PNT_MONITOR_DOWN] = "DOWN",
+    };
+
+    for (int i = 0; i < mon->count; i++)
+    {
+        const struct pnt_monitor_device *dev = &mon->devices[i];
+
+        printf("%02x:%02x:%02x:%02x:%02x:%02x\t%s\t%u\t%u\t%u\t%.3f\t%.3f\t%.3f\n",
+               dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4], dev->mac[5],
+               states[dev->state], dev->sent, dev->received, dev->lost,
+               pnt_monitor_percentile(dev, 0.5) / 1e3, pnt_monitor_percentile(dev, 0.99) / 1e3,
+               dev->max_us / 1e3);
+    }
+    fflush(stdout);
+}
+
+/* A copy of a sent request with its kernel transmit time, which is closer
+   to the wire than the clock read before sendmmsg() */
+static void
+pnt_monitor_handle_tx(char *buf, ssize_t len, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_monitor *mon = arg;
+
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, len, NULL, PN_FRAME_ID_RTA_DCP_GETSET);
+    if (pn_dcp == NULL)
+        return;
+
+    struct pnt_xact *xact = pnt_xact_find(&mon->xacts, ntohl(pn_dcp->h_xid));
+    if (xact != NULL)
+        xact->sent = info->ts;
+}
+
+static void
+pnt_monitor_handle_frame(char *buf, ssize_t received, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_monitor *mon = arg;
+    struct ether_header *eh = (struct ether_header *)buf;
+
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, received, mon->if_addr, PN_FRAME_ID_RTA_DCP_GETSET);
+    if (pn_dcp == NULL)
+        return;
+
+    struct pnt_xact *xact = pnt_xact_match(&mon->xacts, pn_dcp, eh->ether_shost);
+    if (xact == NULL)
+        return;
+
+    struct pnt_monitor_device *dev = xact->data;
+    int64_t us = (info->ts.tv_sec - xact->sent.tv_sec) * 1000000LL + (info->ts.tv_nsec - xact->sent.tv_nsec) / 1000;
+
+    if (us < 0)
+        us = 0;
+    if (us > UINT32_MAX)
+        us = UINT32_MAX;
+
+    pnt_stats_response(&xact->sent, &info->ts);
+    pnt_xact_finish(&mon->xacts, xact);
+    dev->outstanding = 0;
+
+    /* any answer, even an error, shows the device is alive */
+    dev->received++;
+    dev->missed = 0;
+    dev->hist[pnt_monitor_bucket(us)]++;
+    if (us > dev->max_us)
+        dev->max_us = us;
+
+    if (dev->state != PNT_MONITOR_UP)
+    {
+        dev->state = PNT_MONITOR_UP;
+        pnt_monitor_event(dev, "UP", us);
+    }
+}
+
+static void
+pnt_monitor_lost(struct pnt_monitor *mon, struct pnt_monitor_device *dev)
+{
+    pnt_xact_finish(&mon->xacts, &dev->xact);
+    dev->outstanding = 0;
+    dev->lost++;
+
+    if (++dev->missed >= mon->missed && dev->state != PNT_MONITOR_DOWN)
+    {
+        dev->state = PNT_MONITOR_DOWN;
+        pnt_monitor_event(dev, "DOWN", -1);
+    }
+}
+
+static void
+pnt_monitor_expired(struct pnt_xact *xact, void *arg)
+{
+    pnt_monitor_lost(arg, xact->data);
+}
+
+/* The timer only queues the request, every due one goes out in one sendmmsg() */
+static void
+pnt_monitor_probe_due(struct pnt_timer *timer, void *arg)
+{
+    struct pnt_monitor *mon = arg;
+    struct pnt_monitor_device *dev = (struct pnt_monitor_device *)((char *)timer - offsetof(struct pnt_monitor_device, probe));
+
+    uint64_t next = timer->expires + mon->interval;
+
+    /* after a stall, skip the intervals that passed instead of firing again
+       in this advance, the device keeps its place in the schedule */
+    if (next <= mon->now)
+        next += (mon->now - next) / mon->interval * mon->interval + mon->interval;
+    pnt_wheel_add(&mon->probes, &dev->probe, next);
+
+    if (dev->queued)
+        return;
+
+    /* a timeout as long as the interval can still be pending */
+    if (dev->outstanding)
+        pnt_monitor_lost(mon, dev);
+
+    dev->queued = 1;
+    mon->due[mon->ndue++] = dev;
+}
+
+static int
+pnt_monitor_send_due(struct pnt_monitor *mon)
+{
+    struct mmsghdr msgs[PNT_MONITOR_BATCH];
+    struct iovec iovs[PNT_MONITOR_BATCH];
+    struct sockaddr_ll addrs[PNT_MONITOR_BATCH];
+    int sent = 0;
+
+    /* in batches, a large device list may all be due at once */
+    while (sent < mon->ndue)
+    {
+        int n = 0;
+
+        for (; n < PNT_MONITOR_BATCH && sent + n < mon->ndue; n++)
+        {
+            struct pnt_monitor_device *dev = mon->due[sent + n];
+            char *frame = mon->frames[n];
+
+            dev->queued = 0;
+            dev->xact.data = dev;
+            if (pnt_xact_start(&mon->xacts, &dev->xact, PN_DCP_SERVICE_ID_GET, dev->mac, mon->timeout) < 0)
+                return -1;
+            dev->outstanding = 1;
+            dev->sent++;
+
+            memset(frame, 0, PNT_MONITOR_FRAME_SIZE);
+            iovs[n].iov_base = frame;
+            iovs[n].iov_len = pnt_dcp_create_get_request(frame, mon->if_addr, dev->mac, dev->xact.xid,
+                                                         PN_DCP_BLOCK_OPTION_DEV_PROPS,
+                                                         PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME);
+
+            memset(&addrs[n], 0, sizeof(addrs[n]));
+            addrs[n].sll_family = AF_PACKET;
+            addrs[n].sll_ifindex = mon->if_index;
+            addrs[n].sll_halen = ETH_ALEN;
+            memcpy(addrs[n].sll_addr, dev->mac, ETH_ALEN);
+
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = &addrs[n];
+            msgs[n].msg_hdr.msg_namelen = sizeof(addrs[n]);
+            msgs[n].msg_hdr.msg_iov = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+
+        for (int done = 0; done < n;)
+        {
+            int ret = sendmmsg(mon->sock, msgs + done, n - done, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("Could not send get request packets");
+                return -1;
+            }
+            done += ret;
+        }
+        sent += n;
+    }
+    mon->ndue = 0;
+
+    if (sent > 0)
+        pnt_debug("monitor: sent %d requests", sent);
+    return sent;
+}
+
+static int
+pnt_monitor_run(struct pnt_monitor *mon)
+{
+    struct pollfd pfd = {.fd = mon->sock, .events = POLLIN};
+    struct timespec next_report;
+    uint64_t now = pnt_now_ms();
+
+    /* Spread the first requests over one interval, every device then keeps
+       its place in the schedule */
+    pnt_wheel_init(&mon->probes);
+    for (int i = 0; i < mon->count; i++)
+        pnt_wheel_add(&mon->probes, &mon->devices[i].probe, now + (uint64_t)i * mon->interval / mon->count);
+
+    if (mon->report > 0)
+        pnt_deadline_set(&next_report, mon->report);
+
+    while (!pnt_monitor_stop)
+    {
+        if (pnt_monitor_dump)
+        {
+            pnt_monitor_dump = 0;
+            pnt_monitor_report(mon);
+        }
+        if (mon->report > 0 && pnt_deadline_remaining_ms(&next_report) == 0)
+        {
+            pnt_monitor_report(mon);
+            pnt_timespec_add_ms(&next_report, mon->report);
+        }
+
+        mon->now = pnt_now_ms();
+        pnt_xact_expire(&mon->xacts, pnt_monitor_expired, mon);
+        pnt_wheel_advance(&mon->probes, mon->now, pnt_monitor_probe_due, mon);
+        if (pnt_monitor_send_due(mon) < 0)
+            return -1;
+        fflush(stdout);
+
+        int wait = pnt_wheel_next_ms(&mon->probes);
+        int expire = pnt_xact_next_timeout(&mon->xacts);
+
+        if (expire >= 0 && (wait < 0 || expire < wait))
+            wait = expire;
+        if (mon->report > 0 && pnt_deadline_remaining_ms(&next_report) < wait)
+            wait = pnt_deadline_remaining_ms(&next_report);
+
+        int ready = poll(&pfd, 1, wait);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not poll socket");
+            return -1;
+        }
+        if (ready == 0)
+            continue;
+
+        /* transmit times first, the answers to those requests may be queued already */
+        if (pfd.revents & POLLERR)
+            pnt_recv_tx_timestamps(mon->sock, mon->buf, pnt_monitor_handle_tx, mon);
+
+        if (pfd.revents & POLLIN)
+        {
+            if (mon->ring.map != NULL)
+                pnt_ring_dispatch(&mon->ring, pnt_monitor_handle_frame, mon);
+            else if (pnt_recv_dispatch(mon->sock, mon->buf, pnt_monitor_handle_frame, mon) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int pnt_monitor(int argc, char **argv)
+{
+    struct pnt_monitor *mon;
+    char *if_name = NULL;
+    int do_headers = 0;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    mon = calloc(1, sizeof(*mon));
+    if (mon == NULL)
+    {
+        perror("Cannot allocate monitor state");
+        return EXIT_FAILURE;
+    }
+    mon->sock = -1;
+    mon->interval = PNT_MONITOR_INTERVAL;
+    mon->timeout = PNT_MONITOR_TIMEOUT;
+    mon->missed = PNT_MONITOR_MISSED;
+
+    while ((opt = getopt(argc, argv, "vdoi:f:I:t:m:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            pnt_set_verbose_level(PNT_VERBOSE_PRINT);
+            break;
+        case 'd':
+            pnt_set_verbose_level(PNT_VERBOSE_DEBUG);
+            break;
+        case 'o':
+            do_headers = 1;
+            break;
+        case 'i':
+            if_name = optarg;
+            break;
+        case 'f':
+            if (pnt_monitor_read_devices(mon, optarg) < 0)
+                goto out;
+            break;
+        case 'I':
+            mon->interval = atoi(optarg);
+            break;
+        case 't':
+            mon->timeout = atoi(optarg);
+            break;
+        case 'm':
+            mon->missed = atoi(optarg);
+            break;
+        case 's':
+            mon->report = atoi(optarg);
+            break;
+        default: /* '?' */
+            pnt_monitor_print_usage(argv[0]);
+            goto out;
+        }
+    }
+
+    pnt_print("Parameters: iface[%s] verbose_level[%d] devices[%d] interval[%d] timeout[%d] missed[%d] report[%d]",
+              if_name, pnt_get_verbose_level(), mon->count, mon->interval, mon->timeout, mon->missed, mon->report);
+
+    if (if_name == NULL || mon->count == 0 || mon->interval < 1 || mon->timeout < 1 ||
+        mon->timeout > mon->interval || mon->missed < 1 || mon->report < 0)
+    {
+        pnt_monitor_print_usage(argv[0]);
+        goto out;
+    }
+    pnt_print("%.0f requests/s", mon->count * 1000.0 / mon->interval);
+
+    mon->sock = open_raw_sock(if_name, mon->if_addr, &mon->if_index, 0, 1, 1, 1, &mon->ring);
+    if (mon->sock < 0)
+    {
+        //error has already been printed
+        goto out;
+    }
+
+    if (pnt_attach_dcp_filter(mon->sock, PN_FRAME_ID_RTA_DCP_GETSET, pnt_xid_alloc(), PNT_XID_SESSION_MASK) < 0)
+        pnt_print("%s: could not attach socket filter, all frames will be received", if_name);
+    if (pnt_enable_tx_timestamps(mon->sock) < 0)
+        pnt_print("%s: no kernel transmit timestamps, timing from user space", if_name);
+
+    mon->due = calloc(mon->count, sizeof(*mon->due));
+    if (mon->due == NULL || pnt_xact_table_init(&mon->xacts, mon->count) < 0)
+    {
+        perror("Cannot allocate request buffers");
+        goto out;
+    }
+
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = pnt_monitor_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+
+    if (do_headers)
+        printf("mac\tstate\tsent\treceived\tlost\tp50_ms\tp99_ms\tmax_ms\n");
+
+    if (pnt_monitor_run(mon) == 0)
+        ret = EXIT_SUCCESS;
+
+    pnt_monitor_report(mon);
+
+out:
+    if (mon->sock >= 0)
+    {
+        pnt_ring_close(&mon->ring);
+        close(mon->sock);
+    }
+    pnt_xact_table_free(&mon->xacts);
+    free(mon->due);
+    free(mon->devices);
+    free(mon);
+
+    return ret;
+}
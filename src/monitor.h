@@ -0,0 +1,66 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+
+#include <signal.h>
+
+#define PNT_MONITOR_INTERVAL 1000
+#define PNT_MONITOR_TIMEOUT 500
+#define PNT_MONITOR_MISSED 1
+#define PNT_MONITOR_FRAME_SIZE 64
+#define PNT_MONITOR_BATCH 64 //requests per sendmmsg()
+
+/* RTT histogram: exact below 4 us, then 4 linear buckets per power of two,
+   so a percentile is off by at most a quarter of an octave's width, up to
+   25% of the value. 96 buckets reach 16 s. */
+#define PNT_MONITOR_BUCKETS 96
+
+enum pnt_monitor_state
+{
+    PNT_MONITOR_UNKNOWN,
+    PNT_MONITOR_UP,
+    PNT_MONITOR_DOWN,
+};
+
+struct pnt_monitor_device
+{
+    uint8_t mac[ETH_ALEN];
+    uint8_t state;       //enum pnt_monitor_state
+    uint8_t outstanding; //xact is in the table
+    uint8_t queued;      //in due, waiting for pnt_monitor_send_due()
+    uint16_t missed;     //probes in a row without answer
+    uint32_t sent;
+    uint32_t received;
+    uint32_t lost;
+    uint32_t max_us;
+    struct pnt_timer probe; //when the next request is due
+    struct pnt_xact xact;   //request in flight, xact.sent becomes the kernel TX time when known
+    uint32_t hist[PNT_MONITOR_BUCKETS];
+};
+
+struct pnt_monitor
+{
+    struct pnt_monitor_device *devices;
+    int count;
+    int cap;
+    int interval; //between two requests to the same device
+    int timeout;
+    int missed;   //probes in a row a device may miss before it is DOWN
+    int report;   //ms between summaries, 0: only on SIGUSR1 and at exit
+    struct pnt_wheel probes;
+    uint64_t now; //time the probe wheel is being advanced to
+    struct pnt_xact_table xacts;
+    struct pnt_monitor_device **due; //requests to send in this loop
+    int ndue;
+    char frames[PNT_MONITOR_BATCH][PNT_MONITOR_FRAME_SIZE];
+    int sock;
+    int if_index;
+    uint8_t if_addr[ETH_ALEN];
+    struct pnt_ring ring;
+    char buf[BUF_SIZE];
+};
+
+int pnt_monitor(int argc, char **argv);
@@ -0,0 +1,493 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "output.h"
+
+_Static_assert(sizeof(struct pnt_output_bin_record) == 562, "bin record layout changed");
+
+static const char *pnt_output_formats[] = {
+    [PNT_OUTPUT_TSV] = "tsv",
+    [PNT_OUTPUT_CSV] = "csv",
+    [PNT_OUTPUT_JSON] = "json",
+    [PNT_OUTPUT_NDJSON] = "ndjson",
+    [PNT_OUTPUT_BIN] = "bin",
+};
+
+static const char *pnt_output_events[] = {
+    [PNT_EVENT_NONE] = "",
+    [PNT_EVENT_ADDED] = "ADDED",
+    [PNT_EVENT_CHANGED] = "CHANGED",
+    [PNT_EVENT_REMOVED] = "REMOVED",
+    [PNT_EVENT_HELLO] = "HELLO",
+    [PNT_EVENT_CONFIRMED] = "CONFIRMED",
+    [PNT_EVENT_UNCONFIRMED] = "UNCONFIRMED",
+};
+
+/* Names of the PNT_FIELD_* bits, in bit order */
+static const char *pnt_output_fields[] = {
+    "station_name",
+    "vendor_value",
+    "device_role",
+    "vendor_id",
+    "device_id",
+    "ip_address",
+    "subnet_mask",
+    "gateway",
+    "ip_status",
+};
+
+int pnt_output_parse_format(const char *name)
+{
+    for (unsigned int i = 0; i < sizeof(pnt_output_formats) / sizeof(pnt_output_formats[0]); i++)
+    {
+        if (strcmp(name, pnt_output_formats[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int pnt_output_init(struct pnt_output *out, enum pnt_output_format format, int flags, int fd)
+{
+    memset(out, 0, sizeof(*out));
+    out->format = format;
+    out->flags = flags;
+    out->fd = fd;
+
+    out->buf = malloc(PNT_OUTPUT_BUF_SIZE);
+    if (out->buf == NULL)
+    {
+        perror("Cannot allocate output buffer");
+        return -1;
+    }
+
+    if (format == PNT_OUTPUT_BIN)
+    {
+        struct pnt_output_bin_header hdr;
+
+        memcpy(hdr.magic, PNT_OUTPUT_BIN_MAGIC, sizeof(hdr.magic));
+        hdr.version = htole16(PNT_OUTPUT_BIN_VERSION);
+        hdr.record_size = htole16(sizeof(struct pnt_output_bin_record));
+        memcpy(out->buf, &hdr, sizeof(hdr));
+        out->len = sizeof(hdr);
+    }
+    else if (format == PNT_OUTPUT_JSON)
+    {
+        out->buf[out->len++] = '[';
+    }
+
+    return 0;
+}
+
+int pnt_output_flush(struct pnt_output *out)
+{
+    size_t off = 0;
+
+    while (off < out->len)
+    {
+        ssize_t written = write(out->fd, out->buf + off, out->len - off);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not write output");
+            out->len = 0;
+            return -1;
+        }
+        off += written;
+    }
+
+    out->len = 0;
+    return 0;
+}
+
+int pnt_output_close(struct pnt_output *out)
+{
+    int ret;
+
+    if (out->buf == NULL)
+        return 0;
+
+    if (out->format == PNT_OUTPUT_JSON)
+    {
+        memcpy(out->buf + out->len, out->records > 0 ? "\n]\n" : "]\n", out->records > 0 ? 3 : 2);
+        out->len += out->records > 0 ? 3 : 2;
+    }
+
+    ret = pnt_output_flush(out);
+    free(out->buf);
+    out->buf = NULL;
+
+    return ret;
+}
+
+/* Every record is formatted straight into the buffer, which always has
+   room for one more */
+static void pnt_output_printf(struct pnt_output *out, const char *format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(out->buf + out->len, PNT_OUTPUT_BUF_SIZE - out->len, format, args);
+    va_end(args);
+
+    if (len > 0)
+        out->len += (size_t)len < PNT_OUTPUT_BUF_SIZE - out->len ? (size_t)len : PNT_OUTPUT_BUF_SIZE - out->len - 1;
+}
+
+static void pnt_output_putc(struct pnt_output *out, char c)
+{
+    out->buf[out->len++] = c;
+}
+
+static void pnt_output_json_string(struct pnt_output *out, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    pnt_output_putc(out, '"');
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            pnt_output_putc(out, '\\');
+            pnt_output_putc(out, *p);
+        }
+        else if (*p < 0x20 || *p >= 0x7f)
+        {
+            /* DCP strings carry no encoding, bytes are taken as Latin-1 */
+            memcpy(out->buf + out->len, "\\u00", 4);
+            out->len += 4;
+            pnt_output_putc(out, hex[*p >> 4]);
+            pnt_output_putc(out, hex[*p & 0xf]);
+        }
+        else
+            pnt_output_putc(out, *p);
+    }
+    pnt_output_putc(out, '"');
+}
+
+static void pnt_output_csv_string(struct pnt_output *out, const char *str)
+{
+    if (strpbrk(str, ",\"\r\n") == NULL)
+    {
+        pnt_output_printf(out, "%s", str);
+        return;
+    }
+
+    pnt_output_putc(out, '"');
+    for (const char *p = str; *p; p++)
+    {
+        if (*p == '"')
+            pnt_output_putc(out, '"');
+        pnt_output_putc(out, *p);
+    }
+    pnt_output_putc(out, '"');
+}
+
+static uint32_t pnt_output_changed(const struct pn_dcp_identify_response_data *old,
+                                   const struct pn_dcp_identify_response_data *new)
+{
+    uint32_t changed = 0;
+
+    if (old == NULL)
+        return 0;
+
+    if (strcmp(old->device_stationname, new->device_stationname) != 0)
+        changed |= PNT_FIELD_STATION_NAME;
+    if (strcmp(old->device_vendorvalue, new->device_vendorvalue) != 0)
+        changed |= PNT_FIELD_VENDOR_VALUE;
+    if (old->device_role != new->device_role)
+        changed |= PNT_FIELD_DEVICE_ROLE;
+    if (old->device_id_vendor != new->device_id_vendor)
+        changed |= PNT_FIELD_VENDOR_ID;
+    if (old->device_id_device != new->device_id_device)
+        changed |= PNT_FIELD_DEVICE_ID;
+    if (memcmp(old->device_ip_addr, new->device_ip_addr, 4) != 0)
+        changed |= PNT_FIELD_IP_ADDRESS;
+    if (memcmp(old->device_ip_mask, new->device_ip_mask, 4) != 0)
+        changed |= PNT_FIELD_SUBNET_MASK;
+    if (memcmp(old->device_ip_gateway, new->device_ip_gateway, 4) != 0)
+        changed |= PNT_FIELD_GATEWAY;
+    if (old->device_ip_info != new->device_ip_info)
+        changed |= PNT_FIELD_IP_STATUS;
+
+    return changed;
+}
+
+#define _IP(a) a[0], a[1], a[2], a[3]
+
+#define _DIFF_STR(bit, field)                                                     \
+    if (changed & bit)                                                            \
+    {                                                                             \
+        pnt_output_printf(out, "\t%s:%s>%s", pnt_output_fields[__builtin_ctz(bit)], \
+                          old->field, new->field);                                \
+    }
+#define _DIFF_NUM(bit, field, fmt)                                                \
+    if (changed & bit)                                                            \
+    {                                                                             \
+        pnt_output_printf(out, "\t%s:" fmt ">" fmt, pnt_output_fields[__builtin_ctz(bit)], \
+                          old->field, new->field);                                \
+    }
+#define _DIFF_IP(bit, field)                                                      \
+    if (changed & bit)                                                            \
+    {                                                                             \
+        pnt_output_printf(out, "\t%s:%u.%u.%u.%u>%u.%u.%u.%u", pnt_output_fields[__builtin_ctz(bit)], \
+                          _IP(old->field), _IP(new->field));                      \
+    }
+
+/* The original discovery layout, CHANGED records end with field:old>new */
+static void pnt_output_tsv(struct pnt_output *out, enum pnt_output_event event, const struct pnt_device *dev,
+                           const struct pn_dcp_identify_response_data *old, uint32_t changed)
+{
+    const struct pn_dcp_identify_response_data *new = &dev->data;
+
+    if (out->flags & PNT_OUTPUT_EVENT)
+        pnt_output_printf(out, "%s\t", pnt_output_events[event]);
+    if (out->flags & PNT_OUTPUT_VLAN)
+    {
+        /* the VLAN goes between the interface and the device */
+        if (out->flags & PNT_OUTPUT_IFACE)
+            pnt_output_printf(out, "%s\t", dev->if_name);
+        pnt_output_printf(out, "%u\t", dev->vlan);
+    }
+
+    int len = pnt_device_snprint(out->buf + out->len, PNT_DEVICE_LINE_SIZE,
+                                 (out->flags & (PNT_OUTPUT_IFACE | PNT_OUTPUT_VLAN)) == PNT_OUTPUT_IFACE ? dev->if_name : NULL,
+                                 dev->mac, new);
+    out->len += len < PNT_DEVICE_LINE_SIZE ? len : PNT_DEVICE_LINE_SIZE - 1;
+
+    if (out->flags & PNT_OUTPUT_TIMES)
+        pnt_output_printf(out, "\t%ld.%06ld\t%ld.%06ld",
+                          (long)dev->first_seen.tv_sec, dev->first_seen.tv_nsec / 1000L,
+                          (long)dev->last_seen.tv_sec, dev->last_seen.tv_nsec / 1000L);
+
+    if (old != NULL)
+    {
+        _DIFF_STR(PNT_FIELD_STATION_NAME, device_stationname);
+        _DIFF_STR(PNT_FIELD_VENDOR_VALUE, device_vendorvalue);
+        _DIFF_NUM(PNT_FIELD_DEVICE_ROLE, device_role, "%u");
+        _DIFF_NUM(PNT_FIELD_VENDOR_ID, device_id_vendor, "%04x");
+        _DIFF_NUM(PNT_FIELD_DEVICE_ID, device_id_device, "%04x");
+        _DIFF_IP(PNT_FIELD_IP_ADDRESS, device_ip_addr);
+        _DIFF_IP(PNT_FIELD_SUBNET_MASK, device_ip_mask);
+        _DIFF_IP(PNT_FIELD_GATEWAY, device_ip_gateway);
+        _DIFF_NUM(PNT_FIELD_IP_STATUS, device_ip_info, "%u");
+    }
+
+    pnt_output_putc(out, '\n');
+}
+
+#undef _DIFF_STR
+#undef _DIFF_NUM
+#undef _DIFF_IP
+
+static void pnt_output_csv(struct pnt_output *out, enum pnt_output_event event, const struct pnt_device *dev,
+                           uint32_t changed)
+{
+    const struct pn_dcp_identify_response_data *data = &dev->data;
+
+    if (out->flags & PNT_OUTPUT_EVENT)
+        pnt_output_printf(out, "%s,", pnt_output_events[event]);
+    if (out->flags & PNT_OUTPUT_IFACE)
+    {
+        pnt_output_csv_string(out, dev->if_name);
+        pnt_output_putc(out, ',');
+    }
+    if (out->flags & PNT_OUTPUT_VLAN)
+        pnt_output_printf(out, "%u,", dev->vlan);
+
+    pnt_output_printf(out, "%02x:%02x:%02x:%02x:%02x:%02x,",
+                      dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4], dev->mac[5]);
+    pnt_output_csv_string(out, data->device_stationname);
+    pnt_output_putc(out, ',');
+    pnt_output_csv_string(out, data->device_vendorvalue);
+    pnt_output_printf(out, ",%u,%04x,%04x,%u.%u.%u.%u,%u.%u.%u.%u,%u.%u.%u.%u,%u",
+                      data->device_role, data->device_id_vendor, data->device_id_device,
+                      _IP(data->device_ip_addr), _IP(data->device_ip_mask), _IP(data->device_ip_gateway),
+                      data->device_ip_info);
+
+    if (out->flags & PNT_OUTPUT_TIMES)
+        pnt_output_printf(out, ",%ld.%06ld,%ld.%06ld",
+                          (long)dev->first_seen.tv_sec, dev->first_seen.tv_nsec / 1000L,
+                          (long)dev->last_seen.tv_sec, dev->last_seen.tv_nsec / 1000L);
+
+    /* changed field names, ; separated */
+    if (out->flags & PNT_OUTPUT_EVENT)
+    {
+        pnt_output_putc(out, ',');
+        for (unsigned int i = 0, first = 1; i < sizeof(pnt_output_fields) / sizeof(pnt_output_fields[0]); i++)
+        {
+            if (!(changed & (1u << i)))
+                continue;
+            pnt_output_printf(out, "%s%s", first ? "" : ";", pnt_output_fields[i]);
+            first = 0;
+        }
+    }
+
+    pnt_output_putc(out, '\n');
+}
+
+static void pnt_output_json(struct pnt_output *out, enum pnt_output_event event, const struct pnt_device *dev,
+                            uint32_t changed)
+{
+    const struct pn_dcp_identify_response_data *data = &dev->data;
+
+    if (out->format == PNT_OUTPUT_JSON)
+        pnt_output_printf(out, "%s\n", out->records > 0 ? "," : "");
+
+    pnt_output_putc(out, '{');
+    if (out->flags & PNT_OUTPUT_EVENT)
+        pnt_output_printf(out, "\"event\":\"%s\",", pnt_output_events[event]);
+    if (out->flags & PNT_OUTPUT_IFACE)
+    {
+        pnt_output_printf(out, "\"interface\":");
+        pnt_output_json_string(out, dev->if_name);
+        pnt_output_putc(out, ',');
+    }
+    if (out->flags & PNT_OUTPUT_VLAN)
+        pnt_output_printf(out, "\"vlan\":%u,", dev->vlan);
+
+    pnt_output_printf(out, "\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"station_name\":",
+                      dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4], dev->mac[5]);
+    pnt_output_json_string(out, data->device_stationname);
+    pnt_output_printf(out, ",\"vendor_value\":");
+    pnt_output_json_string(out, data->device_vendorvalue);
+    pnt_output_printf(out, ",\"device_role\":%u,\"vendor_id\":%u,\"device_id\":%u,"
+                           "\"ip_address\":\"%u.%u.%u.%u\",\"subnet_mask\":\"%u.%u.%u.%u\",\"gateway\":\"%u.%u.%u.%u\","
+                           "\"ip_status\":%u",
+                      data->device_role, data->device_id_vendor, data->device_id_device,
+                      _IP(data->device_ip_addr), _IP(data->device_ip_mask), _IP(data->device_ip_gateway),
+                      data->device_ip_info);
+
+    if (out->flags & PNT_OUTPUT_TIMES)
+        pnt_output_printf(out, ",\"first_seen\":%ld.%06ld,\"last_seen\":%ld.%06ld",
+                          (long)dev->first_seen.tv_sec, dev->first_seen.tv_nsec / 1000L,
+                          (long)dev->last_seen.tv_sec, dev->last_seen.tv_nsec / 1000L);
+
+    if (event == PNT_EVENT_CHANGED)
+    {
+        pnt_output_printf(out, ",\"changed\":[");
+        for (unsigned int i = 0, first = 1; i < sizeof(pnt_output_fields) / sizeof(pnt_output_fields[0]); i++)
+        {
+            if (!(changed & (1u << i)))
+                continue;
+            pnt_output_printf(out, "%s\"%s\"", first ? "" : ",", pnt_output_fields[i]);
+            first = 0;
+        }
+        pnt_output_putc(out, ']');
+    }
+
+    pnt_output_putc(out, '}');
+    if (out->format == PNT_OUTPUT_NDJSON)
+        pnt_output_putc(out, '\n');
+}
+
+static int64_t pnt_output_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void pnt_output_bin(struct pnt_output *out, enum pnt_output_event event, const struct pnt_device *dev,
+                           uint32_t changed)
+{
+    const struct pn_dcp_identify_response_data *data = &dev->data;
+    struct pnt_output_bin_record *rec = (struct pnt_output_bin_record *)(out->buf + out->len);
+
+    memset(rec, 0, sizeof(*rec));
+    rec->first_seen_ns = htole64(pnt_output_ns(&dev->first_seen));
+    rec->last_seen_ns = htole64(pnt_output_ns(&dev->last_seen));
+    rec->changed = htole32(changed);
+    rec->vendor_id = htole16(data->device_id_vendor);
+    rec->device_id = htole16(data->device_id_device);
+    rec->ip_status = htole16(data->device_ip_info);
+    rec->event = event;
+    rec->device_role = data->device_role;
+    memcpy(rec->mac, dev->mac, ETH_ALEN);
+    memcpy(rec->ip_address, data->device_ip_addr, 4);
+    memcpy(rec->subnet_mask, data->device_ip_mask, 4);
+    memcpy(rec->gateway, data->device_ip_gateway, 4);
+    memcpy(rec->interface, dev->if_name, IFNAMSIZ - 1);
+    memcpy(rec->station_name, data->device_stationname, sizeof(data->device_stationname));
+    memcpy(rec->vendor_value, data->device_vendorvalue, sizeof(data->device_vendorvalue));
+    rec->vlan = htole16(dev->vlan);
+
+    out->len += sizeof(*rec);
+}
+
+#undef _IP
+
+void pnt_output_header(struct pnt_output *out)
+{
+    const char *sep;
+
+    if (out->format == PNT_OUTPUT_TSV)
+    {
+        if (out->flags & PNT_OUTPUT_EVENT)
+            pnt_output_printf(out, "Event\t");
+        if (out->flags & PNT_OUTPUT_IFACE)
+            pnt_output_printf(out, "Interface\t");
+        if (out->flags & PNT_OUTPUT_VLAN)
+            pnt_output_printf(out, "VLAN\t");
+        pnt_output_printf(out, "MAC Address\tStation Name\tVendor Value\tDevice Role\tVendorID\tDeviceID\tIP Address\tSubnet Mask\tGateway\tIP status");
+        if (out->flags & PNT_OUTPUT_TIMES)
+            pnt_output_printf(out, "\tFirst Seen\tLast Seen");
+        pnt_output_putc(out, '\n');
+    }
+    else if (out->format == PNT_OUTPUT_CSV)
+    {
+        sep = "";
+        if (out->flags & PNT_OUTPUT_EVENT)
+        {
+            pnt_output_printf(out, "event");
+            sep = ",";
+        }
+        if (out->flags & PNT_OUTPUT_IFACE)
+        {
+            pnt_output_printf(out, "%sinterface", sep);
+            sep = ",";
+        }
+        if (out->flags & PNT_OUTPUT_VLAN)
+        {
+            pnt_output_printf(out, "%svlan", sep);
+            sep = ",";
+        }
+        pnt_output_printf(out, "%smac,station_name,vendor_value,device_role,vendor_id,device_id,ip_address,subnet_mask,gateway,ip_status", sep);
+        if (out->flags & PNT_OUTPUT_TIMES)
+            pnt_output_printf(out, ",first_seen,last_seen");
+        if (out->flags & PNT_OUTPUT_EVENT)
+            pnt_output_printf(out, ",changed");
+        pnt_output_putc(out, '\n');
+    }
+}
+
+/* Format one device record. old is the previous data of a CHANGED device. */
+void pnt_output_device(struct pnt_output *out, enum pnt_output_event event, const struct pnt_device *dev,
+                       const struct pn_dcp_identify_response_data *old)
+{
+    uint32_t changed = pnt_output_changed(old, &dev->data);
+
+    if (PNT_OUTPUT_BUF_SIZE - out->len < PNT_OUTPUT_RECORD_MAX)
+        pnt_output_flush(out);
+
+    switch (out->format)
+    {
+    case PNT_OUTPUT_TSV:
+        pnt_output_tsv(out, event, dev, old, changed);
+        break;
+    case PNT_OUTPUT_CSV:
+        pnt_output_csv(out, event, dev, changed);
+        break;
+    case PNT_OUTPUT_JSON:
+    case PNT_OUTPUT_NDJSON:
+        pnt_output_json(out, event, dev, changed);
+        break;
+    case PNT_OUTPUT_BIN:
+        pnt_output_bin(out, event, dev, changed);
+        break;
+    }
+
+    out->records++;
+}
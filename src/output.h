@@ -0,0 +1,106 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#ifndef __PNT_OUTPUT__
+#define __PNT_OUTPUT__
+
+#include "common.h"
+#include "devtable.h"
+
+#include <endian.h>
+
+#define PNT_OUTPUT_BUF_SIZE (1 << 16)
+#define PNT_OUTPUT_RECORD_MAX 8192 //worst case size of one formatted record
+
+#define PNT_OUTPUT_FORMATS "tsv|csv|json|ndjson|bin"
+
+enum pnt_output_format
+{
+    PNT_OUTPUT_TSV,
+    PNT_OUTPUT_CSV,
+    PNT_OUTPUT_JSON,
+    PNT_OUTPUT_NDJSON,
+    PNT_OUTPUT_BIN,
+};
+
+/* Optional columns of the text formats, the binary record has them all */
+#define PNT_OUTPUT_IFACE 0x01
+#define PNT_OUTPUT_EVENT 0x02
+#define PNT_OUTPUT_TIMES 0x04
+#define PNT_OUTPUT_VLAN 0x08
+
+enum pnt_output_event
+{
+    PNT_EVENT_NONE,
+    PNT_EVENT_ADDED,
+    PNT_EVENT_CHANGED,
+    PNT_EVENT_REMOVED,
+    PNT_EVENT_HELLO,       //a device announced itself with a DCP Hello
+    PNT_EVENT_CONFIRMED,   //it answered the unicast identify sent after the Hello
+    PNT_EVENT_UNCONFIRMED, //it did not answer in time
+};
+
+/* Fields that differ in a CHANGED record */
+#define PNT_FIELD_STATION_NAME 0x0001
+#define PNT_FIELD_VENDOR_VALUE 0x0002
+#define PNT_FIELD_DEVICE_ROLE 0x0004
+#define PNT_FIELD_VENDOR_ID 0x0008
+#define PNT_FIELD_DEVICE_ID 0x0010
+#define PNT_FIELD_IP_ADDRESS 0x0020
+#define PNT_FIELD_SUBNET_MASK 0x0040
+#define PNT_FIELD_GATEWAY 0x0080
+#define PNT_FIELD_IP_STATUS 0x0100
+
+/* The bin format is this header followed by fixed size records, all
+   integers little endian and all strings NUL padded */
+#define PNT_OUTPUT_BIN_MAGIC "PNTB"
+#define PNT_OUTPUT_BIN_VERSION 2 //2: vlan
+
+struct pnt_output_bin_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+} __attribute__((packed));
+
+struct pnt_output_bin_record
+{
+    int64_t first_seen_ns; //CLOCK_REALTIME, 0 when unknown
+    int64_t last_seen_ns;
+    uint32_t changed; //PNT_FIELD_* bits
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t ip_status;
+    uint8_t event; //enum pnt_output_event
+    uint8_t device_role;
+    uint8_t mac[ETH_ALEN];
+    uint8_t ip_address[4];
+    uint8_t subnet_mask[4];
+    uint8_t gateway[4];
+    char interface[IFNAMSIZ];
+    char station_name[PN_DCP_NAME_OF_STATION_MAX + 2];
+    char vendor_value[PN_DCP_VENDOR_VALUE_MAX + 1];
+    uint16_t vlan;
+} __attribute__((packed));
+
+struct pnt_output
+{
+    enum pnt_output_format format;
+    int flags;
+    int fd;
+    char *buf;
+    size_t len;
+    unsigned long records;
+};
+
+int pnt_output_parse_format(const char *name);
+int pnt_output_init(struct pnt_output *out, enum pnt_output_format format, int flags, int fd);
+void pnt_output_header(struct pnt_output *out);
+void pnt_output_device(struct pnt_output *out, enum pnt_output_event event, const struct pnt_device *dev,
+                       const struct pn_dcp_identify_response_data *old);
+int pnt_output_flush(struct pnt_output *out);
+int pnt_output_close(struct pnt_output *out);
+
+#endif
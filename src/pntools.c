@@ -0,0 +1,282 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+#include "pntools.h"
+
+_Static_assert(PNT_CTX_MAC_LEN == ETH_ALEN, "MAC length");
+_Static_assert(PNT_CTX_NAME_OF_STATION_MAX == PN_DCP_NAME_OF_STATION_MAX, "NameOfStation length");
+_Static_assert(PNT_CTX_VENDOR_VALUE_MAX == PN_DCP_VENDOR_VALUE_MAX, "DeviceVendorValue length");
+
+/* An identify scan in flight, keyed by the XID of its request */
+struct pnt_ctx_scan
+{
+    struct pnt_xact xact;
+    unsigned int responses;
+    unsigned int expect; //0: run until the timeout
+    pnt_ctx_device_cb on_device;
+    pnt_ctx_done_cb on_done;
+    void *arg;
+    struct pnt_ctx_scan *next_done;
+};
+
+struct pnt_ctx
+{
+    char if_name[IFNAMSIZ];
+    int sock;
+    int if_index;
+    uint8_t if_addr[ETH_ALEN];
+    struct pnt_ring ring;
+    struct pnt_xact_table xacts;
+    /* scans that ended, their callbacks run once the receive path and the
+       timer wheel are no longer walked */
+    struct pnt_ctx_scan *done;
+    char buf[BUF_SIZE];
+};
+
+/* NULL with errno set on failure */
+struct pnt_ctx *pnt_ctx_open(const char *if_name)
+{
+    struct pnt_ctx *ctx;
+
+    if (if_name == NULL || strlen(if_name) >= IFNAMSIZ)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+    strcpy(ctx->if_name, if_name);
+
+    if (pnt_xact_table_init(&ctx->xacts, 4) < 0)
+    {
+        free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ctx->sock = open_raw_sock(ctx->if_name, ctx->if_addr, &ctx->if_index, 0, 1, 1, 1, &ctx->ring);
+    if (ctx->sock < 0)
+    {
+        int err = errno;
+
+        pnt_xact_table_free(&ctx->xacts);
+        free(ctx);
+        errno = err;
+        return NULL;
+    }
+
+    /* only answers to this process' requests wake the caller's loop */
+    if (pnt_attach_dcp_filter(ctx->sock, PN_FRAME_ID_RTA_DCP_RESPONSE, pnt_xid_alloc(), PNT_XID_SESSION_MASK) < 0)
+        pnt_print("%s: could not attach socket filter, all frames will be received", ctx->if_name);
+
+    return ctx;
+}
+
+/* Pending scans end without their done callback */
+void pnt_ctx_close(struct pnt_ctx *ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    for (unsigned int i = 0; i < ctx->xacts.size; i++)
+    {
+        if (ctx->xacts.slots[i] != NULL)
+            free(ctx->xacts.slots[i]->data);
+    }
+    while (ctx->done != NULL)
+    {
+        struct pnt_ctx_scan *scan = ctx->done;
+
+        ctx->done = scan->next_done;
+        free(scan);
+    }
+
+    pnt_ring_close(&ctx->ring);
+    close(ctx->sock);
+    pnt_xact_table_free(&ctx->xacts);
+    free(ctx);
+}
+
+int pnt_ctx_fd(const struct pnt_ctx *ctx)
+{
+    return ctx->sock;
+}
+
+int pnt_ctx_if_index(const struct pnt_ctx *ctx)
+{
+    return ctx->if_index;
+}
+
+const uint8_t *pnt_ctx_if_addr(const struct pnt_ctx *ctx)
+{
+    return ctx->if_addr;
+}
+
+/* ms until pnt_ctx_process() must run even without input, -1 for never */
+int pnt_ctx_timeout(const struct pnt_ctx *ctx)
+{
+    if (ctx->done != NULL)
+        return 0;
+    return pnt_xact_next_timeout(&ctx->xacts);
+}
+
+static void
+pnt_ctx_scan_end(struct pnt_ctx *ctx, struct pnt_ctx_scan *scan)
+{
+    pnt_xact_finish(&ctx->xacts, &scan->xact);
+    scan->next_done = ctx->done;
+    ctx->done = scan;
+}
+
+static void
+pnt_ctx_expired(struct pnt_xact *xact, void *arg)
+{
+    pnt_ctx_scan_end(arg, xact->data);
+}
+
+static void
+pnt_ctx_handle_frame(char *buf, ssize_t received, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_ctx *ctx = arg;
+    struct ether_header *eh = (struct ether_header *)buf;
+
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, received, ctx->if_addr, PN_FRAME_ID_RTA_DCP_RESPONSE);
+    if (pn_dcp == NULL)
+        return;
+
+    struct pnt_xact *xact = pnt_xact_match(&ctx->xacts, pn_dcp, eh->ether_shost);
+    if (xact == NULL)
+        return;
+
+    struct pnt_ctx_scan *scan = xact->data;
+    struct pn_dcp_identify_response_data data;
+    struct pnt_ctx_device dev;
+
+    pnt_stats_response(&xact->sent, &info->ts);
+
+    memset(&data, 0, sizeof(data));
+    pnt_parse_dcp_response_blocks(pn_dcp, &data);
+
+    memset(&dev, 0, sizeof(dev));
+    memcpy(dev.mac, eh->ether_shost, ETH_ALEN);
+    dev.received = info->ts;
+    memcpy(dev.vendor_value, data.device_vendorvalue, sizeof(dev.vendor_value));
+    memcpy(dev.station_name, data.device_stationname, sizeof(dev.station_name));
+    dev.vendor_id = data.device_id_vendor;
+    dev.device_id = data.device_id_device;
+    dev.role = data.device_role;
+    dev.ip_info = data.device_ip_info;
+    memcpy(dev.ip_addr, data.device_ip_addr, 4);
+    memcpy(dev.ip_mask, data.device_ip_mask, 4);
+    memcpy(dev.ip_gateway, data.device_ip_gateway, 4);
+
+    scan->responses++;
+    if (scan->expect > 0 && scan->responses >= scan->expect)
+        pnt_ctx_scan_end(ctx, scan);
+
+    if (scan->on_device != NULL)
+        scan->on_device(ctx, &dev, scan->arg);
+}
+
+/*
+ * Receive what is queued, end the scans that timed out and run their
+ * callbacks. Returns -1 with errno set when the socket failed.
+ */
+int pnt_ctx_process(struct pnt_ctx *ctx)
+{
+    int ret = 0;
+
+    if (ctx->ring.map != NULL)
+        pnt_ring_dispatch(&ctx->ring, pnt_ctx_handle_frame, ctx);
+    else if (pnt_recv_dispatch(ctx->sock, ctx->buf, pnt_ctx_handle_frame, ctx) < 0)
+        ret = -1;
+
+    pnt_xact_expire(&ctx->xacts, pnt_ctx_expired, ctx);
+
+    while (ctx->done != NULL)
+    {
+        struct pnt_ctx_scan *scan = ctx->done;
+        struct pnt_ctx_scan ended = *scan;
+
+        /* the callback may start the next scan right away */
+        ctx->done = scan->next_done;
+        free(scan);
+        if (ended.on_done != NULL)
+            ended.on_done(ctx, ended.responses, ended.arg);
+    }
+
+    return ret;
+}
+
+/*
+ * Send an identify request, to every device or to those matching filter
+ * (may be NULL). The scan ends after timeout ms, or once expect devices
+ * answered when expect is not 0.
+ */
+int pnt_ctx_discover(struct pnt_ctx *ctx, const struct pnt_ctx_filter *filter, int timeout, unsigned int expect,
+                     pnt_ctx_device_cb on_device, pnt_ctx_done_cb on_done, void *arg)
+{
+    struct pnt_dcp_filter dcp_filter;
+    struct pnt_ctx_scan *scan;
+
+    if (timeout < 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&dcp_filter, 0, sizeof(dcp_filter));
+    if (filter != NULL)
+    {
+        dcp_filter.name = filter->name;
+        dcp_filter.alias = filter->alias;
+        dcp_filter.has_id = filter->has_id;
+        dcp_filter.vendor_id = filter->vendor_id;
+        dcp_filter.device_id = filter->device_id;
+        dcp_filter.response_delay = filter->response_delay;
+    }
+
+    scan = calloc(1, sizeof(*scan));
+    if (scan == NULL)
+        return -1;
+    scan->expect = expect;
+    scan->on_device = on_device;
+    scan->on_done = on_done;
+    scan->arg = arg;
+    scan->xact.data = scan;
+
+    if (pnt_xact_start(&ctx->xacts, &scan->xact, PN_DCP_SERVICE_ID_IDENTIFY, NULL, timeout) < 0)
+    {
+        free(scan);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(ctx->buf, 0, BUF_SIZE);
+    size_t send_len = pnt_dcp_create_ident_request(ctx->buf, ctx->if_addr, scan->xact.xid, &dcp_filter);
+
+    struct sockaddr_ll sock_addr;
+
+    memset(&sock_addr, 0, sizeof(sock_addr));
+    sock_addr.sll_ifindex = ctx->if_index;
+    sock_addr.sll_halen = ETH_ALEN;
+    memcpy(sock_addr.sll_addr, addr_broadcast_pn, ETH_ALEN);
+
+    if (sendto(ctx->sock, ctx->buf, send_len, 0, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0)
+    {
+        int err = errno;
+
+        pnt_xact_finish(&ctx->xacts, &scan->xact);
+        free(scan);
+        errno = err;
+        return -1;
+    }
+
+    pnt_debug("%s: identify request %08x sent", ctx->if_name, scan->xact.xid);
+    return 0;
+}
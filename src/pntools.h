@@ -0,0 +1,93 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+/*
+ * libpntools: DCP discovery for programs with their own event loop.
+ *
+ * A context owns one AF_PACKET socket bound to an interface. Add
+ * pnt_ctx_fd() to poll/epoll for reading, wait at most pnt_ctx_timeout()
+ * ms, and call pnt_ctx_process() whenever either fires. Results arrive
+ * through the callbacks from inside pnt_ctx_process(); nothing blocks.
+ * Callbacks may start new scans but must not close the context.
+ *
+ * Not everything is per context: the verbosity, the log handler, the
+ * receive counters and the XID counter are process-wide. Use the library
+ * from one thread at a time.
+ */
+
+#ifndef __PNT_PNTOOLS__
+#define __PNT_PNTOOLS__
+
+#include <stdint.h>
+#include <time.h>
+
+/* Self-contained on purpose: this is the header installed next to the
+   library, the internal headers of pn-tools are not. Only what is marked
+   PNT_EXPORT here is exported from libpntools.so. */
+#if defined(__GNUC__)
+#define PNT_EXPORT __attribute__((visibility("default")))
+#else
+#define PNT_EXPORT
+#endif
+
+#define PNT_CTX_MAC_LEN 6
+#define PNT_CTX_NAME_OF_STATION_MAX 240
+#define PNT_CTX_VENDOR_VALUE_MAX 255
+
+struct pnt_ctx;
+
+/* Identify filter, only devices matching every set field answer */
+struct pnt_ctx_filter
+{
+    const char *name;  //NameOfStation
+    const char *alias; //AliasName, <port>.<name of the neighbour>
+    int has_id;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    int response_delay; //10 ms slots, 0: 1 for a name or an alias, else the DCP default
+};
+
+/* The identify response of one device, strings are NUL terminated */
+struct pnt_ctx_device
+{
+    uint8_t mac[PNT_CTX_MAC_LEN];
+    struct timespec received; //CLOCK_REALTIME
+    char vendor_value[PNT_CTX_VENDOR_VALUE_MAX + 1];
+    char station_name[PNT_CTX_NAME_OF_STATION_MAX + 1];
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t role;
+    uint16_t ip_info;
+    uint8_t ip_addr[4];
+    uint8_t ip_mask[4];
+    uint8_t ip_gateway[4];
+};
+
+/* One call per response, a device answering twice is reported twice */
+typedef void (*pnt_ctx_device_cb)(struct pnt_ctx *ctx, const struct pnt_ctx_device *dev, void *arg);
+/* The scan is over: its timeout passed or the expected devices answered */
+typedef void (*pnt_ctx_done_cb)(struct pnt_ctx *ctx, unsigned int responses, void *arg);
+
+PNT_EXPORT struct pnt_ctx *pnt_ctx_open(const char *if_name);
+PNT_EXPORT void pnt_ctx_close(struct pnt_ctx *ctx);
+PNT_EXPORT int pnt_ctx_fd(const struct pnt_ctx *ctx);
+PNT_EXPORT int pnt_ctx_if_index(const struct pnt_ctx *ctx);
+PNT_EXPORT const uint8_t *pnt_ctx_if_addr(const struct pnt_ctx *ctx);
+PNT_EXPORT int pnt_ctx_timeout(const struct pnt_ctx *ctx);
+PNT_EXPORT int pnt_ctx_process(struct pnt_ctx *ctx);
+PNT_EXPORT int pnt_ctx_discover(struct pnt_ctx *ctx, const struct pnt_ctx_filter *filter, int timeout, unsigned int expect,
+                                pnt_ctx_device_cb on_device, pnt_ctx_done_cb on_done, void *arg);
+
+/* Messages go to stderr unless a handler takes them, level is one of these.
+   Both settings are process-wide, set them before opening a context. */
+#define PNT_VERBOSE_PRINT 1
+#define PNT_VERBOSE_DEBUG 2
+
+typedef void (*pnt_log_handler)(int level, const char *msg, void *arg);
+
+PNT_EXPORT void pnt_set_verbose_level(int lvl);
+PNT_EXPORT void pnt_set_log_handler(pnt_log_handler handler, void *arg);
+
+#endif
@@ -0,0 +1,473 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "set.h"
+
+static void
+pnt_set_print_usage(const char *progname)
+{
+    fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
+    fprintf(stderr, "usage: %s set -i <iface> -f <file> [-h] [-v] [-d] [-T] [-w <window>] [-t <timeout>] [-r <retries>]\n\n", progname);
+    fprintf(stderr, "Assign station names and IP parameters to Profinet devices with DCP Set requests\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "   -h            Show this help\n");
+    fprintf(stderr, "   -i iface      The interface on which to send the requests\n");
+    fprintf(stderr, "   -f file       Read targets from file (\"-\" for stdin), one per line:\n");
+    fprintf(stderr, "                     <mac> <name|-> [<ip> <mask> [<gateway>]]\n");
+    fprintf(stderr, "                 \"-\" leaves the name as it is, without an ip the IP parameters are kept\n");
+    fprintf(stderr, "   -T            Set the values temporarily, they are lost on power off\n");
+    fprintf(stderr, "   -w window     Amount of requests in flight at once (default=%d)\n", PNT_SET_WINDOW);
+    fprintf(stderr, "   -t timeout    Amount of time (in ms) to wait for each response (default=%d)\n", PNT_SET_TIMEOUT);
+    fprintf(stderr, "   -r retries    Amount of times a request is repeated without response (default=%d)\n", PNT_SET_RETRIES);
+    fprintf(stderr, "   -v            Be verbose\n");
+    fprintf(stderr, "   -d            Show debug information\n");
+    fprintf(stderr, "\nEach device is reported as soon as it is done, as <mac> OK|ERROR|TIMEOUT <attempts> [<errors>]\n");
+}
+
+/* NameOfStation labels: lower case letters, digits and '-', split by '.' */
+static int
+pnt_set_valid_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len == 0 || len > PN_DCP_NAME_OF_STATION_MAX || name[0] == '.' || name[len - 1] == '.')
+        return 0;
+
+    for (const char *p = name; *p; p++)
+    {
+        if (!((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') || *p == '-' || *p == '.'))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int
+pnt_set_parse_line(struct pnt_set_target *t, char *line)
+{
+    char *fields[5];
+    int n = 0;
+
+    for (char *f = strtok(line, " \t\r\n"); f != NULL && n < 5; f = strtok(NULL, " \t\r\n"))
+        fields[n++] = f;
+
+    memset(t, 0, sizeof(*t));
+    if (n < 2 || n == 3 || pnt_parse_mac(fields[0], t->mac) < 0)
+        return -1;
+
+    if (strcmp(fields[1], "-") != 0)
+    {
+        if (!pnt_set_valid_name(fields[1]))
+            return -1;
+        strcpy(t->name, fields[1]);
+        t->has_name = 1;
+    }
+
+    if (n >= 4)
+    {
+        if (inet_pton(AF_INET, fields[2], t->ip) != 1 || inet_pton(AF_INET, fields[3], t->ip + 4) != 1)
+            return -1;
+        if (n == 5 && inet_pton(AF_INET, fields[4], t->ip + 8) != 1)
+            return -1;
+        t->has_ip = 1;
+    }
+
+    return t->has_name || t->has_ip ? 0 : -1;
+}
+
+static int
+pnt_set_read_targets(struct pnt_set *set, const char *path)
+{
+    FILE *f;
+    char line[512];
+    int lineno = 0;
+    int ret = 0;
+
+    f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (f == NULL)
+    {
+        perror("Cannot open target file");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *first = line + strspn(line, " \t");
+
+        lineno++;
+        if (*first == '#' || *first == '\n' || *first == '\r' || *first == '\0')
+            continue;
+
+        if (set->count == set->cap)
+        {
+            int cap = set->cap ? set->cap * 2 : 64;
+            struct pnt_set_target *targets = realloc(set->targets, cap * sizeof(*targets));
+
+            if (targets == NULL)
+            {
+                perror("Cannot allocate target list");
+                ret = -1;
+                break;
+            }
+            set->targets = targets;
+            set->cap = cap;
+        }
+
+        if (pnt_set_parse_line(&set->targets[set->count], line) < 0)
+        {
+            fprintf(stderr, "%s:%d: expected <mac> <name|-> [<ip> <mask> [<gateway>]]\n", path, lineno);
+            ret = -1;
+            break;
+        }
+        set->count++;
+    }
+
+    if (f != stdin)
+        fclose(f);
+
+    return ret;
+}
+
+static const char *
+pnt_set_block_error(uint8_t error)
+{
+    switch (error)
+    {
+    case PN_DCP_BLOCK_ERROR_OPTION_UNSUPPORTED:
+        return "option_unsupported";
+    case PN_DCP_BLOCK_ERROR_SUBOPTION_UNSUPPORTED:
+        return "suboption_unsupported";
+    case PN_DCP_BLOCK_ERROR_SUBOPTION_NOT_SET:
+        return "suboption_not_set";
+    case PN_DCP_BLOCK_ERROR_RESOURCE:
+        return "resource_error";
+    case PN_DCP_BLOCK_ERROR_SET_NOT_POSSIBLE:
+        return "set_not_possible";
+    case PN_DCP_BLOCK_ERROR_IN_OPERATION:
+        return "in_operation";
+    default:
+        return "unknown_error";
+    }
+}
+
+static void
+pnt_set_finish(struct pnt_set *set, struct pnt_set_target *t, enum pnt_set_state state, const char *detail)
+{
+    static const char *names[] = {
+        [PNT_SET_OK] = "OK",
+        [PNT_SET_ERROR] = "ERROR",
+        [PNT_SET_TIMEDOUT] = "TIMEOUT",
+    };
+
+    if (t->state == PNT_SET_INFLIGHT)
+    {
+        pnt_xact_finish(&set->xacts, &t->xact);
+        set->inflight--;
+    }
+    t->state = state;
+    set->finished++;
+
+    printf("%02x:%02x:%02x:%02x:%02x:%02x\t%s\t%d%s%s\n",
+           t->mac[0], t->mac[1], t->mac[2], t->mac[3], t->mac[4], t->mac[5],
+           names[state], t->attempts, detail[0] ? "\t" : "", detail);
+}
+
+static void
+pnt_set_handle_frame(char *buf, ssize_t received, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_set *set = arg;
+    struct ether_header *eh = (struct ether_header *)buf;
+
+    struct pn_dcp_header *pn_dcp = pnt_get_dcp_header(buf, received, set->if_addr, PN_FRAME_ID_RTA_DCP_GETSET);
+    if (pn_dcp == NULL)
+        return;
+
+    /* The XID names the transaction, late answers to a retried request
+       match just as well */
+    struct pnt_xact *xact = pnt_xact_match(&set->xacts, pn_dcp, eh->ether_shost);
+    if (xact == NULL)
+        return;
+
+    struct pnt_set_target *t = xact->data;
+    pnt_stats_response(&xact->sent, &info->ts);
+
+    if (pn_dcp->h_service_type != PN_DCP_SERVICE_TYPE_RESPONSE_SUCCESS)
+    {
+        pnt_set_finish(set, t, PNT_SET_ERROR, "unsupported");
+        return;
+    }
+
+    /* One control response block per block of the request */
+    struct pnt_dcp_block_view views[PNT_DCP_MAX_BLOCKS];
+    char detail[256] = "";
+    size_t len = 0;
+    int name_answered = 0;
+    int ip_answered = 0;
+
+    int count = pnt_dcp_parse_blocks(pn_dcp, 0, views, PNT_DCP_MAX_BLOCKS);
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t *data = pnt_dcp_view_data(pn_dcp, &views[i]);
+
+        if (views[i].option != PN_DCP_BLOCK_OPTION_CONTROL ||
+            views[i].suboption != PN_DCP_BLOCK_SUBOPTION_CONTROL_RESPONSE || views[i].length < 3)
+            continue;
+
+        const char *block = "block";
+        if (data[0] == PN_DCP_BLOCK_OPTION_DEV_PROPS && data[1] == PN_DCP_BLOCK_SUBOPTION_DEV_PROPS_NAME)
+        {
+            block = "name";
+            name_answered = 1;
+        }
+        else if (data[0] == PN_DCP_BLOCK_OPTION_ADDR && data[1] == PN_DCP_BLOCK_SUBOPTION_ADDR_IP)
+        {
+            block = "ip";
+            ip_answered = 1;
+        }
+
+        if (data[2] != PN_DCP_BLOCK_ERROR_NONE && len < sizeof(detail))
+            len += snprintf(detail + len, sizeof(detail) - len, "%s%s:%s",
+                            len ? "," : "", block, pnt_set_block_error(data[2]));
+    }
+
+    /* a truncated or empty response does not confirm the blocks it lacks */
+    if ((t->has_name && !name_answered) || (t->has_ip && !ip_answered))
+        pnt_set_finish(set, t, PNT_SET_ERROR, "malformed_response");
+    else
+        pnt_set_finish(set, t, len ? PNT_SET_ERROR : PNT_SET_OK, detail);
+}
+
+/* Queue a retry of a request that got no response in time */
+static void
+pnt_set_expired(struct pnt_xact *xact, void *arg)
+{
+    struct pnt_set *set = arg;
+    struct pnt_set_target *t = xact->data;
+
+    if (t->attempts > set->retries)
+        pnt_set_finish(set, t, PNT_SET_TIMEDOUT, "");
+    else
+        set->due[set->ndue++] = t;
+}
+
+/* Send every request that is due in one sendmmsg(): retries of the expired
+   ones first, then new ones until the window is full */
+static int
+pnt_set_send_due(struct pnt_set *set)
+{
+    struct mmsghdr msgs[set->window];
+    struct iovec iovs[set->window];
+    struct sockaddr_ll addrs[set->window];
+    struct pnt_set_target *sent[set->window];
+    int n = 0;
+
+    /* at most window requests are in flight, so are the retries */
+    set->ndue = 0;
+    pnt_xact_expire(&set->xacts, pnt_set_expired, set);
+    for (int i = 0; i < set->ndue; i++)
+    {
+        pnt_xact_rearm(&set->xacts, &set->due[i]->xact, set->timeout);
+        sent[n++] = set->due[i];
+    }
+
+    while (set->inflight < set->window && set->next < set->count && n < set->window)
+    {
+        struct pnt_set_target *t = &set->targets[set->next++];
+
+        t->xact.data = t;
+        if (pnt_xact_start(&set->xacts, &t->xact, PN_DCP_SERVICE_ID_SET, t->mac, set->timeout) < 0)
+            return -1;
+
+        /* retries send the same bytes again, with the same XID */
+        t->frame_len = pnt_dcp_create_set_request(t->frame, set->if_addr, t->mac, t->xact.xid, set->qualifier,
+                                                  t->has_name ? t->name : NULL, t->has_ip ? t->ip : NULL);
+        t->state = PNT_SET_INFLIGHT;
+        set->inflight++;
+        sent[n++] = t;
+    }
+
+    if (n == 0)
+        return 0;
+
+    memset(msgs, 0, n * sizeof(msgs[0]));
+    for (int i = 0; i < n; i++)
+    {
+        struct pnt_set_target *t = sent[i];
+
+        memset(&addrs[i], 0, sizeof(addrs[i]));
+        addrs[i].sll_family = AF_PACKET;
+        addrs[i].sll_ifindex = set->if_index;
+        addrs[i].sll_halen = ETH_ALEN;
+        memcpy(addrs[i].sll_addr, t->mac, ETH_ALEN);
+
+        iovs[i].iov_base = t->frame;
+        iovs[i].iov_len = t->frame_len;
+
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+
+        t->attempts++;
+    }
+
+    for (int done = 0; done < n;)
+    {
+        int ret = sendmmsg(set->sock, msgs + done, n - done, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not send set request packets");
+            return -1;
+        }
+        done += ret;
+    }
+
+    pnt_debug("set: sent %d requests, %d in flight", n, set->inflight);
+    return n;
+}
+
+static int
+pnt_set_run(struct pnt_set *set)
+{
+    struct pollfd pfd = {.fd = set->sock, .events = POLLIN};
+
+    while (set->finished < set->count)
+    {
+        if (pnt_set_send_due(set) < 0)
+            return -1;
+
+        fflush(stdout);
+        if (set->finished == set->count)
+            break;
+
+        int ready = poll(&pfd, 1, pnt_xact_next_timeout(&set->xacts));
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not poll socket");
+            return -1;
+        }
+
+        if (ready > 0 && pnt_recv_dispatch(set->sock, set->buf, pnt_set_handle_frame, set) < 0)
+            return -1;
+    }
+
+    fflush(stdout);
+    return 0;
+}
+
+int pnt_set(int argc, char **argv)
+{
+    struct pnt_set set;
+    char *if_name = NULL;
+    char *frames = NULL;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    memset(&set, 0, sizeof(set));
+    set.sock = -1;
+    set.window = PNT_SET_WINDOW;
+    set.timeout = PNT_SET_TIMEOUT;
+    set.retries = PNT_SET_RETRIES;
+    set.qualifier = PN_DCP_BLOCK_QUALIFIER_PERMANENT;
+
+    while ((opt = getopt(argc, argv, "vdTi:f:w:t:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            pnt_set_verbose_level(PNT_VERBOSE_PRINT);
+            break;
+        case 'd':
+            pnt_set_verbose_level(PNT_VERBOSE_DEBUG);
+            break;
+        case 'T':
+            set.qualifier = PN_DCP_BLOCK_QUALIFIER_TEMPORARY;
+            break;
+        case 'i':
+            if_name = optarg;
+            break;
+        case 'f':
+            if (pnt_set_read_targets(&set, optarg) < 0)
+                goto out;
+            break;
+        case 'w':
+            set.window = atoi(optarg);
+            break;
+        case 't':
+            set.timeout = atoi(optarg);
+            break;
+        case 'r':
+            set.retries = atoi(optarg);
+            break;
+        default: /* '?' */
+            pnt_set_print_usage(argv[0]);
+            goto out;
+        }
+    }
+
+    pnt_print("Parameters: iface[%s] verbose_level[%d] targets[%d] window[%d] timeout[%d] retries[%d] permanent[%d]",
+              if_name, pnt_get_verbose_level(), set.count, set.window, set.timeout, set.retries, set.qualifier);
+
+    if (if_name == NULL || set.count == 0 || set.window < 1 || set.window > 1024 ||
+        set.timeout < 1 || set.retries < 0)
+    {
+        pnt_set_print_usage(argv[0]);
+        goto out;
+    }
+
+    set.sock = open_raw_sock(if_name, set.if_addr, &set.if_index, 0, 1, 1, 1, NULL);
+    if (set.sock < 0)
+    {
+        //error has already been printed
+        goto out;
+    }
+
+    /* Every transaction gets its own XID, all from this process' session */
+    if (pnt_attach_dcp_filter(set.sock, PN_FRAME_ID_RTA_DCP_GETSET, pnt_xid_alloc(), PNT_XID_SESSION_MASK) < 0)
+        pnt_print("%s: could not attach socket filter, all frames will be received", if_name);
+
+    if (pnt_xact_table_init(&set.xacts, set.window) < 0)
+        goto out;
+
+    frames = calloc(set.count, BUF_SIZE);
+    set.due = calloc(set.window, sizeof(*set.due));
+    if (frames == NULL || set.due == NULL)
+    {
+        perror("Cannot allocate request buffers");
+        goto out;
+    }
+
+    for (int i = 0; i < set.count; i++)
+        set.targets[i].frame = frames + (size_t)i * BUF_SIZE;
+
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pnt_set_run(&set) == 0)
+        ret = EXIT_SUCCESS;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int ok = 0;
+    for (int i = 0; i < set.count; i++)
+        ok += set.targets[i].state == PNT_SET_OK;
+
+    pnt_print("%d of %d devices set in %.0f ms", ok, set.count, TIME_DIFF_MS(start, end));
+    if (ok != set.count)
+        ret = EXIT_FAILURE;
+
+out:
+    free(frames);
+    free(set.due);
+    free(set.targets);
+    pnt_xact_table_free(&set.xacts);
+    if (set.sock >= 0)
+        close(set.sock);
+
+    return ret;
+}
@@ -0,0 +1,58 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+
+#define PNT_SET_WINDOW 32
+#define PNT_SET_TIMEOUT 1000
+#define PNT_SET_RETRIES 3
+
+#define TIME_DIFF_MS(s, e) ((e.tv_sec - s.tv_sec) * 1e3 + (e.tv_nsec - s.tv_nsec) / 1e6)
+
+enum pnt_set_state
+{
+    PNT_SET_PENDING,
+    PNT_SET_INFLIGHT,
+    PNT_SET_OK,
+    PNT_SET_ERROR,
+    PNT_SET_TIMEDOUT,
+};
+
+struct pnt_set_target
+{
+    uint8_t mac[ETH_ALEN];
+    char name[PN_DCP_NAME_OF_STATION_MAX + 1];
+    uint8_t ip[12]; //address, mask, gateway
+    int has_name;
+    int has_ip;
+    enum pnt_set_state state;
+    int attempts;
+    struct pnt_xact xact; //XID and response timeout of the request in flight
+    uint16_t frame_len;
+    char *frame;
+};
+
+struct pnt_set
+{
+    struct pnt_set_target *targets;
+    int count;
+    int cap;
+    int window;  //transactions in flight at once
+    int timeout; //per attempt
+    int retries;
+    int inflight;
+    int next;     //first target never sent
+    int finished;
+    struct pnt_xact_table xacts;
+    struct pnt_set_target **due; //timed out, to be sent again
+    int ndue;
+    uint16_t qualifier;
+    int sock;
+    int if_index;
+    uint8_t if_addr[ETH_ALEN];
+    char buf[BUF_SIZE];
+};
+
+int pnt_set(int argc, char **argv);
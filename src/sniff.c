@@ -0,0 +1,522 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "sniff.h"
+
+static volatile sig_atomic_t pnt_sniff_stop = 0;
+static volatile sig_atomic_t pnt_sniff_dump = 0;
+
+/* RT class 3, then RT class 1 and RT over UDP */
+static const struct pnt_frame_id_range pnt_sniff_frame_ids[] = {
+    {PN_FRAME_CLASS_00FF_RT_RESERVED_3 + 1, PN_FRAME_CLASS_0FFF_RTC3_REDUNDANT},
+    {PN_FRAME_CLASS_7FFF_RT_RESERVED_4 + 1, PN_FRAME_CLASS_FBFF_RT_RTC1_LEG_MULTI},
+};
+
+static void
+pnt_sniff_print_usage(const char *progname)
+{
+    fprintf(stderr, "pn-tools %s\n", PNT_VERSION);
+    fprintf(stderr, "usage: %s sniff -i <iface> [-h] [-v] [-d] [-o] [-s <report>] [-b <ring>] [-x <mode>]\n\n", progname);
+    fprintf(stderr, "Passively watch the cyclic real-time traffic on a network (e.g. a mirror port)\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "   -h          Show this help\n");
+    fprintf(stderr, "   -i iface    The interface to listen on, it is put in promiscuous mode while running\n");
+    fprintf(stderr, "   -s report   Amount of time (in ms) between two summaries (default=%d)\n", PNT_SNIFF_REPORT);
+    fprintf(stderr, "   -b ring     Size (in MiB) of the kernel receive ring (default=%d)\n", PNT_SNIFF_RING_MB);
+    fprintf(stderr, "   -x mode     Capture through AF_XDP, with a UMEM of -b MiB per RX queue. Mode is auto\n");
+    fprintf(stderr, "               (driver mode and zero-copy when supported, falls back to the ring), generic,\n");
+    fprintf(stderr, "               native or zerocopy%s\n",
+#ifdef PNT_AF_XDP
+            ""
+#else
+            " (not built in)"
+#endif
+    );
+    fprintf(stderr, "   -o          Print the header of the summary fields\n");
+    fprintf(stderr, "   -v          Be verbose\n");
+    fprintf(stderr, "   -d          Show debug information\n");
+    fprintf(stderr, "\nEvents are printed as they happen:\n");
+    fprintf(stderr, "   <time> <mac> <frame id> LOST <frames>       the cycle counter skipped frames\n");
+    fprintf(stderr, "   <time> <mac> <frame id> SILENT              no frame for %d cycles\n", PNT_SNIFF_SILENT_CYCLES);
+    fprintf(stderr, "   <time> <mac> <frame id> STATUS <old> <new>  DataStatus or TransferStatus changed\n");
+    fprintf(stderr, "The summary has one line per (source MAC, FrameID): <mac> <frame id> <frames> <frames/s>\n");
+    fprintf(stderr, "<cycle us> <jitter us> <min us> <max us> <lost> <repeated> <data status> <transfer status>.\n");
+    fprintf(stderr, "Times are inter-arrival times over the last period, jitter is their standard deviation,\n");
+    fprintf(stderr, "lost and repeated are totals.\n");
+}
+
+static void
+pnt_sniff_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        pnt_sniff_dump = 1;
+    else
+        pnt_sniff_stop = 1;
+}
+
+static inline unsigned int
+pnt_sniff_hash(const uint8_t *mac, uint16_t frame_id)
+{
+    /* the vendor half of the MAC is shared by many devices, mix the rest */
+    uint32_t h = ((uint32_t)mac[3] << 24 | mac[4] << 16 | mac[5] << 8 | mac[2]) ^ ((uint32_t)frame_id << 7);
+
+    return (h * 2654435761u) >> 8;
+}
+
+static int
+pnt_sniff_grow(struct pnt_sniff *sniff)
+{
+    unsigned int size = sniff->flows ? (sniff->mask + 1) * 2 : PNT_SNIFF_FLOWS;
+    struct pnt_sniff_flow *flows = calloc(size, sizeof(*flows));
+
+    if (flows == NULL)
+    {
+        perror("Cannot allocate flow table");
+        return -1;
+    }
+
+    for (unsigned int i = 0; sniff->flows != NULL && i <= sniff->mask; i++)
+    {
+        struct pnt_sniff_flow *flow = &sniff->flows[i];
+
+        if (!flow->used)
+            continue;
+
+        unsigned int j = pnt_sniff_hash(flow->mac, flow->frame_id) & (size - 1);
+        while (flows[j].used)
+            j = (j + 1) & (size - 1);
+        flows[j] = *flow;
+    }
+
+    free(sniff->flows);
+    sniff->flows = flows;
+    sniff->mask = size - 1;
+    return 0;
+}
+
+static struct pnt_sniff_flow *
+pnt_sniff_lookup(struct pnt_sniff *sniff, const uint8_t *mac, uint16_t frame_id)
+{
+    unsigned int i = pnt_sniff_hash(mac, frame_id) & sniff->mask;
+
+    for (;;)
+    {
+        struct pnt_sniff_flow *flow = &sniff->flows[i];
+
+        if (!flow->used)
+            break;
+        if (flow->frame_id == frame_id && memcmp(flow->mac, mac, ETH_ALEN) == 0)
+            return flow;
+        i = (i + 1) & sniff->mask;
+    }
+
+    /* new flow, keep the table at most half full */
+    if ((sniff->count + 1) * 2 > sniff->mask + 1)
+    {
+        if (pnt_sniff_grow(sniff) < 0)
+            return NULL;
+        return pnt_sniff_lookup(sniff, mac, frame_id);
+    }
+
+    struct pnt_sniff_flow *flow = &sniff->flows[i];
+
+    memcpy(flow->mac, mac, ETH_ALEN);
+    flow->frame_id = frame_id;
+    flow->used = 1;
+    sniff->count++;
+    pnt_debug("sniff: new flow %02x:%02x:%02x:%02x:%02x:%02x %04x",
+              mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], frame_id);
+    return flow;
+}
+
+static void
+pnt_sniff_event(const struct pnt_sniff_flow *flow, int64_t ns, const char *event)
+{
+    printf("%ld.%06ld\t%02x:%02x:%02x:%02x:%02x:%02x\t0x%04x\t%s",
+           (long)(ns / 1000000000), (long)(ns % 1000000000 / 1000),
+           flow->mac[0], flow->mac[1], flow->mac[2], flow->mac[3], flow->mac[4], flow->mac[5],
+           flow->frame_id, event);
+}
+
+static void
+pnt_sniff_period_reset(struct pnt_sniff_flow *flow)
+{
+    if (flow->samples > 0)
+        flow->ref_ns += flow->sum / flow->samples;
+    flow->period_frames = 0;
+    flow->samples = 0;
+    flow->gap_min_ns = INT64_MAX;
+    flow->gap_max_ns = 0;
+    flow->sum = 0;
+    flow->sumsq = 0;
+}
+
+/* Runs for every cyclic frame on the wire: no allocation and no output
+   unless something happened to the connection */
+static void
+pnt_sniff_handle_frame(char *buf, ssize_t len, const struct pnt_frame_info *info, void *arg)
+{
+    struct pnt_sniff *sniff = arg;
+    struct ether_header *eh = (struct ether_header *)buf;
+    size_t offset = sizeof(*eh);
+    uint16_t type;
+
+    if (len < (ssize_t)(offset + sizeof(struct vlan_hdr) + sizeof(struct pn_header) + sizeof(struct pn_footer)))
+    {
+        pnt_stats.frames_rejected[PNT_REJECT_LENGTH]++;
+        return;
+    }
+
+    type = ntohs(eh->ether_type);
+    if (type == ETH_P_8021Q)
+    {
+        type = ntohs(((struct vlan_hdr *)(buf + offset))->h_vlan_encapsulated_proto);
+        offset += sizeof(struct vlan_hdr);
+    }
+    if (type != ETH_P_PROFINET)
+    {
+        pnt_stats.frames_rejected[PNT_REJECT_ETHERTYPE]++;
+        return;
+    }
+
+    uint16_t frame_id = ntohs(((struct pn_header *)(buf + offset))->h_frame_id);
+    struct pn_footer *footer = (struct pn_footer *)(buf + len - sizeof(*footer));
+    struct pnt_sniff_flow *flow = pnt_sniff_lookup(sniff, eh->ether_shost, frame_id);
+    int64_t ns = (int64_t)info->ts.tv_sec * 1000000000 + info->ts.tv_nsec;
+    uint16_t cycle = ntohs(footer->f_cycle_counter);
+
+    if (flow == NULL)
+        return;
+
+    if (flow->frames == 0)
+    {
+        pnt_sniff_period_reset(flow);
+        flow->data_status = footer->f_data_status;
+        flow->transfer_status = footer->f_transfer_status;
+    }
+    else
+    {
+        int64_t gap = ns - flow->last_ns;
+        uint16_t delta = cycle - flow->cycle;
+
+        if (flow->ref_ns == 0)
+            flow->ref_ns = gap;
+        flow->sum += gap - flow->ref_ns;
+        flow->sumsq += (double)(gap - flow->ref_ns) * (gap - flow->ref_ns);
+        flow->samples++;
+        if (gap < flow->gap_min_ns)
+            flow->gap_min_ns = gap;
+        if (gap > flow->gap_max_ns)
+            flow->gap_max_ns = gap;
+
+        if (delta == 0)
+            flow->repeated++;
+        else if (flow->step == 0 || delta < flow->step)
+            flow->step = delta;
+        else if (delta >= 2 * flow->step)
+        {
+            flow->lost += delta / flow->step - 1;
+            pnt_sniff_event(flow, ns, "LOST");
+            printf("\t%u\n", delta / flow->step - 1);
+        }
+
+        if (footer->f_data_status != flow->data_status || footer->f_transfer_status != flow->transfer_status)
+        {
+            flow->changes++;
+            pnt_sniff_event(flow, ns, "STATUS");
+            printf("\t%02x/%02x\t%02x/%02x\n", flow->data_status, flow->transfer_status,
+                   footer->f_data_status, footer->f_transfer_status);
+            flow->data_status = footer->f_data_status;
+            flow->transfer_status = footer->f_transfer_status;
+        }
+    }
+
+    if (flow->silent)
+    {
+        flow->silent = 0;
+        pnt_debug("sniff: flow %04x is back after %.3f ms", frame_id, (ns - flow->last_ns) / 1e6);
+    }
+
+    flow->cycle = cycle;
+    flow->last_ns = ns;
+    flow->frames++;
+    flow->period_frames++;
+}
+
+/* A connection that stopped altogether has no cycle counter to tell, so
+   look for flows that missed a few cycles */
+static void
+pnt_sniff_check_silent(struct pnt_sniff *sniff)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    for (unsigned int i = 0; i <= sniff->mask; i++)
+    {
+        struct pnt_sniff_flow *flow = &sniff->flows[i];
+        int64_t limit;
+
+        if (!flow->used || flow->silent || flow->frames < 2)
+            continue;
+
+        limit = flow->step ? (int64_t)flow->step * PN_CYCLE_COUNTER_NS : flow->ref_ns;
+        limit *= PNT_SNIFF_SILENT_CYCLES;
+        if (limit < PNT_SNIFF_SILENT_MIN * 1000000LL)
+            limit = PNT_SNIFF_SILENT_MIN * 1000000LL;
+
+        if (now_ns - flow->last_ns > limit)
+        {
+            flow->silent = 1;
+            pnt_sniff_event(flow, now_ns, "SILENT");
+            printf("\n");
+        }
+    }
+}
+
+static void
+pnt_sniff_report(struct pnt_sniff *sniff, double period_s)
+{
+    struct tpacket_stats_v3 stats;
+
+    for (unsigned int i = 0; i <= sniff->mask; i++)
+    {
+        struct pnt_sniff_flow *flow = &sniff->flows[i];
+        double mean = 0, jitter = 0;
+
+        if (!flow->used)
+            continue;
+
+        if (flow->samples > 0)
+        {
+            double offset = flow->sum / flow->samples;
+            double var = flow->sumsq / flow->samples - offset * offset;
+
+            mean = flow->ref_ns + offset;
+            jitter = var > 0 ? sqrt(var) : 0;
+        }
+
+        printf("%02x:%02x:%02x:%02x:%02x:%02x\t0x%04x\t%u\t%.1f\t%.3f\t%.3f\t%.3f\t%.3f\t%lu\t%lu\t%02x\t%02x\n",
+               flow->mac[0], flow->mac[1], flow->mac[2], flow->mac[3], flow->mac[4], flow->mac[5],
+               flow->frame_id, flow->period_frames, flow->period_frames / period_s,
+               mean / 1e3, jitter / 1e3,
+               flow->samples ? flow->gap_min_ns / 1e3 : 0, flow->gap_max_ns / 1e3,
+               (unsigned long)flow->lost, (unsigned long)flow->repeated,
+               flow->data_status, flow->transfer_status);
+
+        pnt_sniff_period_reset(flow);
+    }
+    fflush(stdout);
+
+    if (pnt_ring_stats(sniff->sock, &stats) == 0 && stats.tp_drops > 0)
+        fprintf(stderr, "sniff: the kernel dropped %u of %u frames, the statistics above are incomplete\n",
+                stats.tp_drops, stats.tp_packets + stats.tp_drops);
+    if (sniff->xdp)
+    {
+        unsigned int drops = pnt_xsk_stats(&sniff->xsk);
+
+        if (drops > 0)
+            fprintf(stderr, "sniff: AF_XDP dropped %u frames, the statistics above are incomplete\n", drops);
+    }
+}
+
+static int
+pnt_sniff_run(struct pnt_sniff *sniff)
+{
+    struct pollfd pfds[1 + PNT_XSK_MAX_QUEUES];
+    int nfds = 1;
+    struct timespec next_report, last_report, next_check, now;
+
+    pfds[0].fd = sniff->sock;
+    pfds[0].events = POLLIN;
+    for (int i = 0; sniff->xdp && i < sniff->xsk.queue_count; i++, nfds++)
+    {
+        pfds[nfds].fd = sniff->xsk.queues[i].fd;
+        pfds[nfds].events = POLLIN;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &last_report);
+    pnt_deadline_set(&next_report, sniff->report);
+    pnt_deadline_set(&next_check, PNT_SNIFF_CHECK);
+
+    while (!pnt_sniff_stop)
+    {
+        int wait = pnt_deadline_remaining_ms(&next_report);
+
+        if (pnt_deadline_remaining_ms(&next_check) < wait)
+            wait = pnt_deadline_remaining_ms(&next_check);
+
+        int ready = poll(pfds, nfds, wait);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("Could not poll socket");
+            return -1;
+        }
+
+        for (int i = 1; ready > 0 && i < nfds; i++)
+        {
+            if (pfds[i].revents & POLLIN)
+                pnt_xsk_dispatch(&sniff->xsk.queues[i - 1], pnt_sniff_handle_frame, sniff);
+        }
+        if (ready > 0 && (pfds[0].revents & POLLIN))
+        {
+            if (sniff->ring.map != NULL)
+                pnt_ring_dispatch(&sniff->ring, pnt_sniff_handle_frame, sniff);
+            else if (pnt_recv_dispatch(sniff->sock, sniff->buf, pnt_sniff_handle_frame, sniff) < 0)
+                return -1;
+        }
+
+        if (pnt_deadline_remaining_ms(&next_check) == 0)
+        {
+            pnt_sniff_check_silent(sniff);
+            pnt_deadline_set(&next_check, PNT_SNIFF_CHECK);
+        }
+
+        if (pnt_sniff_dump || pnt_deadline_remaining_ms(&next_report) == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            pnt_sniff_report(sniff, (now.tv_sec - last_report.tv_sec) + (now.tv_nsec - last_report.tv_nsec) / 1e9);
+            last_report = now;
+            pnt_sniff_dump = 0;
+            pnt_deadline_set(&next_report, sniff->report);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pnt_sniff_report(sniff, (now.tv_sec - last_report.tv_sec) + (now.tv_nsec - last_report.tv_nsec) / 1e9);
+    return 0;
+}
+
+int pnt_sniff(int argc, char **argv)
+{
+    struct pnt_sniff *sniff;
+    char *if_name = NULL;
+    int ring_mb = PNT_SNIFF_RING_MB;
+    int do_headers = 0;
+    int xdp_mode = -1;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    sniff = calloc(1, sizeof(*sniff));
+    if (sniff == NULL)
+    {
+        perror("Cannot allocate sniffer state");
+        return EXIT_FAILURE;
+    }
+    sniff->sock = -1;
+    sniff->report = PNT_SNIFF_REPORT;
+
+    while ((opt = getopt(argc, argv, "vdoi:s:b:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            pnt_set_verbose_level(PNT_VERBOSE_PRINT);
+            break;
+        case 'd':
+            pnt_set_verbose_level(PNT_VERBOSE_DEBUG);
+            break;
+        case 'o':
+            do_headers = 1;
+            break;
+        case 'i':
+            if_name = optarg;
+            break;
+        case 's':
+            sniff->report = atoi(optarg);
+            break;
+        case 'b':
+            ring_mb = atoi(optarg);
+            break;
+        case 'x':
+            xdp_mode = pnt_xsk_parse_mode(optarg);
+            if (xdp_mode < 0)
+            {
+                pnt_sniff_print_usage(argv[0]);
+                goto out;
+            }
+            break;
+        default: /* '?' */
+            pnt_sniff_print_usage(argv[0]);
+            goto out;
+        }
+    }
+
+    pnt_print("Parameters: iface[%s] verbose_level[%d] report[%d] ring[%d MiB] xdp[%d]",
+              if_name, pnt_get_verbose_level(), sniff->report, ring_mb, xdp_mode);
+
+    if (if_name == NULL || sniff->report < 1 || ring_mb < 1 || ring_mb > 4096)
+    {
+        pnt_sniff_print_usage(argv[0]);
+        goto out;
+    }
+
+    if (pnt_sniff_grow(sniff) < 0)
+        goto out;
+
+    if (xdp_mode >= 0)
+    {
+        unsigned int if_index = if_nametoindex(if_name);
+
+        if (if_index > 0 && pnt_xsk_open(&sniff->xsk, if_name, if_index, xdp_mode, (size_t)ring_mb << 20) == 0)
+            sniff->xdp = 1;
+        else if (xdp_mode != PNT_XSK_AUTO)
+        {
+            perror("Cannot capture through AF_XDP");
+            goto out;
+        }
+        else
+            pnt_print("%s: AF_XDP is not available (%s), using the ring", if_name, strerror(errno));
+    }
+
+    sniff->ring.block_nr = (unsigned int)ring_mb * (1 << 20) / PNT_RING_BLOCK_SIZE;
+    sniff->sock = open_raw_sock(if_name, sniff->if_addr, &sniff->if_index, 0, 1, 1, 1, sniff->xdp ? NULL : &sniff->ring);
+    if (sniff->sock < 0)
+    {
+        //error has already been printed
+        goto out;
+    }
+    if (sniff->ring.map == NULL && !sniff->xdp)
+        fprintf(stderr, "sniff: no RX ring, frames will be dropped at high rates\n");
+
+    if (pnt_attach_frame_id_filter(sniff->sock, pnt_sniff_frame_ids, 2) < 0)
+        pnt_print("%s: could not attach socket filter, all frames will be received", if_name);
+    if (pnt_add_promisc_membership(sniff->sock, sniff->if_index) < 0)
+        perror("Cannot set promiscuous mode, only frames to this host will be seen");
+
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = pnt_sniff_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+
+    if (do_headers)
+        printf("mac\tframe_id\tframes\tframes_s\tcycle_us\tjitter_us\tmin_us\tmax_us\tlost\trepeated\tdata_status\ttransfer_status\n");
+
+    if (pnt_sniff_run(sniff) == 0)
+        ret = EXIT_SUCCESS;
+
+    if (pnt_stats.kernel_drops > 0)
+        fprintf(stderr, "sniff: the kernel dropped %lu frames in total\n", (unsigned long)pnt_stats.kernel_drops);
+    pnt_print("%u flows, %lu frames received", sniff->count, (unsigned long)pnt_stats.frames_received);
+
+out:
+    if (sniff->xdp)
+        pnt_xsk_close(&sniff->xsk);
+    if (sniff->sock >= 0)
+    {
+        pnt_ring_close(&sniff->ring);
+        close(sniff->sock);
+    }
+    free(sniff->flows);
+    free(sniff);
+
+    return ret;
+}
@@ -0,0 +1,61 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "common.h"
+#include "xsk.h"
+
+#include <signal.h>
+#include <math.h>
+
+#define PNT_SNIFF_REPORT 1000
+#define PNT_SNIFF_RING_MB 16
+#define PNT_SNIFF_FLOWS 256       //initial table size, a power of two
+#define PNT_SNIFF_CHECK 10        //ms between two looks for flows that went silent
+#define PNT_SNIFF_SILENT_CYCLES 3 //cycles without a frame before a flow is silent
+#define PNT_SNIFF_SILENT_MIN 20   //ms, above the time a ring block may be held back
+
+/* One cyclic connection as seen on the wire: a provider MAC and a FrameID */
+struct pnt_sniff_flow
+{
+    uint8_t mac[ETH_ALEN];
+    uint16_t frame_id;
+    uint8_t used;
+    uint8_t silent;
+    uint8_t data_status;
+    uint8_t transfer_status;
+    uint16_t cycle; //last cycle counter
+    uint16_t step;  //cycle counter increment per frame, the smallest seen
+    uint64_t frames;
+    uint64_t lost;     //frames missing according to the cycle counter
+    uint64_t repeated; //frames with the same cycle counter as the one before
+    uint64_t changes;  //DataStatus and TransferStatus changes
+    int64_t last_ns;
+    /* inter-arrival times of the current report period, summed as offsets
+       from ref_ns so the sums stay small enough for a double */
+    uint32_t period_frames;
+    uint32_t samples;
+    int64_t ref_ns;
+    int64_t gap_min_ns;
+    int64_t gap_max_ns;
+    double sum;
+    double sumsq;
+};
+
+struct pnt_sniff
+{
+    struct pnt_sniff_flow *flows;
+    unsigned int mask; //table size - 1
+    unsigned int count;
+    int report;
+    int sock;
+    int if_index;
+    uint8_t if_addr[ETH_ALEN];
+    struct pnt_ring ring;
+    int xdp; //frames come from the AF_XDP sockets, the AF_PACKET one gets what they miss
+    struct pnt_xsk xsk;
+    char buf[BUF_SIZE];
+};
+
+int pnt_sniff(int argc, char **argv);
@@ -0,0 +1,120 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "stats.h"
+#include "common.h"
+
+#include <inttypes.h>
+#include <limits.h>
+
+struct pnt_stats pnt_stats;
+
+static const uint64_t pnt_stats_bounds_us[PNT_STATS_BUCKETS] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000};
+
+static const char *pnt_stats_reasons[PNT_REJECT_MAX] = {
+    [PNT_REJECT_LENGTH] = "length",
+    [PNT_REJECT_ADDRESS] = "address",
+    [PNT_REJECT_ETHERTYPE] = "ethertype",
+    [PNT_REJECT_VLAN] = "vlan",
+    [PNT_REJECT_FRAME_ID] = "frame_id",
+};
+
+/* Account a response received at received (CLOCK_REALTIME, as the kernel
+   stamps frames) to a request sent at sent */
+void pnt_stats_response(const struct timespec *sent, const struct timespec *received)
+{
+    int64_t us = (received->tv_sec - sent->tv_sec) * 1000000LL + (received->tv_nsec - sent->tv_nsec) / 1000;
+    int i = 0;
+
+    if (us < 0)
+        us = 0;
+
+    while (i < PNT_STATS_BUCKETS && (uint64_t)us > pnt_stats_bounds_us[i])
+        i++;
+
+    pnt_stats.responses[i]++;
+    pnt_stats.response_count++;
+    pnt_stats.response_sum_us += us;
+}
+
+static void pnt_stats_counter(FILE *f, const char *name, const char *help, uint64_t value)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n", name, help, name, name, value);
+}
+
+/* Prometheus text exposition format */
+void pnt_stats_write(FILE *f)
+{
+    pnt_stats_counter(f, "pntools_frames_received_total", "Frames read from the packet sockets.",
+                      pnt_stats.frames_received);
+
+    fprintf(f, "# HELP pntools_frames_rejected_total Frames that are no DCP PDU for this host, by reason.\n"
+               "# TYPE pntools_frames_rejected_total counter\n");
+    for (int i = 0; i < PNT_REJECT_MAX; i++)
+        fprintf(f, "pntools_frames_rejected_total{reason=\"%s\"} %" PRIu64 "\n",
+                pnt_stats_reasons[i], pnt_stats.frames_rejected[i]);
+
+    pnt_stats_counter(f, "pntools_kernel_packets_total", "Frames the kernel passed the socket filter.",
+                      pnt_stats.kernel_packets);
+    pnt_stats_counter(f, "pntools_kernel_drops_total", "Frames the kernel dropped for lack of buffer space.",
+                      pnt_stats.kernel_drops);
+    pnt_stats_counter(f, "pntools_kernel_freezes_total", "Times the RX ring was full.",
+                      pnt_stats.kernel_freezes);
+    pnt_stats_counter(f, "pntools_parse_errors_total", "DCP PDUs whose blocks run past their data.",
+                      pnt_stats.parse_errors);
+
+    fprintf(f, "# HELP pntools_response_seconds Time from a request to each of its responses.\n"
+               "# TYPE pntools_response_seconds histogram\n");
+
+    uint64_t cumulative = 0;
+    for (int i = 0; i < PNT_STATS_BUCKETS; i++)
+    {
+        cumulative += pnt_stats.responses[i];
+        fprintf(f, "pntools_response_seconds_bucket{le=\"%g\"} %" PRIu64 "\n",
+                pnt_stats_bounds_us[i] / 1e6, cumulative);
+    }
+    cumulative += pnt_stats.responses[PNT_STATS_BUCKETS];
+    fprintf(f, "pntools_response_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", cumulative);
+    fprintf(f, "pntools_response_seconds_sum %.6f\n", pnt_stats.response_sum_us / 1e6);
+    fprintf(f, "pntools_response_seconds_count %" PRIu64 "\n", pnt_stats.response_count);
+}
+
+/* Write the counters to path, or to stderr when it is NULL. The file is
+   replaced in one rename(), so collectors never read half of it. */
+int pnt_stats_dump(const char *path)
+{
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    if (path == NULL)
+    {
+        pnt_stats_write(stderr);
+        return 0;
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        perror("Cannot open statistics file");
+        return -1;
+    }
+
+    pnt_stats_write(f);
+    if (fclose(f) != 0 || rename(tmp, path) < 0)
+    {
+        perror("Cannot write statistics file");
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
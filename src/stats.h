@@ -0,0 +1,48 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#ifndef __PNT_STATS__
+#define __PNT_STATS__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Why pnt_get_dcp_header() turned a frame away */
+enum pnt_reject
+{
+    PNT_REJECT_LENGTH,
+    PNT_REJECT_ADDRESS,
+    PNT_REJECT_ETHERTYPE,
+    PNT_REJECT_VLAN,
+    PNT_REJECT_FRAME_ID,
+    PNT_REJECT_MAX,
+};
+
+/* Response time histogram, bucket upper bounds from 1 ms to 10 s */
+#define PNT_STATS_BUCKETS 13
+
+/* Counters along the receive path of the whole process. They are plain
+   increments, cheap enough to stay on under load. */
+struct pnt_stats
+{
+    uint64_t frames_received;
+    uint64_t frames_rejected[PNT_REJECT_MAX];
+    uint64_t kernel_packets; //PACKET_STATISTICS, summed over every read
+    uint64_t kernel_drops;
+    uint64_t kernel_freezes;
+    uint64_t parse_errors;
+    uint64_t responses[PNT_STATS_BUCKETS + 1]; //the last one is +Inf
+    uint64_t response_count;
+    uint64_t response_sum_us;
+};
+
+extern struct pnt_stats pnt_stats;
+
+void pnt_stats_response(const struct timespec *sent, const struct timespec *received);
+void pnt_stats_write(FILE *f);
+int pnt_stats_dump(const char *path);
+
+#endif
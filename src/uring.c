@@ -0,0 +1,415 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "uring.h"
+
+#ifdef PNT_IO_URING
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define PNT_URING_BGID 0
+#define PNT_URING_SEND ((uint64_t)1 << 32) //user_data of sends, receives carry their socket slot
+
+static int pnt_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int pnt_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int pnt_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static struct io_uring_buf_ring *pnt_uring_buf_ring(struct pnt_uring *ur)
+{
+    return ur->buf_ring;
+}
+
+/* Hand buffer bid back to the kernel, visible after pnt_uring_publish_bufs() */
+static void pnt_uring_recycle(struct pnt_uring *ur, uint16_t bid)
+{
+    struct io_uring_buf *buf = &pnt_uring_buf_ring(ur)->bufs[ur->buf_tail & (PNT_URING_BUF_COUNT - 1)];
+
+    /* the resv field of the first entry is the ring tail, leave it alone */
+    buf->addr = (uintptr_t)(ur->bufs + (size_t)bid * PNT_URING_BUF_SIZE);
+    buf->len = PNT_URING_BUF_SIZE;
+    buf->bid = bid;
+    ur->buf_tail++;
+}
+
+static void pnt_uring_publish_bufs(struct pnt_uring *ur)
+{
+    __atomic_store_n(&pnt_uring_buf_ring(ur)->tail, ur->buf_tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *pnt_uring_get_sqe(struct pnt_uring *ur)
+{
+    unsigned int tail = *ur->sq_tail;
+
+    if (tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries)
+    {
+        /* full, make room by handing what is queued to the kernel */
+        if (pnt_uring_submit(ur) < 0 || tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries)
+            return NULL;
+    }
+
+    unsigned int idx = tail & *ur->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)ur->sqes + idx;
+
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void pnt_uring_queue(struct pnt_uring *ur)
+{
+    __atomic_store_n(ur->sq_tail, *ur->sq_tail + 1, __ATOMIC_RELEASE);
+    ur->queued++;
+}
+
+static int pnt_uring_arm(struct pnt_uring *ur, int slot)
+{
+    struct pnt_uring_sock *us = &ur->socks[slot];
+    struct io_uring_sqe *sqe = pnt_uring_get_sqe(ur);
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = us->sock;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = PNT_URING_BGID;
+    sqe->ioprio = us->multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = slot;
+    pnt_uring_queue(ur);
+    us->armed = 1;
+
+    return 0;
+}
+
+int pnt_uring_init(struct pnt_uring *ur)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(ur, 0, sizeof(*ur));
+    memset(&p, 0, sizeof(p));
+    /* room for a completion per receive buffer and the sends on top */
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = PNT_URING_BUF_COUNT * 2;
+
+    ur->fd = pnt_uring_setup(PNT_URING_ENTRIES, &p);
+    if (ur->fd < 0)
+    {
+        pnt_debug("pnt_uring_init: io_uring_setup: %s", strerror(errno));
+        return -1;
+    }
+    ur->sq_entries = p.sq_entries;
+
+    ur->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ur->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ur->cq_map_len > ur->sq_map_len)
+            ur->sq_map_len = ur->cq_map_len;
+        ur->cq_map_len = 0;
+    }
+
+    ur->sq_map = mmap(NULL, ur->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_map == MAP_FAILED)
+    {
+        ur->sq_map = NULL;
+        goto fail;
+    }
+    if (ur->cq_map_len > 0)
+    {
+        ur->cq_map = mmap(NULL, ur->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+        if (ur->cq_map == MAP_FAILED)
+        {
+            ur->cq_map = NULL;
+            goto fail;
+        }
+    }
+    else
+    {
+        ur->cq_map = ur->sq_map;
+    }
+
+    ur->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED)
+    {
+        ur->sqes = NULL;
+        goto fail;
+    }
+
+    ur->sq_head = (unsigned int *)((char *)ur->sq_map + p.sq_off.head);
+    ur->sq_tail = (unsigned int *)((char *)ur->sq_map + p.sq_off.tail);
+    ur->sq_flags = (unsigned int *)((char *)ur->sq_map + p.sq_off.flags);
+    ur->sq_mask = (unsigned int *)((char *)ur->sq_map + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned int *)((char *)ur->sq_map + p.sq_off.array);
+    ur->cq_head = (unsigned int *)((char *)ur->cq_map + p.cq_off.head);
+    ur->cq_tail = (unsigned int *)((char *)ur->cq_map + p.cq_off.tail);
+    ur->cq_mask = (unsigned int *)((char *)ur->cq_map + p.cq_off.ring_mask);
+    ur->cqes = (char *)ur->cq_map + p.cq_off.cqes;
+
+    /* Receive buffers: the kernel picks one per frame from the ring */
+    ur->buf_ring_len = PNT_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ur->buf_ring = mmap(NULL, ur->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ur->bufs = malloc((size_t)PNT_URING_BUF_COUNT * PNT_URING_BUF_SIZE);
+    if (ur->buf_ring == MAP_FAILED || ur->bufs == NULL)
+    {
+        if (ur->buf_ring == MAP_FAILED)
+            ur->buf_ring = NULL;
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ur->buf_ring;
+    reg.ring_entries = PNT_URING_BUF_COUNT;
+    reg.bgid = PNT_URING_BGID;
+    if (pnt_uring_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        pnt_debug("pnt_uring_init: IORING_REGISTER_PBUF_RING: %s", strerror(errno));
+        goto fail;
+    }
+
+    for (unsigned int i = 0; i < PNT_URING_BUF_COUNT; i++)
+        pnt_uring_recycle(ur, i);
+    pnt_uring_publish_bufs(ur);
+
+    pnt_debug("pnt_uring_init: %u entries, %u buffers of %u bytes", ur->sq_entries, PNT_URING_BUF_COUNT, PNT_URING_BUF_SIZE);
+    return 0;
+
+fail:
+    err = errno;
+    pnt_uring_close(ur);
+    errno = err;
+    return -1;
+}
+
+void pnt_uring_close(struct pnt_uring *ur)
+{
+    if (ur->fd >= 0)
+        pnt_debug("pnt_uring_close: send errors[%u] no buffers[%u] overflows[%u]",
+                  ur->send_errors, ur->no_buffers, ur->overflows);
+
+    if (ur->sqes != NULL)
+        munmap(ur->sqes, ur->sqes_len);
+    if (ur->cq_map != NULL && ur->cq_map != ur->sq_map)
+        munmap(ur->cq_map, ur->cq_map_len);
+    if (ur->sq_map != NULL)
+        munmap(ur->sq_map, ur->sq_map_len);
+    if (ur->fd >= 0)
+        close(ur->fd);
+    /* the registration goes away with the ring */
+    if (ur->buf_ring != NULL)
+        munmap(ur->buf_ring, ur->buf_ring_len);
+    free(ur->bufs);
+
+    memset(ur, 0, sizeof(*ur));
+    ur->fd = -1;
+}
+
+/* Keep receiving from sock, every frame goes to handler from pnt_uring_dispatch() */
+int pnt_uring_add_recv(struct pnt_uring *ur, int sock, pnt_frame_handler handler, void *arg)
+{
+    if (ur->sock_count == PNT_URING_MAX_SOCKS)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    struct pnt_uring_sock *us = &ur->socks[ur->sock_count];
+
+    us->sock = sock;
+    us->multishot = 1;
+    us->handler = handler;
+    us->arg = arg;
+
+    return pnt_uring_arm(ur, ur->sock_count++);
+}
+
+/* Queue a frame on a bound socket, buf must stay untouched until the send
+   completed, which is usually within the next pnt_uring_submit() */
+int pnt_uring_send(struct pnt_uring *ur, int sock, const void *buf, size_t len)
+{
+    struct io_uring_sqe *sqe = pnt_uring_get_sqe(ur);
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = PNT_URING_SEND;
+    pnt_uring_queue(ur);
+
+    return 0;
+}
+
+/* One syscall for everything queued since the last one */
+int pnt_uring_submit(struct pnt_uring *ur)
+{
+    while (ur->queued > 0)
+    {
+        int ret = pnt_uring_enter(ur->fd, ur->queued, 0, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not submit to io_uring");
+            return -1;
+        }
+        ur->queued -= ret;
+    }
+
+    return 0;
+}
+
+/* Run the handlers of every completed receive, then re-arm and submit */
+int pnt_uring_dispatch(struct pnt_uring *ur)
+{
+    struct pnt_frame_info info;
+    unsigned int head = *ur->cq_head;
+    unsigned int tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    int frames = 0;
+
+    /* completions that did not fit are held by the kernel, which keeps the
+       fd readable until they are flushed into the ring */
+    if (__atomic_load_n(ur->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)
+    {
+        ur->overflows++;
+        pnt_uring_enter(ur->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &info.ts);
+    info.vlan_tci = -1; //a plain recv has no PACKET_AUXDATA
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = (struct io_uring_cqe *)ur->cqes + (head & *ur->cq_mask);
+
+        if (cqe->user_data == PNT_URING_SEND)
+        {
+            if (cqe->res < 0)
+            {
+                ur->send_errors++;
+                pnt_debug("pnt_uring_dispatch: send: %s", strerror(-cqe->res));
+            }
+            continue;
+        }
+
+        struct pnt_uring_sock *us = &ur->socks[cqe->user_data];
+
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (cqe->res > 0)
+            {
+                pnt_stats.frames_received++;
+                us->handler(ur->bufs + (size_t)bid * PNT_URING_BUF_SIZE, cqe->res, &info, us->arg);
+                frames++;
+            }
+            pnt_uring_recycle(ur, bid);
+        }
+
+        if (cqe->flags & IORING_CQE_F_MORE)
+            continue;
+
+        /* the recv is over: single shot, out of buffers or refused */
+        us->armed = 0;
+        if (cqe->res == -EINVAL && us->multishot)
+        {
+            pnt_debug("pnt_uring_dispatch: no multishot recv, posting one recv per frame");
+            us->multishot = 0;
+        }
+        else if (cqe->res == -ENOBUFS)
+        {
+            ur->no_buffers++;
+        }
+        else if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR)
+        {
+            fprintf(stderr, "io_uring recv: %s\n", strerror(-cqe->res));
+            us->handler = NULL; //not re-armed
+            continue;
+        }
+    }
+
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    pnt_uring_publish_bufs(ur);
+
+    for (int i = 0; i < ur->sock_count; i++)
+    {
+        if (!ur->socks[i].armed && ur->socks[i].handler != NULL && pnt_uring_arm(ur, i) < 0)
+            return -1;
+    }
+
+    if (pnt_uring_submit(ur) < 0)
+        return -1;
+
+    return frames;
+}
+
+#else /* !PNT_IO_URING */
+
+int pnt_uring_init(struct pnt_uring *ur)
+{
+    memset(ur, 0, sizeof(*ur));
+    ur->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+void pnt_uring_close(struct pnt_uring *ur)
+{
+    (void)ur;
+}
+
+int pnt_uring_add_recv(struct pnt_uring *ur, int sock, pnt_frame_handler handler, void *arg)
+{
+    (void)ur, (void)sock, (void)handler, (void)arg;
+    errno = ENOSYS;
+    return -1;
+}
+
+int pnt_uring_send(struct pnt_uring *ur, int sock, const void *buf, size_t len)
+{
+    (void)ur, (void)sock, (void)buf, (void)len;
+    errno = ENOSYS;
+    return -1;
+}
+
+int pnt_uring_submit(struct pnt_uring *ur)
+{
+    (void)ur;
+    errno = ENOSYS;
+    return -1;
+}
+
+int pnt_uring_dispatch(struct pnt_uring *ur)
+{
+    (void)ur;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+int pnt_uring_fd(const struct pnt_uring *ur)
+{
+    return ur->fd;
+}
@@ -0,0 +1,73 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#ifndef __PNT_URING__
+#define __PNT_URING__
+
+#include "common.h"
+
+/*
+ * io_uring backend for raw sockets, on raw syscalls so there is nothing to
+ * link. Sends are queued and go out with the next pnt_uring_submit(),
+ * receives are multishot recvs into a registered buffer ring that are
+ * re-armed as needed. Built only with PNT_IO_URING (see the Makefile),
+ * without it or on kernels without buffer rings pnt_uring_init() fails and
+ * callers keep their poll()/recvfrom() path.
+ */
+
+#define PNT_URING_ENTRIES 64
+#define PNT_URING_BUF_COUNT 256 //a power of two
+#define PNT_URING_BUF_SIZE 2048
+#define PNT_URING_MAX_SOCKS 32
+
+struct pnt_uring_sock
+{
+    int sock;
+    int multishot; //cleared when the kernel refuses multishot recv
+    int armed;
+    pnt_frame_handler handler;
+    void *arg;
+};
+
+struct pnt_uring
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_flags;
+    unsigned int *sq_array;
+    void *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_len;
+    size_t cq_map_len;
+    size_t sqes_len;
+    void *buf_ring; //struct io_uring_buf_ring
+    size_t buf_ring_len;
+    char *bufs;
+    uint16_t buf_tail;
+    unsigned int queued; //SQEs not submitted yet
+    unsigned int send_errors;
+    unsigned int no_buffers; //receives that found the buffer ring empty
+    unsigned int overflows; //times completions had to be flushed from the kernel
+    struct pnt_uring_sock socks[PNT_URING_MAX_SOCKS];
+    int sock_count;
+};
+
+int pnt_uring_init(struct pnt_uring *ur);
+void pnt_uring_close(struct pnt_uring *ur);
+int pnt_uring_fd(const struct pnt_uring *ur);
+int pnt_uring_add_recv(struct pnt_uring *ur, int sock, pnt_frame_handler handler, void *arg);
+int pnt_uring_send(struct pnt_uring *ur, int sock, const void *buf, size_t len);
+int pnt_uring_submit(struct pnt_uring *ur);
+int pnt_uring_dispatch(struct pnt_uring *ur);
+
+#endif
@@ -0,0 +1,528 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#include "xsk.h"
+
+static const char *pnt_xsk_modes[] = {
+    [PNT_XSK_AUTO] = "auto",
+    [PNT_XSK_GENERIC] = "generic",
+    [PNT_XSK_NATIVE] = "native",
+    [PNT_XSK_ZEROCOPY] = "zerocopy",
+};
+
+int pnt_xsk_parse_mode(const char *mode)
+{
+    for (unsigned int i = 0; i < sizeof(pnt_xsk_modes) / sizeof(pnt_xsk_modes[0]); i++)
+    {
+        if (strcmp(mode, pnt_xsk_modes[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+#ifdef PNT_AF_XDP
+
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* bytes the XDP program puts in front of a frame: its CLOCK_MONOTONIC
+   receive time, from bpf_ktime_get_ns() */
+#define PNT_XSK_META_LEN 8
+
+static int pnt_xsk_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+pnt_xsk_create_map(void)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = PNT_XSK_MAX_QUEUES;
+    strncpy(attr.map_name, "pnt_xsks", sizeof(attr.map_name) - 1);
+
+    return pnt_xsk_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+ * r6 = ctx
+ * if the frame is shorter than a VLAN tagged header: pass
+ * if the ethertype, or the one behind a VLAN tag, is not PROFINET: pass
+ * prepend the receive time when the driver has room for metadata
+ * redirect to the socket of the RX queue, pass if there is none
+ */
+static int
+pnt_xsk_load_prog(int map_fd)
+{
+    struct bpf_insn code[32];
+    unsigned int n = 0;
+    union bpf_attr attr;
+    char log[4096];
+    int fd;
+
+#define _INSN(c, d, s, o, i) code[n++] = (struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)}
+
+    _INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    _INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0);
+    _INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0);
+    _INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    _INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, sizeof(struct ether_header) + sizeof(struct vlan_hdr));
+    _INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 22, 0); //pass
+    /* loaded in network order, so compared with network order constants */
+    _INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, offsetof(struct ether_header, ether_type), 0);
+    _INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 3, htons(ETH_P_PROFINET)); //match
+    _INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 19, htons(ETH_P_8021Q));   //pass
+    _INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2,
+          sizeof(struct ether_header) + offsetof(struct vlan_hdr, h_vlan_encapsulated_proto), 0);
+    _INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 17, htons(ETH_P_PROFINET)); //pass
+
+    /* match: */
+    _INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+    _INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, -PNT_XSK_META_LEN);
+    _INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_xdp_adjust_meta);
+    _INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 7, 0); //redirect
+    _INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns);
+    _INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data_meta), 0);
+    _INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data), 0);
+    _INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    _INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, PNT_XSK_META_LEN);
+    _INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 1, 0); //redirect
+    _INSN(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_2, BPF_REG_0, 0, 0);
+
+    /* redirect: */
+    _INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0);
+    _INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    _INSN(0, 0, 0, 0, 0);
+    _INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS); //returned when the queue has no socket
+    _INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    _INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    /* pass: */
+    _INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    _INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+#undef _INSN
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t)code;
+    attr.insn_cnt = n;
+    attr.license = (uintptr_t) "GPL";
+    strncpy(attr.prog_name, "pnt_xsk", sizeof(attr.prog_name) - 1);
+
+    fd = pnt_xsk_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && pnt_get_verbose_level() >= PNT_VERBOSE_DEBUG)
+    {
+        int err = errno;
+
+        /* again, for the verifier's reasons */
+        log[0] = '\0';
+        attr.log_buf = (uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        pnt_xsk_bpf(BPF_PROG_LOAD, &attr);
+        pnt_debug("pnt_xsk_load_prog: %s\n%s", strerror(err), log);
+        errno = err;
+    }
+
+    return fd;
+}
+
+static int
+pnt_xsk_attach(int prog_fd, int if_index, unsigned int flags)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = if_index;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = flags;
+
+    return pnt_xsk_bpf(BPF_LINK_CREATE, &attr);
+}
+
+static int
+pnt_xsk_map_update(int map_fd, uint32_t key, uint32_t value)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    attr.flags = BPF_ANY;
+
+    return pnt_xsk_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+/* The RX queues the NIC spreads frames over, 1 when it cannot tell */
+static int
+pnt_xsk_queue_count(const char *if_name)
+{
+    struct ethtool_channels channels;
+    struct ifreq ifr;
+    int count = 1;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return 1;
+
+    memset(&channels, 0, sizeof(channels));
+    channels.cmd = ETHTOOL_GCHANNELS;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+    ifr.ifr_data = (void *)&channels;
+    if (ioctl(sock, SIOCETHTOOL, &ifr) == 0)
+    {
+        count = channels.rx_count + channels.combined_count;
+        if (count < 1)
+            count = 1;
+    }
+    close(sock);
+
+    if (count > PNT_XSK_MAX_QUEUES)
+    {
+        pnt_print("%s: %d RX queues, only the first %d are captured through AF_XDP", if_name, count, PNT_XSK_MAX_QUEUES);
+        count = PNT_XSK_MAX_QUEUES;
+    }
+    return count;
+}
+
+static void
+pnt_xsk_queue_close(struct pnt_xsk_queue *q)
+{
+    if (q->rx_map != NULL)
+        munmap(q->rx_map, q->rx_map_len);
+    if (q->fill_map != NULL)
+        munmap(q->fill_map, q->fill_map_len);
+    if (q->fd >= 0)
+        close(q->fd);
+    if (q->umem != NULL)
+        munmap(q->umem, q->umem_len);
+
+    memset(q, 0, sizeof(*q));
+    q->fd = -1;
+}
+
+static int
+pnt_xsk_queue_open(struct pnt_xsk_queue *q, int if_index, unsigned int queue, unsigned int size, int zerocopy)
+{
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr;
+    socklen_t optlen = sizeof(off);
+    unsigned int comp_size = 64; //nothing is sent, but binding needs a completion ring
+    char *map;
+    int err;
+
+    memset(q, 0, sizeof(*q));
+    q->queue = queue;
+    q->size = size;
+
+    q->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (q->fd < 0)
+        return -1;
+
+    q->umem_len = (size_t)size * PNT_XSK_FRAME_SIZE;
+    q->umem = mmap(NULL, q->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (q->umem == MAP_FAILED)
+    {
+        q->umem = NULL;
+        goto fail;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t)q->umem;
+    reg.len = q->umem_len;
+    reg.chunk_size = PNT_XSK_FRAME_SIZE;
+    if (setsockopt(q->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(q->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(q->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &comp_size, sizeof(comp_size)) < 0 ||
+        setsockopt(q->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        getsockopt(q->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+        goto fail;
+
+    q->rx_map_len = off.rx.desc + size * sizeof(struct xdp_desc);
+    map = mmap(NULL, q->rx_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, XDP_PGOFF_RX_RING);
+    if (map == MAP_FAILED)
+        goto fail;
+    q->rx_map = map;
+    q->rx_producer = (unsigned int *)(map + off.rx.producer);
+    q->rx_consumer = (unsigned int *)(map + off.rx.consumer);
+    q->rx_descs = map + off.rx.desc;
+
+    q->fill_map_len = off.fr.desc + size * sizeof(uint64_t);
+    map = mmap(NULL, q->fill_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, XDP_UMEM_PGOFF_FILL_RING);
+    if (map == MAP_FAILED)
+        goto fail;
+    q->fill_map = map;
+    q->fill_producer = (unsigned int *)(map + off.fr.producer);
+    q->fill_flags = (unsigned int *)(map + off.fr.flags);
+    q->fill_addrs = (uint64_t *)(map + off.fr.desc);
+
+    /* the whole UMEM is the kernel's to fill */
+    for (unsigned int i = 0; i < size; i++)
+        q->fill_addrs[i] = (uint64_t)i * PNT_XSK_FRAME_SIZE;
+    __atomic_store_n(q->fill_producer, size, __ATOMIC_RELEASE);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = if_index;
+    addr.sxdp_queue_id = queue;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP | (zerocopy ? XDP_ZEROCOPY : XDP_COPY);
+    if (bind(q->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    err = errno;
+    pnt_xsk_queue_close(q);
+    errno = err;
+    return -1;
+}
+
+void pnt_xsk_close(struct pnt_xsk *xsk)
+{
+    /* the link detaches the program, the map goes with its last user */
+    if (xsk->link_fd >= 0)
+        close(xsk->link_fd);
+    for (int i = 0; i < xsk->queue_count; i++)
+        pnt_xsk_queue_close(&xsk->queues[i]);
+    if (xsk->prog_fd >= 0)
+        close(xsk->prog_fd);
+    if (xsk->map_fd >= 0)
+        close(xsk->map_fd);
+
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->map_fd = xsk->prog_fd = xsk->link_fd = -1;
+}
+
+/*
+ * Capture the PROFINET frames of if_name through AF_XDP, with a UMEM of
+ * umem_len bytes per RX queue. Returns -1 with errno set when AF_XDP is
+ * not usable in the requested mode, the caller keeps its AF_PACKET socket.
+ */
+int pnt_xsk_open(struct pnt_xsk *xsk, const char *if_name, int if_index, enum pnt_xsk_mode mode, size_t umem_len)
+{
+    unsigned int size = 1;
+    int err;
+
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->map_fd = xsk->prog_fd = xsk->link_fd = -1;
+
+    /* rings are powers of two, and so is the UMEM that backs them */
+    while ((size_t)size * 2 * PNT_XSK_FRAME_SIZE <= umem_len)
+        size *= 2;
+    if (size < 64)
+        size = 64;
+
+    xsk->map_fd = pnt_xsk_create_map();
+    if (xsk->map_fd < 0)
+    {
+        pnt_debug("pnt_xsk_open: BPF_MAP_CREATE: %s", strerror(errno));
+        goto fail;
+    }
+    xsk->prog_fd = pnt_xsk_load_prog(xsk->map_fd);
+    if (xsk->prog_fd < 0)
+    {
+        pnt_debug("pnt_xsk_open: BPF_PROG_LOAD: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (mode != PNT_XSK_GENERIC)
+    {
+        xsk->link_fd = pnt_xsk_attach(xsk->prog_fd, if_index, XDP_FLAGS_DRV_MODE);
+        if (xsk->link_fd < 0)
+        {
+            pnt_debug("pnt_xsk_open: %s: no XDP support in the driver: %s", if_name, strerror(errno));
+            if (mode != PNT_XSK_AUTO)
+                goto fail;
+        }
+    }
+    if (xsk->link_fd < 0)
+    {
+        xsk->generic = 1;
+        xsk->link_fd = pnt_xsk_attach(xsk->prog_fd, if_index, XDP_FLAGS_SKB_MODE);
+        if (xsk->link_fd < 0)
+        {
+            pnt_debug("pnt_xsk_open: %s: BPF_LINK_CREATE: %s", if_name, strerror(errno));
+            goto fail;
+        }
+    }
+
+    xsk->zerocopy = !xsk->generic && mode != PNT_XSK_NATIVE;
+    for (int count = pnt_xsk_queue_count(if_name); xsk->queue_count < count; xsk->queue_count++)
+    {
+        struct pnt_xsk_queue *q = &xsk->queues[xsk->queue_count];
+        unsigned int queue = xsk->queue_count;
+
+        if (xsk->zerocopy && pnt_xsk_queue_open(q, if_index, queue, size, 1) < 0)
+        {
+            pnt_debug("pnt_xsk_open: %s: queue %u: no zero-copy: %s", if_name, queue, strerror(errno));
+            if (mode == PNT_XSK_ZEROCOPY)
+                goto fail;
+            xsk->zerocopy = 0;
+        }
+        if (!xsk->zerocopy && pnt_xsk_queue_open(q, if_index, queue, size, 0) < 0)
+        {
+            pnt_debug("pnt_xsk_open: %s: queue %u: bind: %s", if_name, queue, strerror(errno));
+            goto fail;
+        }
+        if (pnt_xsk_map_update(xsk->map_fd, queue, q->fd) < 0)
+        {
+            pnt_debug("pnt_xsk_open: BPF_MAP_UPDATE_ELEM: %s", strerror(errno));
+            xsk->queue_count++;
+            goto fail;
+        }
+    }
+
+    pnt_print("%s: AF_XDP in %s mode%s, %d queue(s) of %u frames", if_name, xsk->generic ? "generic" : "driver",
+              xsk->zerocopy ? " with zero-copy" : "", xsk->queue_count, size);
+    return 0;
+
+fail:
+    err = errno;
+    pnt_xsk_close(xsk);
+    errno = err;
+    return -1;
+}
+
+/* Hand every frame the queue received to handler, then give the UMEM
+   frames back to the kernel */
+int pnt_xsk_dispatch(struct pnt_xsk_queue *q, pnt_frame_handler handler, void *arg)
+{
+    struct xdp_desc *descs = q->rx_descs;
+    unsigned int cons = *q->rx_consumer;
+    unsigned int prod = __atomic_load_n(q->rx_producer, __ATOMIC_ACQUIRE);
+    unsigned int fill = *q->fill_producer;
+    unsigned int mask = q->size - 1;
+    struct pnt_frame_info info;
+    struct timespec mono;
+    int64_t offset;
+    int frames = 0;
+
+    if (cons == prod)
+        return 0;
+
+    /* the program stamps frames with the monotonic clock, the handlers
+       want the realtime one */
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &info.ts);
+    info.vlan_tci = -1; //AF_XDP has no PACKET_AUXDATA
+    offset = ((int64_t)info.ts.tv_sec - mono.tv_sec) * 1000000000 + (info.ts.tv_nsec - mono.tv_nsec);
+
+    for (; cons != prod; cons++)
+    {
+        struct xdp_desc *desc = &descs[cons & mask];
+        char *frame = q->umem + desc->addr;
+        uint64_t *meta = NULL;
+
+        if ((desc->addr & (PNT_XSK_FRAME_SIZE - 1)) >= PNT_XSK_META_LEN)
+            meta = (uint64_t *)(frame - PNT_XSK_META_LEN);
+
+        struct pnt_frame_info frame_info = info;
+
+        if (meta != NULL && *meta != 0)
+        {
+            int64_t ns = (int64_t)*meta + offset;
+
+            frame_info.ts.tv_sec = ns / 1000000000;
+            frame_info.ts.tv_nsec = ns % 1000000000;
+        }
+
+        pnt_stats.frames_received++;
+        handler(frame, desc->len, &frame_info, arg);
+        frames++;
+
+        /* so a frame without a timestamp does not get the last user's */
+        if (meta != NULL)
+            *meta = 0;
+        q->fill_addrs[fill++ & mask] = desc->addr & ~(uint64_t)(PNT_XSK_FRAME_SIZE - 1);
+    }
+
+    __atomic_store_n(q->rx_consumer, cons, __ATOMIC_RELEASE);
+    __atomic_store_n(q->fill_producer, fill, __ATOMIC_RELEASE);
+
+    /* a zero-copy driver that ran out of frames waits for a kick */
+    if (__atomic_load_n(q->fill_flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+        recvfrom(q->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+    return frames;
+}
+
+/* Frames dropped since the last call, for lack of UMEM or RX ring space */
+unsigned int pnt_xsk_stats(struct pnt_xsk *xsk)
+{
+    unsigned int drops = 0;
+
+    for (int i = 0; i < xsk->queue_count; i++)
+    {
+        struct pnt_xsk_queue *q = &xsk->queues[i];
+        struct xdp_statistics stats;
+        socklen_t len = sizeof(stats);
+
+        /* unlike PACKET_STATISTICS these are totals */
+        if (getsockopt(q->fd, SOL_XDP, XDP_STATISTICS, &stats, &len) < 0)
+            continue;
+
+        uint64_t total = stats.rx_dropped + stats.rx_ring_full;
+
+        drops += total - q->drops;
+        q->drops = total;
+    }
+
+    pnt_stats.kernel_drops += drops;
+    return drops;
+}
+
+#else /* !PNT_AF_XDP */
+
+int pnt_xsk_open(struct pnt_xsk *xsk, const char *if_name, int if_index, enum pnt_xsk_mode mode, size_t umem_len)
+{
+    (void)if_name, (void)if_index, (void)mode, (void)umem_len;
+    memset(xsk, 0, sizeof(*xsk));
+    errno = ENOSYS;
+    return -1;
+}
+
+void pnt_xsk_close(struct pnt_xsk *xsk)
+{
+    (void)xsk;
+}
+
+int pnt_xsk_dispatch(struct pnt_xsk_queue *q, pnt_frame_handler handler, void *arg)
+{
+    (void)q, (void)handler, (void)arg;
+    return 0;
+}
+
+unsigned int pnt_xsk_stats(struct pnt_xsk *xsk)
+{
+    (void)xsk;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+  Copyright: (c) 2019-2020, ST-One Ltda., Guilherme Francescon Cittolin <gguilherme.francescon@st-one.io>
+  GNU General Public License v3.0+ (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+*/
+
+#ifndef __PNT_XSK__
+#define __PNT_XSK__
+
+#include "common.h"
+
+/*
+ * AF_XDP receive backend. A small XDP program sends the PROFINET frames
+ * (ethertype 0x8892, also behind a VLAN tag) of every RX queue to an
+ * AF_XDP socket of that queue, everything else goes on to the kernel
+ * stack. The program is loaded and attached with raw bpf() calls through
+ * a BPF link, so it goes away with the process. Built only with
+ * PNT_AF_XDP (see the Makefile), pnt_xsk_open() fails otherwise.
+ */
+
+#define PNT_XSK_FRAME_SIZE 2048
+#define PNT_XSK_MAX_QUEUES 16
+
+enum pnt_xsk_mode
+{
+    PNT_XSK_AUTO,     //driver mode with zero-copy if possible, generic (SKB) mode otherwise
+    PNT_XSK_GENERIC,  //generic (SKB) mode, works on any interface, e.g. veth
+    PNT_XSK_NATIVE,   //driver mode, copying into the UMEM
+    PNT_XSK_ZEROCOPY, //driver mode, the NIC writes into the UMEM
+};
+
+/* A socket bound to one RX queue, with the UMEM it receives into */
+struct pnt_xsk_queue
+{
+    int fd;
+    unsigned int queue;
+    unsigned int size; //frames in the UMEM, also the size of the rings
+    char *umem;
+    size_t umem_len;
+    void *rx_map;
+    size_t rx_map_len;
+    unsigned int *rx_producer;
+    unsigned int *rx_consumer;
+    void *rx_descs; //struct xdp_desc
+    void *fill_map;
+    size_t fill_map_len;
+    unsigned int *fill_producer;
+    unsigned int *fill_flags;
+    uint64_t *fill_addrs;
+    uint64_t drops; //rx_dropped + rx_ring_full at the last pnt_xsk_stats()
+};
+
+struct pnt_xsk
+{
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    int generic;
+    int zerocopy;
+    int queue_count;
+    struct pnt_xsk_queue queues[PNT_XSK_MAX_QUEUES];
+};
+
+int pnt_xsk_open(struct pnt_xsk *xsk, const char *if_name, int if_index, enum pnt_xsk_mode mode, size_t umem_len);
+void pnt_xsk_close(struct pnt_xsk *xsk);
+int pnt_xsk_parse_mode(const char *mode);
+int pnt_xsk_dispatch(struct pnt_xsk_queue *q, pnt_frame_handler handler, void *arg);
+unsigned int pnt_xsk_stats(struct pnt_xsk *xsk);
+
+#endif